@@ -30,6 +30,10 @@ RETURNS boolean
 AS 'MODULE_PATHNAME', 'pg_sqlite_fs_remove'
 LANGUAGE C IMMUTABLE STRICT;
 
+-- With sqlite_fs.use_writer (pg_sqlite_fs in shared_preload_libraries), insert_file, delete_file,
+-- insert_entry and delete_entry don't write: they queue the row and return true (or nothing).
+-- The rows of the transaction are sent to the background writer of the database at COMMIT,
+-- and applied all or none: a write error makes the COMMIT fail. They are dropped on ROLLBACK.
 CREATE OR REPLACE FUNCTION insert_file(filename text, inode bigint,
                                        mountpoint text, relative_path text,
                                        header bytea, payload_size bigint, prepend bytea, append bytea)
@@ -86,3 +90,177 @@ RETURNS boolean
 AS 'MODULE_PATHNAME', 'pg_sqlite_fs_insert_entries'
 LANGUAGE C IMMUTABLE STRICT;
 -- STRICT  = NULL parameters return NULL immediately
+
+CREATE OR REPLACE FUNCTION build(path text, entries text, files text DEFAULT NULL)
+RETURNS boolean
+AS 'MODULE_PATHNAME', 'pg_sqlite_fs_build'
+LANGUAGE C;
+-- Builds the database in a temporary file and renames it over path
+
+CREATE OR REPLACE FUNCTION build_in_memory(path text, entries text, files text DEFAULT NULL)
+RETURNS boolean
+AS 'MODULE_PATHNAME', 'pg_sqlite_fs_build_in_memory'
+LANGUAGE C;
+-- Same as build, in memory up to sqlite_fs.max_memory_build
+
+CREATE OR REPLACE FUNCTION build_bytea(entries text, files text DEFAULT NULL)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'pg_sqlite_fs_build_bytea'
+LANGUAGE C;
+-- Same as build_in_memory, returning the database instead of writing it
+
+CREATE OR REPLACE FUNCTION insert_entries_array(text, inodes bigint[], names text[], parents bigint[],
+                                                ctimes  bigint[]  DEFAULT NULL,
+                                                mtimes  bigint[]  DEFAULT NULL,
+                                                nlinks  bigint[]  DEFAULT NULL,
+                                                sizes   bigint[]  DEFAULT NULL,
+                                                is_dirs boolean[] DEFAULT NULL)
+RETURNS boolean
+AS 'MODULE_PATHNAME', 'pg_sqlite_fs_insert_entries_array'
+LANGUAGE C; -- NO STRICT
+
+CREATE OR REPLACE FUNCTION sqlite_fs_entries_agg_transfn(internal, text, record)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'pg_sqlite_fs_entries_agg_transfn'
+LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION sqlite_fs_entries_agg_finalfn(internal)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'pg_sqlite_fs_entries_agg_finalfn'
+LANGUAGE C;
+
+CREATE AGGREGATE sqlite_fs_entries_agg(text, record) (
+  SFUNC = sqlite_fs_entries_agg_transfn,
+  STYPE = internal,
+  FINALFUNC = sqlite_fs_entries_agg_finalfn,
+  FINALFUNC_MODIFY = READ_WRITE
+);
+-- SELECT sqlite_fs_entries_agg('/x.db', e) FROM my_entries e;
+-- Same fields as insert_entries. Returns the number of inserted entries.
+-- One path per group, and one group at a time per path.
+
+CREATE OR REPLACE FUNCTION sync_entries(path text, changes text, watermark bigint, inodes text DEFAULT NULL)
+RETURNS boolean
+AS 'MODULE_PATHNAME', 'pg_sqlite_fs_sync_entries'
+LANGUAGE C;
+-- changes gets the previous watermark as $1 (0 the first time): SELECT ... WHERE mtime > $1
+-- inodes lists all the inodes of the source: the entries not in it are deleted
+
+CREATE OR REPLACE FUNCTION sqlite_fs_sync_trigger()
+RETURNS trigger
+AS 'MODULE_PATHNAME', 'pg_sqlite_fs_sync_trigger'
+LANGUAGE C;
+-- CREATE TRIGGER ... AFTER INSERT OR UPDATE OR DELETE ON my_entries FOR EACH ROW
+--   EXECUTE FUNCTION sqlite_fs_sync_trigger('/path/to/db' or path_column [, 'entries' or 'files']);
+-- The changes are applied to the SQLite database when the transaction commits
+
+CREATE OR REPLACE FUNCTION build_many(jobs text, workers int DEFAULT 4,
+                                      OUT path text, OUT ok boolean, OUT ms double precision)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_sqlite_fs_build_many'
+LANGUAGE C;
+-- jobs: a query returning (path, entries, files), as the arguments of build()
+-- The jobs run in background workers, in their own transactions: they only see committed data
+
+CREATE OR REPLACE FUNCTION checkpoint(path text, mode text DEFAULT 'PASSIVE',
+                                      OUT busy boolean, OUT log int, OUT checkpointed int)
+RETURNS record
+AS 'MODULE_PATHNAME', 'pg_sqlite_fs_checkpoint'
+LANGUAGE C;
+-- For the databases in WAL mode (sqlite_fs.journal_mode = wal at make() time)
+-- mode: PASSIVE, FULL, RESTART or TRUNCATE
+
+CREATE OR REPLACE FUNCTION delete_subtree(path text, inode bigint)
+RETURNS SETOF bigint
+AS 'MODULE_PATHNAME', 'pg_sqlite_fs_delete_subtree'
+LANGUAGE C;
+-- Deletes the entry, all the entries below it, and their files and extended attributes
+-- Returns the deleted inodes
+
+CREATE OR REPLACE FUNCTION delete_entries(path text, inodes bigint[])
+RETURNS boolean
+AS 'MODULE_PATHNAME', 'pg_sqlite_fs_delete_entries_array'
+LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION delete_files(path text, inodes bigint[])
+RETURNS boolean
+AS 'MODULE_PATHNAME', 'pg_sqlite_fs_delete_files_array'
+LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION delete_entries(path text, inodes text)
+RETURNS boolean
+AS 'MODULE_PATHNAME', 'pg_sqlite_fs_delete_entries_query'
+LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION delete_files(path text, inodes text)
+RETURNS boolean
+AS 'MODULE_PATHNAME', 'pg_sqlite_fs_delete_files_query'
+LANGUAGE C;
+-- inodes: an array, or a query returning the inodes (bigint) in its first column
+-- In one transaction. The entries are deleted with their files and extended attributes.
+
+CREATE OR REPLACE FUNCTION reset(path text)
+RETURNS boolean
+AS 'MODULE_PATHNAME', 'pg_sqlite_fs_reset'
+LANGUAGE C;
+-- Replaces the database with an empty one (renamed over it), instead of deleting its content
+-- The new database gets sqlite_fs.journal_mode, as with make()
+
+CREATE OR REPLACE FUNCTION insert_attributes(path text, sql text, bulk boolean DEFAULT true)
+RETURNS boolean
+AS 'MODULE_PATHNAME', 'pg_sqlite_fs_insert_attributes'
+LANGUAGE C;
+-- sql returns (inode bigint, name text, value text)
+-- bulk: without the per-row triggers, the entries are updated once at the end
+
+CREATE OR REPLACE FUNCTION readdir(path text, parent_inode bigint,
+                                   OUT inode bigint, OUT name text, OUT is_dir boolean, OUT size bigint, OUT mtime bigint)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_sqlite_fs_readdir'
+LANGUAGE C STRICT;
+-- The entries of a directory, sorted by name (using the names index)
+-- The rows are streamed in the select list only: SELECT readdir('db', 1) LIMIT 10 reads 10 of them,
+-- while SELECT * FROM readdir('db', 1) LIMIT 10 reads them all first (the function scan stores them)
+
+CREATE OR REPLACE FUNCTION lookup(path text, fspath text,
+                                  OUT inode bigint, OUT is_dir boolean, OUT size bigint,
+                                  OUT ctime bigint, OUT mtime bigint, OUT nlink int)
+RETURNS record
+AS 'MODULE_PATHNAME', 'pg_sqlite_fs_lookup'
+LANGUAGE C STRICT;
+-- Resolves an absolute path, eg '/a/b/c/file.c4gh', from the root: NULL if not found
+-- The resolved components are cached in the backend, see sqlite_fs.dentry_cache_size
+
+CREATE OR REPLACE FUNCTION sqlite_fs_fdw_handler()
+RETURNS fdw_handler
+AS 'MODULE_PATHNAME', 'pg_sqlite_fs_fdw_handler'
+LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION sqlite_fs_fdw_validator(text[], oid)
+RETURNS void
+AS 'MODULE_PATHNAME', 'pg_sqlite_fs_fdw_validator'
+LANGUAGE C STRICT;
+
+CREATE FOREIGN DATA WRAPPER sqlite_fs
+  HANDLER sqlite_fs_fdw_handler
+  VALIDATOR sqlite_fs_fdw_validator;
+-- CREATE SERVER fs FOREIGN DATA WRAPPER sqlite_fs OPTIONS (database '/path/below/sqlite_fs.location/db.sqlite');
+-- IMPORT FOREIGN SCHEMA main FROM SERVER fs INTO some_schema; -- entries, files and extended_attributes
+-- Table options: database (overrides the server's), table (the SQLite table, default: the foreign table name)
+-- The conditions on the columns (eg inode, parent_inode, name) and the LIMIT are run by SQLite
+
+CREATE OR REPLACE FUNCTION sqlite_fs_query(path text, sql text, VARIADIC params "any")
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_sqlite_fs_query'
+LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION sqlite_fs_query(path text, sql text)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_sqlite_fs_query'
+LANGUAGE C;
+-- One read-only statement, with ? (or ?1, :name, etc) parameters, bound in order
+-- No ATTACH, DETACH, BEGIN, SAVEPOINT, nor PRAGMA with a value (PRAGMA page_size is fine)
+-- SELECT * FROM sqlite_fs_query('/location/db.sqlite', 'SELECT inode, name FROM entries WHERE parent_inode = ?', 1)
+--   AS t(inode bigint, name text);
+-- The rows are converted to the types of the column definition list
+-- In FROM, they are all read before a LIMIT applies: put the LIMIT in the SQLite statement
@@ -0,0 +1,21 @@
+SET client_min_messages = warning;
+\set db '/tmp/pg_sqlite_fs_regress_agg.sqlite'
+\set other '/tmp/pg_sqlite_fs_regress_agg_other.sqlite'
+CREATE TABLE regress_agg(inode bigint, name text, parent bigint, ctime bigint, mtime bigint,
+                         nlink int, size bigint, is_dir boolean);
+INSERT INTO regress_agg SELECT i, 'n' || i, 1, 0, 0, 1, 0, false FROM generate_series(2, 4) i;
+SELECT make(:'db'), make(:'other');
+-- One path per group: the rows of the first one are rolled back
+SELECT sqlite_fs_entries_agg(CASE WHEN inode = 4 THEN :'other' ELSE :'db' END, e) FROM regress_agg e;
+SELECT sqlite_fs_entries_agg(:'db', e) FROM regress_agg e;
+SELECT * FROM regress_counts(:'db');
+-- One group at a time per path: the hashed groups are all open together
+SET enable_sort = off;
+SELECT inode, sqlite_fs_entries_agg(:'other', e) FROM regress_agg e GROUP BY inode;
+RESET enable_sort;
+SET enable_hashagg = off;
+SELECT inode, sqlite_fs_entries_agg(:'other', e) FROM regress_agg e GROUP BY inode ORDER BY inode;
+RESET enable_hashagg;
+SELECT * FROM regress_counts(:'other');
+DROP TABLE regress_agg;
+SELECT remove(:'db'), remove(:'other');
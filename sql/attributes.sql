@@ -0,0 +1,18 @@
+SET client_min_messages = warning;
+\set bulk '/tmp/pg_sqlite_fs_regress_bulk.sqlite'
+\set rows '/tmp/pg_sqlite_fs_regress_rows.sqlite'
+SELECT regress_tree(:'bulk') AND regress_tree(:'rows');
+SELECT insert_attributes(:'bulk', $$ SELECT inode::bigint, 'user.' || k, v FROM (VALUES (2, 'x', '1'), (4, 'x', '2'), (4, 'y', '3')) t(inode, k, v) $$);
+SELECT insert_attributes(:'rows', $$ SELECT inode::bigint, 'user.' || k, v FROM (VALUES (2, 'x', '1'), (4, 'x', '2'), (4, 'y', '3')) t(inode, k, v) $$, bulk => false);
+-- the same entries are touched, with or without the triggers
+SELECT b.inode, b.touched AS bulk, r.touched AS rows
+  FROM sqlite_fs_query(:'bulk', 'SELECT inode, mtime > 0 FROM entries') AS b(inode bigint, touched boolean)
+  JOIN sqlite_fs_query(:'rows', 'SELECT inode, mtime > 0 FROM entries') AS r(inode bigint, touched boolean) USING (inode)
+  ORDER BY inode;
+-- the triggers are back
+SELECT * FROM sqlite_fs_query(:'bulk', $$SELECT name FROM sqlite_master WHERE type = 'trigger' ORDER BY name$$) AS t(name text);
+-- upserts
+SELECT insert_attributes(:'bulk', $$ SELECT 4::bigint, 'user.y', 'z' $$);
+SELECT * FROM sqlite_fs_query(:'bulk', 'SELECT inode, name, value FROM extended_attributes ORDER BY inode, name')
+  AS t(inode bigint, name text, value text);
+SELECT remove(:'bulk') AND remove(:'rows');
@@ -0,0 +1,25 @@
+SET client_min_messages = warning;
+\set db '/tmp/pg_sqlite_fs_regress_build.sqlite'
+-- Builds over a database in WAL mode, with rows in its WAL:
+-- the WAL is checkpointed before the rename, and not paired with the new file
+SET sqlite_fs.journal_mode = wal;
+SELECT make(:'db');
+SELECT insert_entry(:'db', 2, 'old', 1);
+SELECT * FROM sqlite_fs_query(:'db', 'SELECT name FROM entries WHERE inode = 2') AS t(name text);
+SELECT regress_tree(:'db');
+SELECT name FROM readdir(:'db', 1);
+SELECT * FROM sqlite_fs_query(:'db', 'PRAGMA journal_mode') AS t(mode text);
+SELECT insert_entry(:'db', 8, 'new', 1);
+SELECT build_in_memory(:'db', $$ SELECT 2::bigint, 'only', 1::bigint, 0::bigint, 0::bigint, 1, 0::bigint, true $$);
+SELECT name FROM readdir(:'db', 1);
+SELECT * FROM sqlite_fs_query(:'db', 'PRAGMA journal_mode') AS t(mode text);
+-- reset() publishes an empty database in the same way, with the root only
+SELECT reset(:'db');
+SELECT * FROM sqlite_fs_query(:'db', 'SELECT inode, name FROM entries') AS t(inode bigint, name text);
+SELECT * FROM sqlite_fs_query(:'db', 'PRAGMA journal_mode') AS t(mode text);
+-- truncate_entries() keeps the root
+SELECT insert_entry(:'db', 2, 'a', 1);
+SELECT truncate_entries(:'db');
+SELECT * FROM sqlite_fs_query(:'db', 'SELECT inode, name FROM entries') AS t(inode bigint, name text);
+RESET sqlite_fs.journal_mode;
+SELECT remove(:'db');
@@ -0,0 +1,37 @@
+SET client_min_messages = warning;
+\set db '/tmp/pg_sqlite_fs_regress_deletes.sqlite'
+SELECT regress_tree(:'db');
+SELECT insert_attributes(:'db', $$ SELECT i::bigint, 'user.k', 'v' FROM generate_series(2, 7) i $$);
+SELECT * FROM regress_counts(:'db');
+-- delete_subtree: /a and below
+SELECT * FROM delete_subtree(:'db', 2);
+SELECT * FROM regress_counts(:'db');
+SELECT * FROM sqlite_fs_query(:'db', 'SELECT inode FROM entries ORDER BY inode') AS t(inode bigint);
+-- delete_entries, from an array
+SELECT regress_tree(:'db') AND
+       insert_attributes(:'db', $$ SELECT i::bigint, 'user.k', 'v' FROM generate_series(2, 7) i $$);
+SELECT delete_entries(:'db', ARRAY[4, 5]::bigint[]);
+SELECT * FROM regress_counts(:'db');
+-- delete_entries, from a query
+SELECT regress_tree(:'db') AND
+       insert_attributes(:'db', $$ SELECT i::bigint, 'user.k', 'v' FROM generate_series(2, 7) i $$);
+SELECT delete_entries(:'db', 'SELECT 3::bigint UNION ALL SELECT 7');
+SELECT * FROM regress_counts(:'db');
+-- delete_files: the entries and their attributes stay
+SELECT regress_tree(:'db') AND
+       insert_attributes(:'db', $$ SELECT i::bigint, 'user.k', 'v' FROM generate_series(2, 7) i $$);
+SELECT delete_files(:'db', ARRAY[4]::bigint[]);
+SELECT * FROM regress_counts(:'db');
+SELECT delete_files(:'db', 'SELECT 5::bigint');
+SELECT * FROM regress_counts(:'db');
+SELECT * FROM sqlite_fs_query(:'db', 'SELECT inode FROM files') AS t(inode bigint);
+-- sync_entries: the inodes not in the source are deleted
+SELECT regress_tree(:'db') AND
+       insert_attributes(:'db', $$ SELECT i::bigint, 'user.k', 'v' FROM generate_series(2, 7) i $$);
+SELECT sync_entries(:'db',
+  $$ SELECT 2::bigint, 'a', 1::bigint, 0::bigint, $1, 1, 0::bigint, true $$,
+  100,
+  $$ SELECT i::bigint FROM generate_series(1, 3) i $$);
+SELECT * FROM regress_counts(:'db');
+SELECT * FROM sqlite_fs_query(:'db', $$SELECT value FROM metadata WHERE key = 'entries.watermark'$$) AS t(watermark bigint);
+SELECT remove(:'db');
@@ -0,0 +1,21 @@
+SET client_min_messages = warning;
+\set db '/tmp/pg_sqlite_fs_regress_fdw.sqlite'
+SELECT regress_tree(:'db');
+CREATE SERVER regress_fs FOREIGN DATA WRAPPER sqlite_fs OPTIONS (database :'db');
+CREATE SCHEMA regress_fdw;
+IMPORT FOREIGN SCHEMA main LIMIT TO (entries) FROM SERVER regress_fs INTO regress_fdw;
+-- The comparisons with constants, and then the LIMIT, are run by SQLite
+EXPLAIN (VERBOSE, COSTS OFF)
+  SELECT inode, name FROM regress_fdw.entries WHERE parent_inode = 2 LIMIT 1;
+SELECT inode, name FROM regress_fdw.entries WHERE parent_inode = 2 AND inode <> 3;
+-- Not the LIMIT above a filter run by PostgreSQL
+EXPLAIN (VERBOSE, COSTS OFF)
+  SELECT inode, name FROM regress_fdw.entries WHERE name LIKE 'b%' LIMIT 1;
+SELECT inode, name FROM regress_fdw.entries WHERE name LIKE 'b%' ORDER BY inode;
+-- Nor above a sort
+EXPLAIN (VERBOSE, COSTS OFF)
+  SELECT inode FROM regress_fdw.entries WHERE inode > 4 ORDER BY inode DESC LIMIT 1;
+SELECT inode FROM regress_fdw.entries WHERE inode > 4 ORDER BY inode DESC LIMIT 1;
+DROP SCHEMA regress_fdw CASCADE;
+DROP SERVER regress_fs;
+SELECT remove(:'db');
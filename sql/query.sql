@@ -0,0 +1,28 @@
+SET client_min_messages = warning;
+\set db '/tmp/pg_sqlite_fs_regress_query.sqlite'
+SELECT regress_tree(:'db');
+-- The parameters, bound in order with their types
+SELECT * FROM sqlite_fs_query(:'db',
+  'SELECT inode, name FROM entries WHERE parent_inode = ? AND inode <> parent_inode ORDER BY name', 1)
+  AS t(inode bigint, name text);
+SELECT * FROM sqlite_fs_query(:'db', 'SELECT ?1, typeof(?1), ?2, typeof(?2), ?3, typeof(?3), typeof(?4), typeof(?5)',
+  42, 'x'::text, 1.5::float8, '\x0102'::bytea, NULL::int)
+  AS t(i int, ti text, s text, ts text, f float8, tf text, tb text, tn text);
+SELECT * FROM sqlite_fs_query(:'db', 'SELECT ?, ?', 1) AS t(a int, b int);
+-- The values, converted to the column definition list
+SELECT * FROM sqlite_fs_query(:'db', $$SELECT 1, 7, 3000000000, 2.5, '12.50', X'6869', NULL$$)
+  AS t(b boolean, s smallint, big bigint, f float8, n numeric, h bytea, z text);
+SELECT * FROM sqlite_fs_query(:'db', 'SELECT 3000000000 AS big') AS t(i int);
+SELECT * FROM sqlite_fs_query(:'db', 'SELECT 1, 2') AS t(a int);
+-- Only one read-only statement
+SELECT * FROM sqlite_fs_query(:'db', 'DELETE FROM entries') AS t(n int);
+SELECT * FROM sqlite_fs_query(:'db', 'SELECT 1; SELECT 2') AS t(n int);
+SELECT * FROM sqlite_fs_query(:'db', 'BEGIN') AS t(n int);
+SELECT * FROM sqlite_fs_query(:'db', 'SAVEPOINT s') AS t(n int);
+SELECT * FROM sqlite_fs_query(:'db', $$ATTACH '/tmp/pg_sqlite_fs_regress_other.sqlite' AS other$$) AS t(n int);
+-- PRAGMA: to read a setting, not to change the handle shared with the other functions
+SELECT * FROM sqlite_fs_query(:'db', 'PRAGMA locking_mode = EXCLUSIVE') AS t(mode text);
+SELECT * FROM sqlite_fs_query(:'db', 'PRAGMA busy_timeout = 0') AS t(ms int);
+SELECT * FROM sqlite_fs_query(:'db', 'PRAGMA locking_mode') AS t(mode text);
+SELECT count(*) FROM sqlite_fs_query(:'db', 'SELECT inode FROM entries') AS t(inode bigint);
+SELECT remove(:'db');
@@ -0,0 +1,24 @@
+SET client_min_messages = warning;
+\set db '/tmp/pg_sqlite_fs_regress_tree.sqlite'
+SELECT regress_tree(:'db');
+-- sorted by name, without the root itself
+SELECT inode, name, is_dir, size FROM readdir(:'db', 1);
+SELECT inode, name, is_dir, size FROM readdir(:'db', 2);
+-- in the target list, the rows are streamed: the scan stops after 2
+SELECT (readdir(:'db', 1)).name LIMIT 2;
+SELECT count(*) FROM readdir(:'db', 4);
+-- nested, while the outer scan runs: the inner ones use a private statement
+SELECT (r).name,
+       coalesce((SELECT string_agg(e.name, ',' ORDER BY e.name) FROM readdir(:'db', (r).inode) e), '-') AS children
+  FROM (SELECT readdir(:'db', 1) AS r) s;
+-- the second /a/b/file is resolved from the cache
+SELECT p, coalesce((lookup(:'db', p)).inode::text, 'not found') AS inode
+  FROM unnest(ARRAY['/', '/a', '/a/b/file', '/a/b/file', '/a/b/..', '/a/b/../c',
+                    '/a/./b//file', '/zeta/x', '/zeta/..', '/nope']) WITH ORDINALITY AS t(p, i)
+  ORDER BY i;
+SELECT inode, is_dir, size, nlink FROM lookup(:'db', '/a/b/file');
+-- the cache sees the changes
+SELECT * FROM delete_subtree(:'db', 3);
+SELECT coalesce((lookup(:'db', '/a/b/file')).inode::text, 'not found') AS inode;
+SELECT name FROM readdir(:'db', 2);
+SELECT remove(:'db');
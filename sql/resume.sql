@@ -0,0 +1,25 @@
+SET client_min_messages = warning;
+\set db '/tmp/pg_sqlite_fs_regress_resume.sqlite'
+\set query 'SELECT inode, name, 1::bigint, 0::bigint, 0::bigint, 1, 0::bigint, false FROM regress_source'
+CREATE TABLE regress_source AS
+  SELECT i::bigint AS inode, CASE WHEN i = 7 THEN NULL ELSE 'n' || i END AS name
+  FROM generate_series(2, 10) i;
+-- Committed every 2 rows: interrupted at the NULL name, after the checkpoint at inode 5
+SET sqlite_fs.commit_every = 2;
+SELECT make(:'db');
+SELECT insert_entries(:'db', :'query');
+SELECT * FROM sqlite_fs_query(:'db', 'SELECT count(*), max(inode) FROM entries') AS t(n bigint, last bigint);
+-- The checkpoint is not for another query
+SELECT insert_entries(:'db', :'query' || ' WHERE name IS NOT NULL');
+-- The same query resumes after it
+UPDATE regress_source SET name = 'n7' WHERE inode = 7;
+SELECT insert_entries(:'db', :'query');
+SELECT * FROM sqlite_fs_query(:'db', 'SELECT count(*), max(inode) FROM entries') AS t(n bigint, last bigint);
+SELECT * FROM sqlite_fs_query(:'db', 'SELECT count(*) FROM metadata') AS t(n bigint);
+-- A trailing comment does not swallow the wrapping of the query
+SELECT truncate_entries(:'db');
+SELECT insert_entries(:'db', :'query' || ' -- all of them');
+SELECT * FROM sqlite_fs_query(:'db', 'SELECT count(*), max(inode) FROM entries') AS t(n bigint, last bigint);
+RESET sqlite_fs.commit_every;
+DROP TABLE regress_source;
+SELECT remove(:'db');
@@ -0,0 +1,29 @@
+--
+-- The databases of the tests are in /tmp: sqlite_fs.location can only be set from a file
+--
+CREATE EXTENSION pg_sqlite_fs;
+LOAD 'pg_sqlite_fs';
+ALTER SYSTEM SET sqlite_fs.location = '/tmp';
+SELECT pg_reload_conf();
+DO $$ BEGIN PERFORM pg_sleep(1); END $$;
+SHOW sqlite_fs.location;
+--
+-- A small tree, for the other tests:
+--   /a/b/file, /a/c, /beta/, /zeta
+-- with the files of file, c and zeta, and one attribute per entry
+--
+CREATE FUNCTION regress_tree(db text) RETURNS boolean LANGUAGE sql AS $f$
+  SELECT build(db,
+    $$ SELECT inode::bigint, name, parent::bigint, 0::bigint, 0::bigint, 1, size::bigint, is_dir
+         FROM (VALUES (2, 'a', 1, 0, true), (3, 'b', 2, 0, true), (4, 'file', 3, 10, false),
+                      (5, 'zeta', 1, 5, false), (6, 'beta', 1, 0, true), (7, 'c', 2, 3, false))
+              AS t(inode, name, parent, size, is_dir) $$,
+    $$ SELECT inode::bigint, 'mnt', 'rel/' || inode, NULL::bytea, 0::bigint, NULL::bytea, NULL::bytea
+         FROM (VALUES (4), (5), (7)) AS t(inode) $$)
+$f$;
+CREATE FUNCTION regress_counts(db text, OUT entries bigint, OUT files bigint, OUT attributes bigint)
+LANGUAGE sql AS $f$
+  SELECT * FROM sqlite_fs_query(db,
+    'SELECT (SELECT count(*) FROM entries), (SELECT count(*) FROM files), (SELECT count(*) FROM extended_attributes)')
+    AS t(entries bigint, files bigint, attributes bigint)
+$f$;
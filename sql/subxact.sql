@@ -0,0 +1,35 @@
+SET client_min_messages = warning;
+\set db '/tmp/pg_sqlite_fs_regress_subxact.sqlite'
+SELECT regress_tree(:'db');
+-- An error inside the SQLite transaction, caught by an EXCEPTION block:
+-- the subtransaction abort rolls the SQLite one back, and the handle can be used again
+CREATE FUNCTION regress_caught(db text) RETURNS text LANGUAGE plpgsql AS $f$
+BEGIN
+  PERFORM insert_attributes(db, $$ SELECT 2::bigint, 'user.k', (1 / (random() * 0)::int)::text $$);
+  RETURN 'not caught';
+EXCEPTION WHEN division_by_zero THEN
+  RETURN 'caught';
+END
+$f$;
+BEGIN;
+SELECT regress_caught(:'db');
+SELECT insert_attributes(:'db', $$ SELECT 4::bigint, 'user.k', 'v' $$);
+COMMIT;
+SELECT * FROM regress_counts(:'db');
+SELECT * FROM sqlite_fs_query(:'db', $$SELECT name FROM sqlite_master WHERE type = 'trigger' ORDER BY name$$) AS t(name text);
+-- Same with a savepoint
+BEGIN;
+SAVEPOINT s;
+SELECT insert_attributes(:'db', $$ SELECT 2::bigint, 'user.k', (1 / (random() * 0)::int)::text $$);
+ROLLBACK TO SAVEPOINT s;
+SELECT insert_attributes(:'db', $$ SELECT 5::bigint, 'user.k', 'v' $$);
+COMMIT;
+SELECT * FROM regress_counts(:'db');
+SELECT * FROM sqlite_fs_query(:'db', 'SELECT inode, name, value FROM extended_attributes ORDER BY inode')
+  AS t(inode bigint, name text, value text);
+-- The nlinks are checked before the SQLite transaction is opened
+SELECT insert_entries_array(:'db', '{10,11}', '{x,y}', '{1,1}', nlinks => '{1,3000000000}');
+SELECT insert_entries_array(:'db', '{10}', '{x}', '{1}');
+SELECT * FROM regress_counts(:'db');
+DROP FUNCTION regress_caught(text);
+SELECT remove(:'db');
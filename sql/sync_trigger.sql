@@ -0,0 +1,37 @@
+SET client_min_messages = warning;
+\set db '/tmp/pg_sqlite_fs_regress_sync.sqlite'
+SELECT make(:'db');
+CREATE TABLE regress_entries (inode bigint, name text, parent_inode bigint,
+  ctime bigint DEFAULT 0, mtime bigint DEFAULT 0, nlink int DEFAULT 1, size bigint DEFAULT 0, is_dir boolean DEFAULT true);
+CREATE TRIGGER regress_sync AFTER INSERT OR UPDATE OR DELETE ON regress_entries
+  FOR EACH ROW EXECUTE FUNCTION sqlite_fs_sync_trigger(:'db');
+CREATE VIEW regress_synced AS
+  SELECT * FROM sqlite_fs_query('/tmp/pg_sqlite_fs_regress_sync.sqlite',
+    'SELECT inode, name, parent_inode FROM entries WHERE inode > 1 ORDER BY inode')
+    AS t(inode bigint, name text, parent_inode bigint);
+INSERT INTO regress_entries(inode, name, parent_inode) VALUES (2, 'a', 1), (3, 'b', 2), (4, 'c', 2);
+SELECT * FROM regress_synced;
+-- Applied at commit: nothing on rollback
+BEGIN;
+INSERT INTO regress_entries(inode, name, parent_inode) VALUES (5, 'rolled back', 1);
+ROLLBACK;
+SELECT * FROM regress_synced;
+-- The row of a directory: that entry only, its children are still rows
+DELETE FROM regress_entries WHERE inode = 2;
+SELECT * FROM regress_synced;
+-- Moved to another inode: the old entry only
+UPDATE regress_entries SET inode = 6 WHERE inode = 3;
+SELECT * FROM regress_synced;
+-- The changes of a rolled back subtransaction are dropped
+BEGIN;
+INSERT INTO regress_entries(inode, name, parent_inode) VALUES (7, 'kept', 1);
+SAVEPOINT s;
+INSERT INTO regress_entries(inode, name, parent_inode) VALUES (8, 'dropped', 1);
+ROLLBACK TO SAVEPOINT s;
+COMMIT;
+SELECT * FROM regress_synced;
+UPDATE regress_entries SET inode = NULL WHERE inode = 7;
+SELECT * FROM regress_synced;
+DROP VIEW regress_synced;
+DROP TABLE regress_entries;
+SELECT remove(:'db');
@@ -0,0 +1,5 @@
+DROP FUNCTION regress_tree(text);
+DROP FUNCTION regress_counts(text);
+ALTER SYSTEM RESET sqlite_fs.location;
+SELECT pg_reload_conf();
+DROP EXTENSION pg_sqlite_fs;
@@ -11,6 +11,7 @@
  *-------------------------------------------------------------------------
  */
 
+#include <ctype.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -20,10 +21,57 @@
 #include "utils/guc.h"
 
 #include "funcapi.h"
+#include "access/htup_details.h"
+#include "access/reloptions.h"
+#include "access/sysattr.h"
+#include "access/table.h"
+#include "access/transam.h"
+#include "access/xact.h"
+#include "catalog/pg_foreign_server.h"
+#include "catalog/pg_foreign_table.h"
+#include "catalog/pg_type.h"
+#include "common/hashfn.h"
+#include "commands/defrem.h"
+#include "commands/explain.h"
+#include "commands/trigger.h"
 #include "executor/spi.h"
+#include "foreign/fdwapi.h"
+#include "foreign/foreign.h"
+#include "lib/ilist.h"
+#include "libpq/pqformat.h"
+#include "miscadmin.h"
+#include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#include "optimizer/cost.h"
+#include "optimizer/optimizer.h"
+#include "optimizer/pathnode.h"
+#include "optimizer/planmain.h"
+#include "optimizer/restrictinfo.h"
 #include "pgstat.h"
+#include "port/atomics.h"
+#include "portability/instr_time.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/dsm.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shm_mq.h"
+#include "storage/shm_toc.h"
+#include "storage/shmem.h"
+#include "tcop/tcopprot.h"
 #include "tcop/utility.h"
+#include "utils/array.h"
+#include "utils/datum.h"
+#include "utils/typcache.h"
+#include "utils/hsearch.h"
+#include "utils/lsyscache.h"
 #include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/resowner.h"
+#include "utils/snapmgr.h"
 
 #include "sqlite3.h"
 
@@ -42,12 +90,108 @@ PG_MODULE_MAGIC; /* only one time */
 #define D5(fmt, ...) elog(DEBUG5, "============ " fmt, ##__VA_ARGS__)
 
 #define SQLITE_FS_LOCATION "sqlite_fs.location"
+#define SQLITE_FS_MAX_CONNECTIONS "sqlite_fs.max_connections"
+#define SQLITE_FS_FETCH_SIZE "sqlite_fs.fetch_size"
+#define SQLITE_FS_SYNCHRONOUS "sqlite_fs.synchronous"
+#define SQLITE_FS_CACHE_SIZE "sqlite_fs.cache_size"
+#define SQLITE_FS_PAGE_SIZE "sqlite_fs.page_size"
+#define SQLITE_FS_TEMP_STORE "sqlite_fs.temp_store"
+#define SQLITE_FS_FAST_BUILD "sqlite_fs.fast_build"
+#define SQLITE_FS_BUILD_JOURNAL_MODE "sqlite_fs.build_journal_mode"
+#define SQLITE_FS_BUILD_SYNCHRONOUS "sqlite_fs.build_synchronous"
+#define SQLITE_FS_MAX_MEMORY_BUILD "sqlite_fs.max_memory_build"
+#define SQLITE_FS_DEFER_INDEX "sqlite_fs.defer_index"
+#define SQLITE_FS_SCHEMA_VERSION "sqlite_fs.schema_version"
+#define SQLITE_FS_SORTED_LOAD "sqlite_fs.sorted_load"
+#define SQLITE_FS_COMMIT_EVERY "sqlite_fs.commit_every"
+#define SQLITE_FS_USE_WRITER "sqlite_fs.use_writer"
+#define SQLITE_FS_JOURNAL_MODE "sqlite_fs.journal_mode"
+#define SQLITE_FS_BUSY_TIMEOUT "sqlite_fs.busy_timeout"
+#define SQLITE_FS_AUTO_VACUUM "sqlite_fs.auto_vacuum"
+#define SQLITE_FS_MAX_WRITERS "sqlite_fs.max_writers"
+#define SQLITE_FS_WRITER_IDLE_TIMEOUT "sqlite_fs.writer_idle_timeout"
+#define SQLITE_FS_DENTRY_CACHE_SIZE "sqlite_fs.dentry_cache_size"
 
 /* global settings */
 static char* pg_sqlite_fs_location = NULL;
+static int pg_sqlite_fs_max_connections = 16;
+static int pg_sqlite_fs_fetch_size = 10000;
+
+/* SQLite pragmas: the enum values are the ones of the pragmas */
+static const struct config_enum_entry synchronous_options[] = {
+  {"off", 0, false},
+  {"normal", 1, false},
+  {"full", 2, false},
+  {"extra", 3, false},
+  {NULL, 0, false}
+};
+
+static const struct config_enum_entry temp_store_options[] = {
+  {"default", 0, false},
+  {"file", 1, false},
+  {"memory", 2, false},
+  {NULL, 0, false}
+};
+
+static const struct config_enum_entry build_journal_mode_options[] = {
+  {"delete", 0, false},
+  {"truncate", 1, false},
+  {"persist", 2, false},
+  {"memory", 3, false},
+  /* no "off": a ROLLBACK without journal corrupts the database. Only the private builds go without */
+  {NULL, 0, false}
+};
+
+static const struct config_enum_entry journal_mode_options[] = {
+  {"delete", 0, false},
+  {"truncate", 1, false},
+  {"persist", 2, false},
+  {"wal", 3, false},
+  {NULL, 0, false}
+};
+
+static const struct config_enum_entry auto_vacuum_options[] = {
+  {"none", 0, false},
+  {"full", 1, false},
+  {"incremental", 2, false},
+  {NULL, 0, false}
+};
+
+static int pg_sqlite_fs_synchronous = 2; /* full */
+static int pg_sqlite_fs_cache_size = 2000; /* kB */
+static int pg_sqlite_fs_page_size = 4096;
+static int pg_sqlite_fs_temp_store = 0; /* default */
+static bool pg_sqlite_fs_fast_build = false;
+static int pg_sqlite_fs_build_journal_mode = 3; /* memory */
+static int pg_sqlite_fs_build_synchronous = 0; /* off */
+static int pg_sqlite_fs_max_memory_build = 262144; /* kB */
+static bool pg_sqlite_fs_defer_index = false;
+static int pg_sqlite_fs_schema_version = 1;
+static bool pg_sqlite_fs_sorted_load = false;
+static int pg_sqlite_fs_commit_every = 0;
+static bool pg_sqlite_fs_use_writer = false;
+static int pg_sqlite_fs_journal_mode = 0; /* delete */
+static int pg_sqlite_fs_busy_timeout = 1000; /* ms */
+static int pg_sqlite_fs_auto_vacuum = 0; /* none */
+static int pg_sqlite_fs_max_writers = 4;
+static int pg_sqlite_fs_writer_idle_timeout = 60; /* s */
+static int pg_sqlite_fs_dentry_cache_size = 10000;
 
 void _PG_init(void);
 static char * convert_and_check_path(text *arg);
+static void sqlite_fs_xact_callback(XactEvent event, void *arg);
+static void sqlite_fs_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+				       SubTransactionId parentSubid, void *arg);
+static void sqlite_fs_sync_xact_callback(XactEvent event, void *arg);
+static void sqlite_fs_writer_xact_callback(XactEvent event, void *arg);
+static void sqlite_fs_writer_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+					      SubTransactionId parentSubid, void *arg);
+static void sqlite_fs_sync_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+					    SubTransactionId parentSubid, void *arg);
+static void sqlite_fs_shmem_request(void);
+static void sqlite_fs_shmem_startup(void);
+PGDLLEXPORT void pg_sqlite_fs_writer_main(Datum main_arg);
+PGDLLEXPORT void pg_sqlite_fs_build_worker_main(Datum main_arg);
 
 static bool
 check_hook(char **newval, void **extra, GucSource source)
@@ -94,6 +238,17 @@ check_hook(char **newval, void **extra, GucSource source)
 }
 
 
+static bool
+check_page_size(int *newval, void **extra, GucSource source)
+{
+  if (*newval & (*newval - 1)){
+    GUC_check_errmsg("%s must be a power of two.", SQLITE_FS_PAGE_SIZE);
+    return false;
+  }
+  return true;
+}
+
+
 /*
  * This gets called when the library file is loaded.
  * Similar to dlopen
@@ -109,6 +264,209 @@ _PG_init(void)
 			     PGC_USERSET,
  			     0,
 			     check_hook, NULL, NULL);
+
+  DefineCustomIntVariable(SQLITE_FS_MAX_CONNECTIONS,
+			  gettext_noop("Maximum number of SQLite databases kept open by a backend."),
+			  gettext_noop("0 closes each database after use."),
+			  &pg_sqlite_fs_max_connections,
+			  16, 0, 1024,
+			  PGC_USERSET,
+			  0,
+			  NULL, NULL, NULL);
+
+  DefineCustomIntVariable(SQLITE_FS_FETCH_SIZE,
+			  gettext_noop("Number of rows fetched at a time by insert_entries and insert_files."),
+			  NULL,
+			  &pg_sqlite_fs_fetch_size,
+			  10000, 1, INT_MAX,
+			  PGC_USERSET,
+			  0,
+			  NULL, NULL, NULL);
+
+  DefineCustomEnumVariable(SQLITE_FS_SYNCHRONOUS,
+			   gettext_noop("SQLite synchronous setting of the opened databases."),
+			   NULL,
+			   &pg_sqlite_fs_synchronous,
+			   2, synchronous_options,
+			   PGC_USERSET,
+			   0,
+			   NULL, NULL, NULL);
+
+  DefineCustomIntVariable(SQLITE_FS_CACHE_SIZE,
+			  gettext_noop("SQLite page cache size of each opened database."),
+			  NULL,
+			  &pg_sqlite_fs_cache_size,
+			  2000, 64, INT_MAX,
+			  PGC_USERSET,
+			  GUC_UNIT_KB,
+			  NULL, NULL, NULL);
+
+  DefineCustomIntVariable(SQLITE_FS_PAGE_SIZE,
+			  gettext_noop("SQLite page size of the created databases."),
+			  NULL,
+			  &pg_sqlite_fs_page_size,
+			  4096, 512, 65536,
+			  PGC_USERSET,
+			  GUC_UNIT_BYTE,
+			  check_page_size, NULL, NULL);
+
+  DefineCustomEnumVariable(SQLITE_FS_TEMP_STORE,
+			   gettext_noop("Where SQLite stores its temporary tables and indices."),
+			   NULL,
+			   &pg_sqlite_fs_temp_store,
+			   0, temp_store_options,
+			   PGC_USERSET,
+			   0,
+			   NULL, NULL, NULL);
+
+  DefineCustomBoolVariable(SQLITE_FS_FAST_BUILD,
+			   gettext_noop("Relax the SQLite durability during insert_entries and insert_files."),
+			   gettext_noop("The settings are restored when the load is over."),
+			   &pg_sqlite_fs_fast_build,
+			   false,
+			   PGC_USERSET,
+			   0,
+			   NULL, NULL, NULL);
+
+  DefineCustomEnumVariable(SQLITE_FS_BUILD_JOURNAL_MODE,
+			   gettext_noop("SQLite journal mode used by the fast builds."),
+			   gettext_noop("build() and build_in_memory() write a private file, without journal."),
+			   &pg_sqlite_fs_build_journal_mode,
+			   3, build_journal_mode_options,
+			   PGC_USERSET,
+			   0,
+			   NULL, NULL, NULL);
+
+  DefineCustomEnumVariable(SQLITE_FS_BUILD_SYNCHRONOUS,
+			   gettext_noop("SQLite synchronous setting used by the fast builds."),
+			   NULL,
+			   &pg_sqlite_fs_build_synchronous,
+			   0, synchronous_options,
+			   PGC_USERSET,
+			   0,
+			   NULL, NULL, NULL);
+
+  DefineCustomIntVariable(SQLITE_FS_MAX_MEMORY_BUILD,
+			  gettext_noop("Maximum size of a database built in memory."),
+			  gettext_noop("Larger databases are built on disk."),
+			  &pg_sqlite_fs_max_memory_build,
+			  262144, 64, INT_MAX,
+			  PGC_USERSET,
+			  GUC_UNIT_KB,
+			  NULL, NULL, NULL);
+
+  DefineCustomBoolVariable(SQLITE_FS_DEFER_INDEX,
+			   gettext_noop("Build the names index after the rows are inserted by insert_entries."),
+			   gettext_noop("The index is sorted with maintenance_work_mem of SQLite cache. Ignored with commit_every."),
+			   &pg_sqlite_fs_defer_index,
+			   false,
+			   PGC_USERSET,
+			   0,
+			   NULL, NULL, NULL);
+
+  DefineCustomIntVariable(SQLITE_FS_SCHEMA_VERSION,
+			  gettext_noop("Schema of the created databases."),
+			  gettext_noop("Version 2 makes the inode the rowid of the tables."),
+			  &pg_sqlite_fs_schema_version,
+			  1, 1, 2,
+			  PGC_USERSET,
+			  0,
+			  NULL, NULL, NULL);
+
+  DefineCustomBoolVariable(SQLITE_FS_SORTED_LOAD,
+			   gettext_noop("Sort the rows of the bulk loads by inode."),
+			   NULL,
+			   &pg_sqlite_fs_sorted_load,
+			   false,
+			   PGC_USERSET,
+			   0,
+			   NULL, NULL, NULL);
+
+  DefineCustomIntVariable(SQLITE_FS_COMMIT_EVERY,
+			  gettext_noop("Number of rows after which insert_entries and insert_files commit."),
+			  gettext_noop("The loads then resume from their last commit, when called again with the same query. 0 loads in a single transaction."),
+			  &pg_sqlite_fs_commit_every,
+			  0, 0, INT_MAX,
+			  PGC_USERSET,
+			  0,
+			  NULL, NULL, NULL);
+
+  DefineCustomBoolVariable(SQLITE_FS_USE_WRITER,
+			   gettext_noop("Send the single-row writes to a background writer per database, at commit."),
+			   gettext_noop("Requires pg_sqlite_fs in shared_preload_libraries."),
+			   &pg_sqlite_fs_use_writer,
+			   false,
+			   PGC_USERSET,
+			   0,
+			   NULL, NULL, NULL);
+
+  DefineCustomIntVariable(SQLITE_FS_MAX_WRITERS,
+			  gettext_noop("Maximum number of background writers (one per database)."),
+			  NULL,
+			  &pg_sqlite_fs_max_writers,
+			  4, 1, 1024,
+			  PGC_POSTMASTER,
+			  0,
+			  NULL, NULL, NULL);
+
+  DefineCustomIntVariable(SQLITE_FS_WRITER_IDLE_TIMEOUT,
+			  gettext_noop("Time after which a background writer without backends stops."),
+			  NULL,
+			  &pg_sqlite_fs_writer_idle_timeout,
+			  60, 1, INT_MAX,
+			  PGC_SIGHUP,
+			  GUC_UNIT_S,
+			  NULL, NULL, NULL);
+
+  DefineCustomEnumVariable(SQLITE_FS_JOURNAL_MODE,
+			   gettext_noop("SQLite journal mode set by make(), and by the builds and reset() before the rename."),
+			   gettext_noop("With wal, the readers of the database are not blocked by the writers."),
+			   &pg_sqlite_fs_journal_mode,
+			   0, journal_mode_options,
+			   PGC_USERSET,
+			   0,
+			   NULL, NULL, NULL);
+
+  DefineCustomIntVariable(SQLITE_FS_BUSY_TIMEOUT,
+			  gettext_noop("Time SQLite waits for a locked database, before failing."),
+			  gettext_noop("0 fails immediately."),
+			  &pg_sqlite_fs_busy_timeout,
+			  1000, 0, INT_MAX,
+			  PGC_USERSET,
+			  GUC_UNIT_MS,
+			  NULL, NULL, NULL);
+
+  DefineCustomEnumVariable(SQLITE_FS_AUTO_VACUUM,
+			   gettext_noop("SQLite auto_vacuum mode of the new databases."),
+			   gettext_noop("full shrinks the file at each commit, incremental after the truncates."),
+			   &pg_sqlite_fs_auto_vacuum,
+			   0, auto_vacuum_options,
+			   PGC_USERSET,
+			   0,
+			   NULL, NULL, NULL);
+
+  DefineCustomIntVariable(SQLITE_FS_DENTRY_CACHE_SIZE,
+			  gettext_noop("Maximum number of path components cached per database by lookup()."),
+			  gettext_noop("0 disables the cache. It is emptied when full."),
+			  &pg_sqlite_fs_dentry_cache_size,
+			  10000, 0, INT_MAX,
+			  PGC_USERSET,
+			  0,
+			  NULL, NULL, NULL);
+
+  if(process_shared_preload_libraries_in_progress){
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = sqlite_fs_shmem_request;
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = sqlite_fs_shmem_startup;
+  }
+
+  RegisterXactCallback(sqlite_fs_xact_callback, NULL);
+  RegisterSubXactCallback(sqlite_fs_subxact_callback, NULL);
+  RegisterXactCallback(sqlite_fs_sync_xact_callback, NULL);
+  RegisterSubXactCallback(sqlite_fs_sync_subxact_callback, NULL);
+  RegisterXactCallback(sqlite_fs_writer_xact_callback, NULL);
+  RegisterSubXactCallback(sqlite_fs_writer_subxact_callback, NULL);
 }
 
 /*
@@ -143,6 +501,14 @@ convert_and_check_path(text *arg)
 }
 
 
+#define SQLITE_FS_TRIGGERS \
+  "CREATE TRIGGER IF NOT EXISTS on_insert AFTER INSERT ON extended_attributes " \
+  "BEGIN UPDATE entries SET mtime = unixepoch() WHERE inode = NEW.inode; END;" \
+  "CREATE TRIGGER IF NOT EXISTS on_update AFTER UPDATE ON extended_attributes " \
+  "BEGIN UPDATE entries SET mtime = unixepoch() WHERE inode = OLD.inode; END;" \
+  "CREATE TRIGGER IF NOT EXISTS on_delete AFTER DELETE ON extended_attributes " \
+  "BEGIN UPDATE entries SET mtime = unixepoch() WHERE inode = OLD.inode; END;"
+
 static char* schema = \
   "CREATE TABLE IF NOT EXISTS entries ("
   "    inode             INT64 NOT NULL PRIMARY KEY,"
@@ -154,7 +520,6 @@ static char* schema = \
   "    size              INT64 NOT NULL DEFAULT 0,"
   "    is_dir            INT NOT NULL DEFAULT 1" // -- if 0, then JOIN with files table
   ");"
-  "CREATE UNIQUE INDEX IF NOT EXISTS names ON entries(parent_inode, name);"
   "INSERT INTO entries(inode, name, parent_inode) VALUES (1, '/', 1) ON CONFLICT DO NOTHING;"
   "CREATE TABLE IF NOT EXISTS files ("
   "  inode         INT64 PRIMARY KEY REFERENCES entries(inode),"
@@ -171,921 +536,5809 @@ static char* schema = \
   "    value             text NOT NULL,"
   "    PRIMARY KEY(inode,name)"
   ");"
-  "CREATE TRIGGER on_insert AFTER INSERT ON extended_attributes "
-  "BEGIN UPDATE entries SET mtime = unixepoch() WHERE inode = NEW.inode; END;"
-  "CREATE TRIGGER on_update AFTER UPDATE ON extended_attributes " 
-  "BEGIN UPDATE entries SET mtime = unixepoch() WHERE inode = OLD.inode; END;"
-  "CREATE TRIGGER on_delete AFTER DELETE ON extended_attributes " 
-  "BEGIN UPDATE entries SET mtime = unixepoch() WHERE inode = OLD.inode; END;"
+  SQLITE_FS_TRIGGERS
 ;
-  
 
-PG_FUNCTION_INFO_V1(pg_sqlite_fs_create);
-Datum
-pg_sqlite_fs_create(PG_FUNCTION_ARGS)
+/*
+ * Version 2: the inode is the rowid (INTEGER PRIMARY KEY), instead of an extra
+ * unique index next to the rowid table, and the extended attributes are
+ * clustered on their primary key. Inserts in inode order are then appends.
+ * Same columns, so same queries for the readers.
+ */
+static char* schema_v2 = \
+  "CREATE TABLE IF NOT EXISTS entries ("
+  "    inode             INTEGER PRIMARY KEY,"
+  "    name              text NOT NULL,"
+  "    parent_inode      INT64 NOT NULL REFERENCES entries(inode),"
+  "    ctime             INT64 NOT NULL DEFAULT 0,"
+  "    mtime             INT64 NOT NULL DEFAULT 0,"
+  "    nlink             INT NOT NULL DEFAULT 1,"
+  "    size              INT64 NOT NULL DEFAULT 0,"
+  "    is_dir            INT NOT NULL DEFAULT 1" // -- if 0, then JOIN with files table
+  ");"
+  "INSERT INTO entries(inode, name, parent_inode) VALUES (1, '/', 1) ON CONFLICT DO NOTHING;"
+  "CREATE TABLE IF NOT EXISTS files ("
+  "  inode         INTEGER PRIMARY KEY REFERENCES entries(inode),"
+  "  mountpoint    text,"
+  "  rel_path      text,"
+  "  header        BLOB,"
+  "  payload_size  INT64 NOT NULL DEFAULT 0," // (decrypted) size on disk
+  "  prepend       BLOB,"
+  "  append        BLOB"
+  ");"
+  "CREATE TABLE IF NOT EXISTS extended_attributes ("
+  "    inode             INT64 REFERENCES entries(inode),"
+  "    name              text NOT NULL,"
+  "    value             text NOT NULL,"
+  "    PRIMARY KEY(inode,name)"
+  ") WITHOUT ROWID;"
+  SQLITE_FS_TRIGGERS
+;
+
+static const char *
+sqlite_fs_schema(void)
 {
+  return (pg_sqlite_fs_schema_version == 2) ? schema_v2 : schema;
+}
 
-  int rc = 1;
-  char* db_path;
-  char* err = NULL;
-  sqlite3 *db;
-  mode_t m;
+/* Bookkeeping of the loads (checkpoints, watermarks), created when first needed */
+static char* metadata_table = \
+  "CREATE TABLE IF NOT EXISTS metadata ("
+  "    key               text PRIMARY KEY,"
+  "    value             INT64"
+  ") WITHOUT ROWID;";
 
-  if(PG_NARGS() != 1){
-    E("Invalid number of arguments: expected 1, got %d", PG_NARGS());
-    PG_RETURN_BOOL(false);
-  }
+/* Set of inodes, for the deletes in bulk. Emptied on each use. */
+static char* inodes_table = \
+  "CREATE TEMP TABLE IF NOT EXISTS inode_set (inode INTEGER PRIMARY KEY);"
+  "DELETE FROM temp.inode_set;";
 
-  if(PG_ARGISNULL(0)){
-    E("Null arguments not accepted");
-    PG_RETURN_BOOL(false);
+/* Created separately, so that the bulk loads can build it after the rows are in */
+static char* names_index = \
+  "CREATE UNIQUE INDEX IF NOT EXISTS names ON entries(parent_inode, name);";
+
+
+/*-------------------------------------------------------------------------
+ *
+ * Connection cache
+ *
+ * The SQLite handles are kept open in the backend, keyed by their canonical path,
+ * so that per-row calls don't pay for opening the file and parsing the schema.
+ * The least recently used handles are closed above sqlite_fs.max_connections.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+/* Statements prepared once per connection */
+typedef enum sqlite_fs_stmt_id {
+  SQLITE_FS_INSERT_FILE,
+  SQLITE_FS_INSERT_ENTRY,
+  SQLITE_FS_DELETE_FILE,
+  SQLITE_FS_DELETE_ENTRY,
+  SQLITE_FS_DELETE_INODE,
+  SQLITE_FS_GET_METADATA,
+  SQLITE_FS_SET_METADATA,
+  SQLITE_FS_DELETE_METADATA,
+  SQLITE_FS_INSERT_INODE,
+  SQLITE_FS_COLLECT_SUBTREE,
+  SQLITE_FS_INSERT_ATTRIBUTE,
+  SQLITE_FS_READDIR,
+  SQLITE_FS_LOOKUP,
+  SQLITE_FS_STAT,
+  SQLITE_FS_DATA_VERSION,
+  SQLITE_FS_NUM_STMTS
+} sqlite_fs_stmt_id;
+
+/* Designated: a missing comma or entry can't shift the others */
+static const char* const sqlite_fs_stmts_sql[SQLITE_FS_NUM_STMTS] = {
+  [SQLITE_FS_INSERT_FILE] =
+  "INSERT INTO files(inode,mountpoint,rel_path,header,payload_size,prepend,append)"
+  " VALUES(?,?,?,?,?,?,?)"
+  " ON CONFLICT(inode) DO UPDATE SET mountpoint=excluded.mountpoint,"
+                                   " rel_path=excluded.rel_path,"
+                                   " header=excluded.header,"
+                                   " payload_size=excluded.payload_size,"
+                                   " prepend=excluded.prepend,"
+                                   " append=excluded.append;",
+  [SQLITE_FS_INSERT_ENTRY] =
+  "INSERT INTO entries(inode,name,parent_inode,ctime,mtime,nlink,size,is_dir)"
+  " VALUES(?,?,?,?,?,?,?,?)"
+  " ON CONFLICT(inode) DO UPDATE SET name=excluded.name,"
+                                   " parent_inode=excluded.parent_inode,"
+                                   " ctime=excluded.ctime,"
+                                   " mtime=excluded.mtime,"
+                                   " nlink=excluded.nlink,"
+                                   " size=excluded.size,"
+                                   " is_dir=excluded.is_dir;",
+  [SQLITE_FS_DELETE_FILE] =
+  "DELETE FROM files WHERE inode = ?;",
+  [SQLITE_FS_DELETE_ENTRY] =
+  "DELETE FROM entries WHERE inode = ?1 OR parent_inode = ?1;",
+  // Note: in case of directory: missing some sub-directories
+  // => Use recursive with condition
+  [SQLITE_FS_DELETE_INODE] = /* that entry only: its children may still exist in the source */
+  "DELETE FROM entries WHERE inode = ?;",
+  [SQLITE_FS_GET_METADATA] =
+  "SELECT value FROM metadata WHERE key = ?;",
+  [SQLITE_FS_SET_METADATA] =
+  "INSERT INTO metadata(key,value) VALUES(?,?)"
+  " ON CONFLICT(key) DO UPDATE SET value=excluded.value;",
+  [SQLITE_FS_DELETE_METADATA] =
+  "DELETE FROM metadata WHERE key = ?;",
+  [SQLITE_FS_INSERT_INODE] =
+  "INSERT OR IGNORE INTO temp.inode_set(inode) VALUES(?);",
+  [SQLITE_FS_COLLECT_SUBTREE] =
+  "INSERT OR IGNORE INTO temp.inode_set(inode)"
+  " WITH RECURSIVE subtree(inode) AS ("
+  "   SELECT inode FROM entries WHERE inode = ?1"
+  "   UNION"
+  "   SELECT e.inode FROM entries e JOIN subtree s ON e.parent_inode = s.inode WHERE e.inode <> e.parent_inode"
+  " ) SELECT inode FROM subtree;",
+  [SQLITE_FS_INSERT_ATTRIBUTE] =
+  "INSERT INTO extended_attributes(inode,name,value) VALUES(?,?,?)"
+  " ON CONFLICT(inode,name) DO UPDATE SET value=excluded.value;",
+  [SQLITE_FS_READDIR] =
+  "SELECT inode, name, is_dir, size, mtime FROM entries"
+  " WHERE parent_inode = ?1 AND inode <> ?1 ORDER BY name;", // the names index, the root is its own parent
+  [SQLITE_FS_LOOKUP] =
+  "SELECT inode, is_dir FROM entries WHERE parent_inode = ? AND name = ?;",
+  [SQLITE_FS_STAT] =
+  "SELECT is_dir, size, ctime, mtime, nlink, parent_inode FROM entries WHERE inode = ?;",
+  [SQLITE_FS_DATA_VERSION] =
+  "PRAGMA data_version;",
+};
+
+typedef struct sqlite_fs_conn {
+  char          path[MAXPGPATH]; /* hash key: must be first */
+  sqlite3      *db;
+  dev_t         dev;             /* to notice the file being removed or replaced */
+  ino_t         ino;
+  int           pins;            /* in use by the running functions */
+  List         *pin_subids;      /* the subtransaction of each pin, in TopMemoryContext */
+  dlist_node    lru;             /* head is the most recently used */
+  sqlite3_stmt *stmts[SQLITE_FS_NUM_STMTS]; /* prepared on first use */
+  int           synchronous;     /* pragmas in effect, -1 if unknown */
+  int           cache_size;
+  int           temp_store;
+  int           busy_timeout;
+  char          journal_mode[16]; /* to restore after a fast build */
+  HTAB         *dentries;        /* lookup() cache, NULL if empty */
+  int64         data_version;    /* of the database when the dentries were cached */
+  int64         total_changes;
+} sqlite_fs_conn;
+
+static HTAB *sqlite_fs_conns = NULL;
+static dlist_head sqlite_fs_lru = DLIST_STATIC_INIT(sqlite_fs_lru);
+
+static int
+sqlite_fs_conn_finish(sqlite_fs_conn *conn)
+{
+  int i, rc;
+
+  D2("Closing database %s", conn->path);
+  list_free(conn->pin_subids);
+  conn->pin_subids = NIL;
+  for(i = 0; i < SQLITE_FS_NUM_STMTS; i++)
+    if(conn->stmts[i]) sqlite3_finalize(conn->stmts[i]);
+  if(conn->dentries){
+    hash_destroy(conn->dentries);
+    conn->dentries = NULL;
   }
+  rc = sqlite3_close_v2(conn->db);
+  if(rc != SQLITE_OK)
+    W("Error closing database %s: %s", conn->path, sqlite3_errmsg(conn->db));
+  conn->db = NULL;
+  return rc;
+}
 
-  db_path = convert_and_check_path(PG_GETARG_TEXT_PP(0)); // allocated in the function context: will be cleaned by PG
+static void
+sqlite_fs_conn_drop(sqlite_fs_conn *conn)
+{
+  dlist_delete(&conn->lru);
+  sqlite_fs_conn_finish(conn);
+  hash_search(sqlite_fs_conns, conn->path, HASH_REMOVE, NULL);
+}
 
-  m = umask(0007);
-  D2("Database open: %s | mask: %o", db_path, m);
+/* close the least recently used handles, above the limit */
+static void
+sqlite_fs_conn_evict(void)
+{
+  dlist_node *node, *prev;
+  long n;
 
-  rc = sqlite3_open(db_path, &db); // SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE
+  if(sqlite_fs_conns == NULL || dlist_is_empty(&sqlite_fs_lru))
+    return;
 
-  if( rc ) {
-    N("Can't open database %s: %s", db_path, sqlite3_errmsg(db));
-    rc = 1;
-    goto bailout;
-  }
+  n = hash_get_num_entries(sqlite_fs_conns);
 
-  D1("Database open: %s", db_path);
+  for(node = dlist_tail_node(&sqlite_fs_lru); node && n > pg_sqlite_fs_max_connections; node = prev){
+    sqlite_fs_conn *conn = dlist_container(sqlite_fs_conn, lru, node);
 
-  /* Execute SQL statement */
-  rc = sqlite3_exec(db, schema, NULL, NULL, &err);
-   
-  if( rc != SQLITE_OK ){
-    N("SQL error creating schema: %s", err);
-    rc = 2;
-    goto bailout;
+    prev = dlist_has_prev(&sqlite_fs_lru, node) ? dlist_prev_node(&sqlite_fs_lru, node) : NULL;
+    if(conn->pins > 0)
+      continue;
+    sqlite_fs_conn_drop(conn);
+    n--;
   }
+}
 
-  D3("Successfully created: %s", db_path);
-  rc = 0; // success
-  
-bailout:
-  if(err) sqlite3_free(err);
-  sqlite3_close(db);
-  (void)umask(m); // reset back to old mask
-  PG_RETURN_BOOL(((rc)?false:true));
+static void
+sqlite_fs_pragma(sqlite_fs_conn *conn, const char *fmt, int value)
+{
+  char sql[64];
+  char *err = NULL;
+
+  snprintf(sql, sizeof(sql), fmt, value);
+  D3("%s: %s", conn->path, sql);
+  if(sqlite3_exec(conn->db, sql, NULL, NULL, &err) != SQLITE_OK)
+    W("SQL error for '%s' in %s: %s", sql, conn->path, err);
+  if(err)
+    sqlite3_free(err);
 }
 
+/* (Re)apply the settings that changed since the last use */
+static void
+sqlite_fs_conn_configure(sqlite_fs_conn *conn)
+{
+  if(conn->synchronous != pg_sqlite_fs_synchronous){
+    sqlite_fs_pragma(conn, "PRAGMA synchronous = %d;", pg_sqlite_fs_synchronous);
+    conn->synchronous = pg_sqlite_fs_synchronous;
+  }
+  if(conn->cache_size != pg_sqlite_fs_cache_size){
+    sqlite_fs_pragma(conn, "PRAGMA cache_size = -%d;", pg_sqlite_fs_cache_size); // negative: in kB
+    conn->cache_size = pg_sqlite_fs_cache_size;
+  }
+  if(conn->temp_store != pg_sqlite_fs_temp_store){
+    sqlite_fs_pragma(conn, "PRAGMA temp_store = %d;", pg_sqlite_fs_temp_store);
+    conn->temp_store = pg_sqlite_fs_temp_store;
+  }
+  if(conn->busy_timeout != pg_sqlite_fs_busy_timeout){
+    D3("%s: busy timeout %d ms", conn->path, pg_sqlite_fs_busy_timeout);
+    sqlite3_busy_timeout(conn->db, pg_sqlite_fs_busy_timeout);
+    conn->busy_timeout = pg_sqlite_fs_busy_timeout;
+  }
+}
 
-PG_FUNCTION_INFO_V1(pg_sqlite_fs_remove);
-Datum
-pg_sqlite_fs_remove(PG_FUNCTION_ARGS)
+/*
+ * Fast builds: no journal sync, and a cheaper journal, for the time of a bulk load.
+ * Must be called outside a transaction, as the journal mode can't change inside one.
+ * A database in WAL mode keeps it: leaving WAL needs the readers gone.
+ */
+static void
+sqlite_fs_fast_build_begin(sqlite_fs_conn *conn)
 {
+  sqlite3_stmt *stmt = NULL;
 
-  char* db_path;
+  if(!pg_sqlite_fs_fast_build)
+    return;
 
-  if(PG_NARGS() != 1){
-    E("Invalid number of arguments: expected 1, got %d", PG_NARGS());
-    PG_RETURN_BOOL(false);
-  }
+  /* remember the journal mode */
+  if(sqlite3_prepare_v2(conn->db, "PRAGMA journal_mode;", -1, &stmt, NULL) == SQLITE_OK &&
+     sqlite3_step(stmt) == SQLITE_ROW)
+    strlcpy(conn->journal_mode, (const char*)sqlite3_column_text(stmt, 0), sizeof(conn->journal_mode));
+  sqlite3_finalize(stmt);
 
-  if(PG_ARGISNULL(0)){
-    E("Null arguments not accepted");
-    PG_RETURN_BOOL(false);
+  if(conn->journal_mode[0] == '\0'){
+    W("Can't read the journal mode of %s: not using a fast build", conn->path);
+    return;
   }
 
-  db_path = convert_and_check_path(PG_GETARG_TEXT_PP(0)); // allocated in the function context: will be cleaned by PG
-
-  PG_RETURN_BOOL((unlink(db_path))?false:true);
+  D1("Fast build in %s (journal mode was %s)", conn->path, conn->journal_mode);
+  sqlite_fs_pragma(conn, "PRAGMA synchronous = %d;", pg_sqlite_fs_build_synchronous);
+  conn->synchronous = pg_sqlite_fs_build_synchronous;
+  if(pg_strcasecmp(conn->journal_mode, "wal") != 0){
+    char sql[64];
+    snprintf(sql, sizeof(sql), "PRAGMA journal_mode = %s;",
+	     build_journal_mode_options[pg_sqlite_fs_build_journal_mode].name);
+    if(sqlite3_exec(conn->db, sql, NULL, NULL, NULL) != SQLITE_OK)
+      W("SQL error for '%s' in %s: %s", sql, conn->path, sqlite3_errmsg(conn->db));
+  }
 }
 
-
-PG_FUNCTION_INFO_V1(pg_sqlite_fs_insert_file);
-Datum
-pg_sqlite_fs_insert_file(PG_FUNCTION_ARGS)
+/* Restores the durable settings */
+static void
+sqlite_fs_fast_build_end(sqlite_fs_conn *conn)
 {
+  char sql[64];
 
-  int rc = 1;
-  char* db_path;
-  sqlite3 *db;
-  sqlite3_stmt *stmt = NULL;
-  text  *rpath = NULL;
-  text  *mnt = NULL;
-  bytea *header = NULL;
-  bytea *prepend = NULL;
-  bytea *append = NULL;
+  if(conn->journal_mode[0] == '\0')
+    return;
 
-  if(PG_NARGS() != 8){
-    E("Invalid number of arguments: expected 8, got %d", PG_NARGS());
-    PG_RETURN_BOOL(false);
-  }
+  D1("End of fast build in %s: restoring journal mode %s", conn->path, conn->journal_mode);
+  snprintf(sql, sizeof(sql), "PRAGMA journal_mode = %s;", conn->journal_mode);
+  if(sqlite3_exec(conn->db, sql, NULL, NULL, NULL) != SQLITE_OK)
+    W("SQL error for '%s' in %s: %s", sql, conn->path, sqlite3_errmsg(conn->db));
+  conn->journal_mode[0] = '\0';
+  sqlite_fs_conn_configure(conn); // synchronous back
+}
 
-  if(PG_ARGISNULL(0) || PG_ARGISNULL(1)){
-    E("First 2 arguments can't be null");
-    PG_RETURN_BOOL(false);
+/*
+ * Returns a (pinned) handle for db_path, opening it if needed.
+ * Returns NULL if the database can't be opened.
+ */
+static sqlite_fs_conn *
+sqlite_fs_conn_open(const char *db_path, int flags)
+{
+  sqlite_fs_conn *conn;
+  struct stat st;
+  bool found;
+  int rc;
+
+  if(strlen(db_path) >= MAXPGPATH)
+    E("Path too long: %s", db_path);
+
+  if(sqlite_fs_conns == NULL){
+    HASHCTL ctl;
+    ctl.keysize = MAXPGPATH;
+    ctl.entrysize = sizeof(sqlite_fs_conn);
+    ctl.hcxt = TopMemoryContext;
+    sqlite_fs_conns = hash_create("sqlite_fs connections", 16, &ctl, HASH_ELEM | HASH_STRINGS | HASH_CONTEXT);
   }
 
-  db_path = convert_and_check_path(PG_GETARG_TEXT_PP(0)); // allocated in the function context: will be cleaned by PG
+  conn = (sqlite_fs_conn*)hash_search(sqlite_fs_conns, db_path, HASH_ENTER, &found);
+
+  if(found && conn->pins == 0){
+    /* Reopen if the file was removed or replaced behind our back */
+    if(stat(db_path, &st) != 0 || (conn->ino && (st.st_dev != conn->dev || st.st_ino != conn->ino))){
+      D1("Database %s changed on disk: reopening", db_path);
+      sqlite_fs_conn_drop(conn);
+      conn = (sqlite_fs_conn*)hash_search(sqlite_fs_conns, db_path, HASH_ENTER, &found);
+    } else if(!conn->ino){ /* the file was created after opening */
+      conn->dev = st.st_dev;
+      conn->ino = st.st_ino;
+    }
+  }
 
-  rc = sqlite3_open(db_path, &db); // SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE
+  if(!found){
+    conn->db = NULL;
+    conn->pins = 0;
+    conn->pin_subids = NIL;
+    conn->dev = 0;
+    conn->ino = 0;
+    memset(conn->stmts, 0, sizeof(conn->stmts));
+    conn->synchronous = -1;
+    conn->cache_size = -1;
+    conn->temp_store = -1;
+    conn->busy_timeout = -1;
+    conn->journal_mode[0] = '\0';
+    conn->dentries = NULL;
+
+    rc = sqlite3_open_v2(db_path, &conn->db, flags, NULL);
+    if( rc != SQLITE_OK ){
+      N("Can't open database %s: %s", db_path, sqlite3_errmsg(conn->db));
+      sqlite3_close(conn->db);
+      hash_search(sqlite_fs_conns, db_path, HASH_REMOVE, NULL);
+      return NULL;
+    }
+    D2("Database open: %s", db_path);
 
-  if( rc ) {
-    N("Can't open database %s: %s", db_path, sqlite3_errmsg(db));
-    rc = 1;
-    goto bailout;
+    if(stat(db_path, &st) == 0){ /* not created yet, if nothing was written */
+      conn->dev = st.st_dev;
+      conn->ino = st.st_ino;
+    }
+    dlist_push_head(&sqlite_fs_lru, &conn->lru);
+  } else {
+    D3("Database cached: %s", db_path);
+    dlist_move_head(&sqlite_fs_lru, &conn->lru);
   }
 
-  D2("Database open: %s", db_path);
+  conn->pins++;
+  {
+    MemoryContext old_cxt = MemoryContextSwitchTo(TopMemoryContext);
+    conn->pin_subids = lappend_oid(conn->pin_subids, GetCurrentSubTransactionId());
+    MemoryContextSwitchTo(old_cxt);
+  }
+  sqlite_fs_conn_configure(conn);
+  return conn;
+}
 
-  /* SQL statement */
-  // 1: inode
-  if(!PG_ARGISNULL(2)) mnt = PG_GETARG_TEXT_PP(2);
-  if(!PG_ARGISNULL(3)) rpath = PG_GETARG_TEXT_PP(3);
-  if(!PG_ARGISNULL(4)) header = PG_GETARG_BYTEA_PP(4);
-  // 5: payload_size
-  if(!PG_ARGISNULL(6)) prepend = PG_GETARG_BYTEA_PP(6);
-  if(!PG_ARGISNULL(7)) append = PG_GETARG_BYTEA_PP(7);
+static void
+sqlite_fs_conn_release(sqlite_fs_conn *conn)
+{
+  SubTransactionId subid = GetCurrentSubTransactionId();
+  int i;
 
-  D1("Inserting %.*s/%.*s", (int)VARSIZE_ANY_EXHDR(mnt), VARDATA_ANY(mnt), (int)VARSIZE_ANY_EXHDR(rpath), VARDATA_ANY(rpath));
+  if(conn == NULL)
+    return;
 
-  rc = sqlite3_prepare_v2(db,
-			  "INSERT INTO files(inode,mountpoint,rel_path,header,payload_size,prepend,append)"
-			  " VALUES(?,?,?,?,?,?,?)"
-			  " ON CONFLICT(inode) DO UPDATE SET mountpoint=excluded.mountpoint,"
-			                                   " rel_path=excluded.rel_path,"
-			                                   " header=excluded.header,"
-			                                   " payload_size=excluded.payload_size,"
-			                                   " prepend=excluded.prepend,"
-			                                   " append=excluded.append;",
-			  -1, &stmt, NULL);
-  if( rc != SQLITE_OK ) {
-    N("Error preparing statement: %s", sqlite3_errmsg(db));
-    rc = 1;
-    goto bailout;
-  }
+  Assert(conn->pins > 0);
+  conn->pins--;
 
-  /* Bind arguments */
-  D2("Binding arguments for inserting file");
-  rc = (sqlite3_bind_int64(stmt, 1, PG_GETARG_INT64(1)) ||
-	( (PG_ARGISNULL(2)) ? sqlite3_bind_null(stmt, 2)
-	                    : sqlite3_bind_text(stmt, 2, VARDATA_ANY(mnt), (int)VARSIZE_ANY_EXHDR(mnt), SQLITE_STATIC)) || // we handle destruction
-	( (PG_ARGISNULL(3)) ? sqlite3_bind_null(stmt, 3)
- 	                    : sqlite3_bind_text(stmt, 3, VARDATA_ANY(rpath), (int)VARSIZE_ANY_EXHDR(rpath), SQLITE_STATIC)) || // we handle destruction
-	( (PG_ARGISNULL(4)) ? sqlite3_bind_null(stmt, 4)
-	                    : sqlite3_bind_blob(stmt, 4, VARDATA_ANY(header), (int)VARSIZE_ANY_EXHDR(header), SQLITE_STATIC) ) ||
-	sqlite3_bind_int64(stmt, 5,  ((PG_ARGISNULL(5)) ? 0 : PG_GETARG_INT64(5))) ||
-	( (PG_ARGISNULL(6)) ? sqlite3_bind_null(stmt, 6)
-	                    : sqlite3_bind_blob(stmt, 6, VARDATA_ANY(prepend), (int)VARSIZE_ANY_EXHDR(prepend), SQLITE_STATIC) ) ||
-	                      // sqlite3_bind_blob64 is too much, come on!
-	( (PG_ARGISNULL(7)) ? sqlite3_bind_null(stmt, 7)
-	                    : sqlite3_bind_blob(stmt, 7, VARDATA_ANY(append), (int)VARSIZE_ANY_EXHDR(append), SQLITE_STATIC) )
-	                      // sqlite3_bind_blob64 is too much, come on!
-	);
-  if( rc != SQLITE_OK ){
-    N("SQL error binding arguments: %s", sqlite3_errmsg(db));
-    rc = 2;
-    goto bailout;
-  }
+  /* a pin of the current subtransaction, or else the last one */
+  for(i = list_length(conn->pin_subids) - 1; i >= 0; i--)
+    if(list_nth_oid(conn->pin_subids, i) == subid)
+      break;
+  if(i < 0)
+    i = list_length(conn->pin_subids) - 1;
+  if(i >= 0)
+    conn->pin_subids = list_delete_nth_cell(conn->pin_subids, i);
 
-  {
-    char* expanded_sql = sqlite3_expanded_sql(stmt);
-    D1("expanded statement: %s", expanded_sql);
-    sqlite3_free(expanded_sql);
-  }
+  sqlite_fs_conn_evict();
+}
 
-  /* Execute SQL prepared statement */
-  D2("Execute statement for insert file");
-  rc = sqlite3_step(stmt);
-  if( rc != SQLITE_DONE ){
-    N("SQL error inserting the file: %s | error: %d", sqlite3_errmsg(db), rc);
-    rc = 3;
-    goto bailout;
+/*
+ * Returns the prepared statement, compiled on first use (or NULL on error).
+ * Hand it back with sqlite_fs_stmt_done() so it can be reused.
+ */
+static sqlite3_stmt *
+sqlite_fs_stmt(sqlite_fs_conn *conn, sqlite_fs_stmt_id id)
+{
+  Assert(sqlite_fs_stmts_sql[id] != NULL);
+  if(conn->stmts[id] == NULL){
+    int rc = sqlite3_prepare_v3(conn->db, sqlite_fs_stmts_sql[id], -1,
+				SQLITE_PREPARE_PERSISTENT, &conn->stmts[id], NULL);
+    if( rc != SQLITE_OK ){
+      N("Error preparing statement: %s", sqlite3_errmsg(conn->db));
+      conn->stmts[id] = NULL;
+      return NULL;
+    }
+    D3("Prepared statement %d for %s", id, conn->path);
   }
+  return conn->stmts[id];
+}
 
-  D3("Successfully inserted file %ld", PG_GETARG_INT64(1));
-  rc = 0; // success
-  
-bailout:
-  if(stmt) sqlite3_finalize(stmt);
-  sqlite3_close(db);
-  PG_RETURN_BOOL(((rc)?false:true));
+static void
+sqlite_fs_stmt_done(sqlite3_stmt *stmt)
+{
+  if(stmt == NULL)
+    return;
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt); // the SQLITE_STATIC bindings point to palloc'ed memory
 }
 
+static bool
+sqlite_fs_stmt_cached(sqlite_fs_conn *conn, sqlite3_stmt *stmt)
+{
+  int i;
 
-PG_FUNCTION_INFO_V1(pg_sqlite_fs_insert_entry);
-Datum
-pg_sqlite_fs_insert_entry(PG_FUNCTION_ARGS)
+  for(i = 0; i < SQLITE_FS_NUM_STMTS; i++)
+    if(conn->stmts[i] == stmt)
+      return true;
+  return false;
+}
+
+/*
+ * Private handle, outside the cache (eg for a database being built).
+ * Close it with sqlite_fs_conn_close().
+ */
+static sqlite_fs_conn *
+sqlite_fs_conn_private(const char *db_path, int flags)
 {
+  sqlite_fs_conn *conn;
+  int rc;
 
-  int rc = 1;
-  char* db_path;
-  sqlite3 *db;
-  sqlite3_stmt *stmt = NULL;
-  text* name;
-  int64 inode, parent_inode;
+  if(strlen(db_path) >= MAXPGPATH)
+    E("Path too long: %s", db_path);
 
+  conn = (sqlite_fs_conn*)palloc0(sizeof(sqlite_fs_conn));
+  strlcpy(conn->path, db_path, MAXPGPATH);
+  conn->synchronous = -1;
+  conn->cache_size = -1;
+  conn->temp_store = -1;
+  conn->busy_timeout = -1;
+  conn->pins = 1;
 
-  if(PG_NARGS() < 4){
-    E("Invalid number of arguments: expected at least 4, got %d", PG_NARGS());
-    PG_RETURN_BOOL(false);
+  rc = sqlite3_open_v2(db_path, &conn->db, flags, NULL);
+  if( rc != SQLITE_OK ){
+    N("Can't open database %s: %s", db_path, sqlite3_errmsg(conn->db));
+    sqlite3_close(conn->db);
+    pfree(conn);
+    return NULL;
   }
+  D2("Database open: %s", db_path);
 
-  if(PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(2) || PG_ARGISNULL(3)){
-    E("Null arguments not accepted");
-    PG_RETURN_BOOL(false);
-  }
+  sqlite_fs_conn_configure(conn);
+  return conn;
+}
 
-  db_path = convert_and_check_path(PG_GETARG_TEXT_PP(0)); // allocated in the function context: will be cleaned by PG
+/* Returns false if SQLite could not flush and close the database */
+static bool
+sqlite_fs_conn_close(sqlite_fs_conn *conn)
+{
+  int rc;
 
-  rc = sqlite3_open(db_path, &db); // SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE
+  if(conn == NULL)
+    return true;
 
-  if( rc ) {
-    N("Can't open database %s: %s", db_path, sqlite3_errmsg(db));
-    rc = 1;
-    goto bailout;
-  }
+  rc = sqlite_fs_conn_finish(conn);
+  pfree(conn);
+  return (rc == SQLITE_OK);
+}
 
-  D2("Database open: %s", db_path);
+/* Close the cached handle, if any (eg before removing the file) */
+static void
+sqlite_fs_conn_invalidate(const char *db_path)
+{
+  sqlite_fs_conn *conn;
 
-  inode = PG_GETARG_INT64(1);
-  name = PG_GETARG_TEXT_PP(2);
-  parent_inode = PG_GETARG_INT64(3);
-  D2("Inserting entry [%ld]/%*s | %ld", parent_inode, (int)VARSIZE_ANY_EXHDR(name), VARDATA_ANY(name), inode);
+  if(sqlite_fs_conns == NULL)
+    return;
+
+  conn = (sqlite_fs_conn*)hash_search(sqlite_fs_conns, db_path, HASH_FIND, NULL);
+  if(conn == NULL)
+    return;
+
+  if(conn->pins > 0){
+    W("Database %s is in use: not closing it", db_path);
+    return;
+  }
+  sqlite_fs_conn_drop(conn);
+}
+
+/*
+ * On abort, the functions did not get a chance to clean up:
+ * we reset the statements and roll back the pending SQLite transaction of the handle.
+ */
+static void
+sqlite_fs_conn_abort(sqlite_fs_conn *conn)
+{
+  sqlite3_stmt *stmt = NULL, *next;
+
+  /* the others are private statements of the interrupted functions */
+  for(stmt = sqlite3_next_stmt(conn->db, NULL); stmt != NULL; stmt = next){
+    next = sqlite3_next_stmt(conn->db, stmt);
+    if(sqlite_fs_stmt_cached(conn, stmt))
+      sqlite3_reset(stmt);
+    else
+      sqlite3_finalize(stmt);
+  }
+
+  if(!sqlite3_get_autocommit(conn->db)){
+    D1("Rolling back the pending transaction in %s", conn->path);
+    if(sqlite3_exec(conn->db, "ROLLBACK;", NULL, NULL, NULL) != SQLITE_OK)
+      W("Error rolling back %s: %s", conn->path, sqlite3_errmsg(conn->db));
+  }
+  sqlite_fs_fast_build_end(conn);
+  conn->pins = 0;
+  list_free(conn->pin_subids);
+  conn->pin_subids = NIL;
+}
+
+static void
+sqlite_fs_xact_callback(XactEvent event, void *arg)
+{
+  HASH_SEQ_STATUS status;
+  sqlite_fs_conn *conn;
+
+  if(sqlite_fs_conns == NULL)
+    return;
+
+  switch(event){
+  case XACT_EVENT_PRE_COMMIT:
+  case XACT_EVENT_PARALLEL_PRE_COMMIT:
+    /* the functions end their SQLite transactions: one still open leaked, don't commit over it */
+    hash_seq_init(&status, sqlite_fs_conns);
+    while((conn = (sqlite_fs_conn*)hash_seq_search(&status)) != NULL){
+      if(!sqlite3_get_autocommit(conn->db)){
+	hash_seq_term(&status);
+	E("Database %s is still inside a transaction at commit", conn->path);
+      }
+    }
+    break;
+  case XACT_EVENT_ABORT:
+  case XACT_EVENT_PARALLEL_ABORT:
+    hash_seq_init(&status, sqlite_fs_conns);
+    while((conn = (sqlite_fs_conn*)hash_seq_search(&status)) != NULL)
+      sqlite_fs_conn_abort(conn);
+    sqlite_fs_conn_evict();
+    break;
+  default:
+    break;
+  }
+}
+
+/*
+ * Same, for the handles pinned in an aborted subtransaction (eg a PL/pgSQL EXCEPTION block),
+ * unless a function of an outer level still uses them: it cleans up itself, or at the abort.
+ */
+static void
+sqlite_fs_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+			   SubTransactionId parentSubid, void *arg)
+{
+  HASH_SEQ_STATUS status;
+  sqlite_fs_conn *conn;
+
+  if(event != SUBXACT_EVENT_ABORT_SUB || sqlite_fs_conns == NULL)
+    return;
+
+  hash_seq_init(&status, sqlite_fs_conns);
+  while((conn = (sqlite_fs_conn*)hash_seq_search(&status)) != NULL){
+    ListCell *lc;
+    int aborted = 0;
+
+    /* the subtransactions nest: the ids of the aborted one and its children are >= mySubid */
+    foreach(lc, conn->pin_subids){
+      if(lfirst_oid(lc) >= mySubid){
+	conn->pin_subids = foreach_delete_current(conn->pin_subids, lc);
+	aborted++;
+      }
+    }
+    if(aborted == 0)
+      continue;
+
+    conn->pins -= aborted;
+    if(conn->pins <= 0){
+      D1("Cleaning up %s after a subtransaction abort", conn->path);
+      sqlite_fs_conn_abort(conn);
+    }
+  }
+
+  sqlite_fs_conn_evict();
+}
+
+
+/*
+ * Metadata
+ *
+ * The table is created on each use: it may have been rolled back with the
+ * transaction that created it.
+ */
+
+static bool
+sqlite_fs_metadata(sqlite_fs_conn *conn)
+{
+  char *err = NULL;
+
+  if(sqlite3_exec(conn->db, metadata_table, NULL, NULL, &err) != SQLITE_OK){
+    N("SQL error creating the metadata table in %s: %s", conn->path, err);
+    sqlite3_free(err);
+    return false;
+  }
+  return true;
+}
+
+/* Returns 1 if found, 0 if not, and -1 on error */
+static int
+sqlite_fs_meta_get(sqlite_fs_conn *conn, const char *key, int64 *value)
+{
+  sqlite3_stmt *stmt;
+  int rc;
+
+  if(!sqlite_fs_metadata(conn) || (stmt = sqlite_fs_stmt(conn, SQLITE_FS_GET_METADATA)) == NULL)
+    return -1;
+
+  rc = sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+  if(rc == SQLITE_OK)
+    rc = sqlite3_step(stmt);
+
+  if(rc == SQLITE_ROW){
+    *value = sqlite3_column_int64(stmt, 0);
+    rc = 1;
+  } else if(rc == SQLITE_DONE){
+    rc = 0;
+  } else {
+    N("SQL error reading %s in %s: %s", key, conn->path, sqlite3_errmsg(conn->db));
+    rc = -1;
+  }
+
+  sqlite_fs_stmt_done(stmt);
+  return rc;
+}
+
+/* Returns 0 on success */
+static int
+sqlite_fs_meta_set(sqlite_fs_conn *conn, const char *key, int64 value)
+{
+  sqlite3_stmt *stmt;
+  int rc;
+
+  if(!sqlite_fs_metadata(conn) || (stmt = sqlite_fs_stmt(conn, SQLITE_FS_SET_METADATA)) == NULL)
+    return 1;
+
+  rc = sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+  if(rc == SQLITE_OK)
+    rc = sqlite3_bind_int64(stmt, 2, value);
+  if(rc == SQLITE_OK)
+    rc = sqlite3_step(stmt);
+  if(rc != SQLITE_DONE)
+    N("SQL error writing %s in %s: %s", key, conn->path, sqlite3_errmsg(conn->db));
+
+  sqlite_fs_stmt_done(stmt);
+  return (rc == SQLITE_DONE) ? 0 : 1;
+}
+
+/* Returns 0 on success */
+static int
+sqlite_fs_meta_del(sqlite_fs_conn *conn, const char *key)
+{
+  sqlite3_stmt *stmt;
+  int rc;
+
+  if(!sqlite_fs_metadata(conn) || (stmt = sqlite_fs_stmt(conn, SQLITE_FS_DELETE_METADATA)) == NULL)
+    return 1;
+
+  rc = sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+  if(rc == SQLITE_OK)
+    rc = sqlite3_step(stmt);
+  if(rc != SQLITE_DONE)
+    N("SQL error deleting %s in %s: %s", key, conn->path, sqlite3_errmsg(conn->db));
+
+  sqlite_fs_stmt_done(stmt);
+  return (rc == SQLITE_DONE) ? 0 : 1;
+}
+
+
+/*
+ * Background writer
+ *
+ * With sqlite_fs.use_writer, insert_entry/insert_file/delete_entry/delete_file
+ * hand their row to a background worker, one per database, instead of writing it themselves.
+ * The worker keeps the database open and applies the rows of all the backends
+ * in one SQLite transaction per round (group commit): no lock contention between the
+ * backends on the same database, and one commit (and sync) for many rows.
+ *
+ * Each backend creates a DSM segment with two queues (requests, replies) per writer,
+ * and passes it to the worker through its slot in shared memory.
+ * The backend buffers its rows per database until the PostgreSQL commit, then sends them
+ * as one request and waits for the reply (the result after the SQLite commit): one round
+ * trip per transaction, not per row. The rows of a request are applied all or none,
+ * and a failure is an error at commit. The functions return true once the row is queued.
+ * The worker stops after sqlite_fs.writer_idle_timeout without backends.
+ *
+ * The slots are in shared memory: pg_sqlite_fs must be in shared_preload_libraries.
+ */
+
+#define SQLITE_FS_WRITER_INBOX 16
+#define SQLITE_FS_WRITER_QUEUE_SIZE 65536
+#define SQLITE_FS_WRITER_REPLY_SIZE 1024
+#define SQLITE_FS_WRITER_MAGIC 0x5173f5a1
+
+/* Requests */
+#define SQLITE_FS_MSG_INSERT_ENTRY 'E'
+#define SQLITE_FS_MSG_INSERT_FILE  'F'
+#define SQLITE_FS_MSG_DELETE_ENTRY 'e'
+#define SQLITE_FS_MSG_DELETE_FILE  'f'
+
+typedef struct sqlite_fs_writer_slot {
+  bool        in_use;
+  uint64      generation;  /* to detect a slot reused by another writer */
+  pid_t       pid;         /* 0 while starting */
+  Latch      *latch;
+  char        path[MAXPGPATH];
+  int         ninbox;
+  dsm_handle  inbox[SQLITE_FS_WRITER_INBOX]; /* new backends */
+} sqlite_fs_writer_slot;
+
+typedef struct sqlite_fs_writer_shared {
+  LWLock     *lock;
+  uint64      generation;
+  sqlite_fs_writer_slot slots[FLEXIBLE_ARRAY_MEMBER];
+} sqlite_fs_writer_shared;
+
+static sqlite_fs_writer_shared *sqlite_fs_writers = NULL;
+
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+static Size
+sqlite_fs_writer_shmem_size(void)
+{
+  return add_size(offsetof(sqlite_fs_writer_shared, slots),
+		  mul_size(pg_sqlite_fs_max_writers, sizeof(sqlite_fs_writer_slot)));
+}
+
+static void
+sqlite_fs_shmem_request(void)
+{
+  if(prev_shmem_request_hook)
+    prev_shmem_request_hook();
+
+  RequestAddinShmemSpace(sqlite_fs_writer_shmem_size());
+  RequestNamedLWLockTranche("pg_sqlite_fs", 1);
+}
+
+static void
+sqlite_fs_shmem_startup(void)
+{
+  bool found;
+
+  if(prev_shmem_startup_hook)
+    prev_shmem_startup_hook();
+
+  LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+  sqlite_fs_writers = ShmemInitStruct("pg_sqlite_fs writers", sqlite_fs_writer_shmem_size(), &found);
+  if(!found){
+    memset(sqlite_fs_writers, 0, sqlite_fs_writer_shmem_size());
+    sqlite_fs_writers->lock = &(GetNamedLWLockTranche("pg_sqlite_fs"))->lock;
+  }
+  LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Backend side
+ */
+
+typedef struct sqlite_fs_writer_client {
+  char            path[MAXPGPATH]; /* key */
+  int             slot;
+  uint64          generation;
+  dsm_segment    *seg;
+  shm_mq_handle  *out;   /* requests */
+  shm_mq_handle  *in;    /* replies */
+} sqlite_fs_writer_client;
+
+static HTAB *sqlite_fs_writer_clients = NULL;
+
+static bool
+sqlite_fs_writer_alive(sqlite_fs_writer_client *client)
+{
+  sqlite_fs_writer_slot *slot = &sqlite_fs_writers->slots[client->slot];
+  bool alive;
+
+  LWLockAcquire(sqlite_fs_writers->lock, LW_SHARED);
+  alive = slot->in_use && slot->generation == client->generation;
+  LWLockRelease(sqlite_fs_writers->lock);
+  return alive;
+}
+
+static void
+sqlite_fs_writer_client_drop(sqlite_fs_writer_client *client)
+{
+  dsm_detach(client->seg); /* detaches the queues too */
+  hash_search(sqlite_fs_writer_clients, client->path, HASH_REMOVE, NULL);
+}
+
+/* Starts the writer of that slot. Returns false on failure, with the slot freed. */
+static bool
+sqlite_fs_writer_start(int i)
+{
+  BackgroundWorker worker;
+  BackgroundWorkerHandle *handle;
+  pid_t pid;
+  sqlite_fs_writer_slot *slot = &sqlite_fs_writers->slots[i];
+
+  memset(&worker, 0, sizeof(worker));
+  worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+  worker.bgw_start_time = BgWorkerStart_ConsistentState;
+  worker.bgw_restart_time = BGW_NEVER_RESTART;
+  snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_sqlite_fs");
+  snprintf(worker.bgw_function_name, BGW_MAXLEN, "pg_sqlite_fs_writer_main");
+  snprintf(worker.bgw_name, BGW_MAXLEN, "sqlite_fs writer for %s", slot->path);
+  snprintf(worker.bgw_type, BGW_MAXLEN, "sqlite_fs writer");
+  worker.bgw_main_arg = Int32GetDatum(i);
+  worker.bgw_notify_pid = MyProcPid;
+
+  if(RegisterDynamicBackgroundWorker(&worker, &handle) &&
+     WaitForBackgroundWorkerStartup(handle, &pid) == BGWH_STARTED){
+    D1("Started the writer for %s: pid %d", slot->path, (int)pid);
+    return true;
+  }
+
+  N("Could not start the writer for %s: see max_worker_processes", slot->path);
+  LWLockAcquire(sqlite_fs_writers->lock, LW_EXCLUSIVE);
+  slot->in_use = false;
+  slot->ninbox = 0;
+  LWLockRelease(sqlite_fs_writers->lock);
+  return false;
+}
+
+/* Returns the queues to the writer of db_path, starting it if needed (or NULL on failure) */
+static sqlite_fs_writer_client*
+sqlite_fs_writer_client_get(const char *db_path)
+{
+  sqlite_fs_writer_client *client;
+  sqlite_fs_writer_slot *slot = NULL;
+  MemoryContext old_cxt;
+  shm_toc_estimator e;
+  shm_toc *toc;
+  shm_mq *req, *rep;
+  dsm_segment *seg;
+  shm_mq_handle *out, *in;
+  bool start = false;
+  int i;
+
+  if(sqlite_fs_writers == NULL)
+    E("%s requires pg_sqlite_fs in shared_preload_libraries", SQLITE_FS_USE_WRITER);
+
+  if(sqlite_fs_writer_clients == NULL){
+    HASHCTL ctl;
+
+    memset(&ctl, 0, sizeof(ctl));
+    ctl.keysize = MAXPGPATH;
+    ctl.entrysize = sizeof(sqlite_fs_writer_client);
+    ctl.hcxt = TopMemoryContext;
+    sqlite_fs_writer_clients = hash_create("sqlite_fs writer clients", 16, &ctl,
+					   HASH_ELEM | HASH_STRINGS | HASH_CONTEXT);
+  }
+
+  client = (sqlite_fs_writer_client*)hash_search(sqlite_fs_writer_clients, db_path, HASH_FIND, NULL);
+  if(client != NULL){
+    if(sqlite_fs_writer_alive(client))
+      return client;
+    sqlite_fs_writer_client_drop(client); /* the writer stopped in the meantime */
+  }
+
+  /* The queues, for the whole session */
+  old_cxt = MemoryContextSwitchTo(TopMemoryContext);
+
+  shm_toc_initialize_estimator(&e);
+  shm_toc_estimate_chunk(&e, SQLITE_FS_WRITER_QUEUE_SIZE);
+  shm_toc_estimate_chunk(&e, SQLITE_FS_WRITER_REPLY_SIZE);
+  shm_toc_estimate_keys(&e, 2);
+
+  seg = dsm_create(shm_toc_estimate(&e), 0);
+  dsm_pin_mapping(seg);
+  toc = shm_toc_create(SQLITE_FS_WRITER_MAGIC, dsm_segment_address(seg), shm_toc_estimate(&e));
+
+  req = shm_mq_create(shm_toc_allocate(toc, SQLITE_FS_WRITER_QUEUE_SIZE), SQLITE_FS_WRITER_QUEUE_SIZE);
+  shm_toc_insert(toc, 0, req);
+  shm_mq_set_sender(req, MyProc);
+  out = shm_mq_attach(req, seg, NULL);
+
+  rep = shm_mq_create(shm_toc_allocate(toc, SQLITE_FS_WRITER_REPLY_SIZE), SQLITE_FS_WRITER_REPLY_SIZE);
+  shm_toc_insert(toc, 1, rep);
+  shm_mq_set_receiver(rep, MyProc);
+  in = shm_mq_attach(rep, seg, NULL);
+
+  MemoryContextSwitchTo(old_cxt);
+
+  client = (sqlite_fs_writer_client*)hash_search(sqlite_fs_writer_clients, db_path, HASH_ENTER, NULL);
+  client->seg = seg;
+  client->out = out;
+  client->in = in;
+  client->slot = 0;
+  client->generation = 0; /* not registered yet: never alive */
+
+  /* Register with the writer, or take a free slot */
+  for(;;){
+    LWLockAcquire(sqlite_fs_writers->lock, LW_EXCLUSIVE);
+
+    slot = NULL;
+    for(i = 0; i < pg_sqlite_fs_max_writers; i++){
+      if(sqlite_fs_writers->slots[i].in_use && strcmp(sqlite_fs_writers->slots[i].path, db_path) == 0){
+	slot = &sqlite_fs_writers->slots[i];
+	break;
+      }
+    }
+
+    if(slot == NULL){
+      for(i = 0; i < pg_sqlite_fs_max_writers; i++){
+	if(!sqlite_fs_writers->slots[i].in_use){
+	  slot = &sqlite_fs_writers->slots[i];
+	  slot->in_use = true;
+	  slot->generation = ++sqlite_fs_writers->generation;
+	  slot->pid = 0;
+	  slot->latch = NULL;
+	  slot->ninbox = 0;
+	  strlcpy(slot->path, db_path, MAXPGPATH);
+	  start = true;
+	  break;
+	}
+      }
+    }
+
+    if(slot == NULL){
+      LWLockRelease(sqlite_fs_writers->lock);
+      N("All the writers are busy: see sqlite_fs.max_writers");
+      sqlite_fs_writer_client_drop(client);
+      return NULL;
+    }
+
+    if(slot->ninbox < SQLITE_FS_WRITER_INBOX){
+      slot->inbox[slot->ninbox++] = dsm_segment_handle(client->seg);
+      client->slot = i;
+      client->generation = slot->generation;
+      if(slot->latch)
+	SetLatch(slot->latch);
+      LWLockRelease(sqlite_fs_writers->lock);
+      break;
+    }
+
+    /* inbox full: wait for the writer to take the pending ones */
+    LWLockRelease(sqlite_fs_writers->lock);
+    (void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH, 10L, PG_WAIT_EXTENSION);
+    ResetLatch(MyLatch);
+    CHECK_FOR_INTERRUPTS();
+  }
+
+  if(start && !sqlite_fs_writer_start(client->slot)){
+    sqlite_fs_writer_client_drop(client);
+    return NULL;
+  }
+
+  return client;
+}
+
+/* Sends the request (a batch) and waits for its reply. Returns false if the writer is gone. */
+static bool
+sqlite_fs_writer_exchange(sqlite_fs_writer_client *client, StringInfo msg, char *status)
+{
+  shm_mq_result res;
+  Size nbytes = 0;
+  void *data = NULL;
+
+  /* not blocking, to notice a writer that stopped before attaching */
+  while((res = shm_mq_send(client->out, msg->len, msg->data, true, true)) == SHM_MQ_WOULD_BLOCK){
+    if(!sqlite_fs_writer_alive(client))
+      return false;
+    (void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH, 100L, PG_WAIT_EXTENSION);
+    ResetLatch(MyLatch);
+    CHECK_FOR_INTERRUPTS();
+  }
+  if(res != SHM_MQ_SUCCESS)
+    return false;
+
+  while((res = shm_mq_receive(client->in, &nbytes, &data, true)) == SHM_MQ_WOULD_BLOCK){
+    if(!sqlite_fs_writer_alive(client))
+      return false;
+    (void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH, 100L, PG_WAIT_EXTENSION);
+    ResetLatch(MyLatch);
+    CHECK_FOR_INTERRUPTS();
+  }
+  if(res != SHM_MQ_SUCCESS || nbytes != 1)
+    return false;
+
+  *status = ((char*)data)[0];
+  return true;
+}
+
+/* Sends the request and waits for its result. Returns true on success. */
+static bool
+sqlite_fs_writer_call(const char *db_path, StringInfo msg)
+{
+  sqlite_fs_writer_client *client;
+  volatile bool ok = false;
+  char status = 1;
+
+  client = sqlite_fs_writer_client_get(db_path);
+  if(client == NULL)
+    return false;
+
+  /*
+   * Interrupted (cancel, statement_timeout), the exchange leaves a partial request
+   * or an unread reply in the queues: the next one would be out of step. Drop them.
+   */
+  PG_TRY();
+  {
+    ok = sqlite_fs_writer_exchange(client, msg, &status);
+  }
+  PG_CATCH();
+  {
+    sqlite_fs_writer_client_drop(client);
+    PG_RE_THROW();
+  }
+  PG_END_TRY();
+
+  if(!ok){
+    N("The writer for %s stopped", db_path);
+    sqlite_fs_writer_client_drop(client);
+    return false;
+  }
+
+  return (status == 0);
+}
+
+/*
+ * Rows waiting for the commit, per database.
+ * A request is the number of rows, then each row (length, message).
+ */
+
+typedef struct sqlite_fs_writer_mark {
+  SubTransactionId  subid;
+  int               len;   /* of the request when the subtransaction wrote its first row */
+  int               count;
+} sqlite_fs_writer_mark;
+
+typedef struct sqlite_fs_writer_batch {
+  char             *path;
+  StringInfoData    request;
+  int               count;
+  List             *marks;
+} sqlite_fs_writer_batch;
+
+/* In TopTransactionContext */
+static List *sqlite_fs_writer_batches = NIL;
+
+/* Queues the row until the commit */
+static bool
+sqlite_fs_writer_add(const char *db_path, StringInfo row)
+{
+  sqlite_fs_writer_batch *batch = NULL;
+  sqlite_fs_writer_mark *mark;
+  SubTransactionId subid = GetCurrentSubTransactionId();
+  MemoryContext old_cxt;
+  ListCell *lc;
+
+  foreach(lc, sqlite_fs_writer_batches){
+    sqlite_fs_writer_batch *b = (sqlite_fs_writer_batch*)lfirst(lc);
+    if(strcmp(b->path, db_path) == 0){
+      batch = b;
+      break;
+    }
+  }
+
+  old_cxt = MemoryContextSwitchTo(TopTransactionContext);
+
+  if(batch == NULL){
+    /* starts the writer now: a misconfiguration shows on the first row, not at commit */
+    if(sqlite_fs_writer_client_get(db_path) == NULL){
+      MemoryContextSwitchTo(old_cxt);
+      return false;
+    }
+    batch = (sqlite_fs_writer_batch*)palloc0(sizeof(sqlite_fs_writer_batch));
+    batch->path = pstrdup(db_path);
+    initStringInfo(&batch->request);
+    pq_sendint32(&batch->request, 0); /* count, set at the flush */
+    sqlite_fs_writer_batches = lappend(sqlite_fs_writer_batches, batch);
+  }
+
+  /* where to cut the request if the subtransaction aborts */
+  mark = (batch->marks != NIL) ? (sqlite_fs_writer_mark*)llast(batch->marks) : NULL;
+  if(mark == NULL || mark->subid != subid){
+    mark = (sqlite_fs_writer_mark*)palloc(sizeof(sqlite_fs_writer_mark));
+    mark->subid = subid;
+    mark->len = batch->request.len;
+    mark->count = batch->count;
+    batch->marks = lappend(batch->marks, mark);
+  }
+
+  pq_sendint32(&batch->request, row->len);
+  pq_sendbytes(&batch->request, row->data, row->len);
+  batch->count++;
+
+  MemoryContextSwitchTo(old_cxt);
+  pfree(row->data);
+  return true;
+}
+
+/* Errors abort the PostgreSQL transaction: nothing of the failed request was applied */
+static void
+sqlite_fs_writer_flush(void)
+{
+  List *batches = sqlite_fs_writer_batches;
+  ListCell *lc;
+
+  sqlite_fs_writer_batches = NIL; /* sent once */
+
+  foreach(lc, batches){
+    sqlite_fs_writer_batch *batch = (sqlite_fs_writer_batch*)lfirst(lc);
+    uint32 count = pg_hton32((uint32)batch->count);
+
+    if(batch->count == 0)
+      continue;
+
+    memcpy(batch->request.data, &count, sizeof(count));
+    if(!sqlite_fs_writer_call(batch->path, &batch->request))
+      E("The writer could not apply the %d change(s) to %s", batch->count, batch->path);
+    D1("%s: %d change(s) written", batch->path, batch->count);
+  }
+}
+
+static void
+sqlite_fs_writer_xact_callback(XactEvent event, void *arg)
+{
+  switch(event){
+  case XACT_EVENT_PRE_COMMIT:
+    sqlite_fs_writer_flush();
+    break;
+  case XACT_EVENT_PRE_PREPARE:
+    if(sqlite_fs_writer_batches != NIL)
+      E("Cannot PREPARE a transaction with pending sqlite_fs writes");
+    break;
+  case XACT_EVENT_COMMIT:
+  case XACT_EVENT_ABORT:
+  case XACT_EVENT_PREPARE:
+    sqlite_fs_writer_batches = NIL; /* freed with TopTransactionContext */
+    break;
+  default:
+    break;
+  }
+}
+
+/* The subtransactions nest: the rows after the first one of an aborted subtransaction are its own */
+static void
+sqlite_fs_writer_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+				  SubTransactionId parentSubid, void *arg)
+{
+  ListCell *lc;
+
+  if(event != SUBXACT_EVENT_ABORT_SUB)
+    return;
+
+  foreach(lc, sqlite_fs_writer_batches){
+    sqlite_fs_writer_batch *batch = (sqlite_fs_writer_batch*)lfirst(lc);
+    ListCell *mc;
+
+    foreach(mc, batch->marks){
+      sqlite_fs_writer_mark *mark = (sqlite_fs_writer_mark*)lfirst(mc);
+
+      if(mark->subid < mySubid)
+	continue;
+      batch->request.len = mark->len;
+      batch->request.data[mark->len] = '\0';
+      batch->count = mark->count;
+      batch->marks = list_truncate(batch->marks, foreach_current_index(mc));
+      break;
+    }
+  }
+}
+
+/* NULL is -1 */
+static void
+sqlite_fs_msg_put_bytes(StringInfo msg, const void *data, int len)
+{
+  pq_sendint32(msg, len);
+  if(len > 0)
+    pq_sendbytes(msg, (const char*)data, len);
+}
+
+static const char*
+sqlite_fs_msg_get_bytes(StringInfo msg, int *len)
+{
+  *len = (int)pq_getmsgint(msg, 4);
+  return (*len < 0) ? NULL : pq_getmsgbytes(msg, *len);
+}
+
+static void
+sqlite_fs_msg_put_varlena(StringInfo msg, FunctionCallInfo fcinfo, int arg)
+{
+  struct varlena *v;
+
+  if(PG_ARGISNULL(arg)){
+    sqlite_fs_msg_put_bytes(msg, NULL, -1);
+    return;
+  }
+  v = PG_GETARG_VARLENA_PP(arg);
+  sqlite_fs_msg_put_bytes(msg, VARDATA_ANY(v), VARSIZE_ANY_EXHDR(v));
+}
+
+/* insert_entry(path, inode, name, parent_inode, ctime, mtime, nlink, size, is_dir) */
+static bool
+sqlite_fs_writer_insert_entry(const char *db_path, FunctionCallInfo fcinfo)
+{
+  StringInfoData msg;
+
+  initStringInfo(&msg);
+  pq_sendbyte(&msg, SQLITE_FS_MSG_INSERT_ENTRY);
+  pq_sendint64(&msg, PG_GETARG_INT64(1));
+  sqlite_fs_msg_put_varlena(&msg, fcinfo, 2);
+  pq_sendint64(&msg, PG_GETARG_INT64(3));
+  pq_sendint64(&msg, PG_GETARG_INT64(4));
+  pq_sendint64(&msg, PG_GETARG_INT64(5));
+  pq_sendint64(&msg, PG_GETARG_INT64(6));
+  pq_sendint64(&msg, PG_GETARG_INT64(7));
+  pq_sendbyte(&msg, PG_GETARG_BOOL(8) ? 1 : 0);
+  return sqlite_fs_writer_add(db_path, &msg);
+}
+
+/* insert_file(path, inode, mountpoint, rel_path, header, payload_size, prepend, append) */
+static bool
+sqlite_fs_writer_insert_file(const char *db_path, FunctionCallInfo fcinfo)
+{
+  StringInfoData msg;
+
+  initStringInfo(&msg);
+  pq_sendbyte(&msg, SQLITE_FS_MSG_INSERT_FILE);
+  pq_sendint64(&msg, PG_GETARG_INT64(1));
+  sqlite_fs_msg_put_varlena(&msg, fcinfo, 2);
+  sqlite_fs_msg_put_varlena(&msg, fcinfo, 3);
+  sqlite_fs_msg_put_varlena(&msg, fcinfo, 4);
+  pq_sendint64(&msg, (PG_ARGISNULL(5)) ? 0 : PG_GETARG_INT64(5));
+  sqlite_fs_msg_put_varlena(&msg, fcinfo, 6);
+  sqlite_fs_msg_put_varlena(&msg, fcinfo, 7);
+  return sqlite_fs_writer_add(db_path, &msg);
+}
+
+static bool
+sqlite_fs_writer_delete(const char *db_path, char op, int64 inode)
+{
+  StringInfoData msg;
+
+  initStringInfo(&msg);
+  pq_sendbyte(&msg, op);
+  pq_sendint64(&msg, inode);
+  return sqlite_fs_writer_add(db_path, &msg);
+}
+
+/*
+ * Worker side
+ */
+
+typedef struct sqlite_fs_writer_peer {
+  dsm_segment    *seg;
+  shm_mq_handle  *in;     /* requests */
+  shm_mq_handle  *out;    /* replies */
+  bool            pending;
+  char            status; /* 0: success */
+} sqlite_fs_writer_peer;
+
+static int sqlite_fs_writer_slot_index = -1;
+static uint64 sqlite_fs_writer_generation = 0;
+
+static void
+sqlite_fs_writer_exit(int code, Datum arg)
+{
+  sqlite_fs_writer_slot *slot = &sqlite_fs_writers->slots[sqlite_fs_writer_slot_index];
+
+  LWLockAcquire(sqlite_fs_writers->lock, LW_EXCLUSIVE);
+  if(slot->in_use && slot->generation == sqlite_fs_writer_generation){
+    slot->in_use = false;
+    slot->pid = 0;
+    slot->latch = NULL;
+    slot->ninbox = 0;
+  }
+  LWLockRelease(sqlite_fs_writers->lock);
+}
+
+static sqlite_fs_writer_peer*
+sqlite_fs_writer_attach(dsm_handle handle)
+{
+  sqlite_fs_writer_peer *peer;
+  dsm_segment *seg;
+  shm_toc *toc;
+  shm_mq *req, *rep;
+
+  seg = dsm_attach(handle);
+  if(seg == NULL) /* the backend is gone */
+    return NULL;
+
+  toc = shm_toc_attach(SQLITE_FS_WRITER_MAGIC, dsm_segment_address(seg));
+  if(toc == NULL){
+    dsm_detach(seg);
+    return NULL;
+  }
+
+  peer = (sqlite_fs_writer_peer*)palloc0(sizeof(sqlite_fs_writer_peer));
+  peer->seg = seg;
+
+  req = (shm_mq*)shm_toc_lookup(toc, 0, false);
+  shm_mq_set_receiver(req, MyProc);
+  peer->in = shm_mq_attach(req, seg, NULL);
+
+  rep = (shm_mq*)shm_toc_lookup(toc, 1, false);
+  shm_mq_set_sender(rep, MyProc);
+  peer->out = shm_mq_attach(rep, seg, NULL);
+
+  return peer;
+}
+
+/* Binds the blob/text, or NULL */
+static int
+sqlite_fs_writer_bind(sqlite3_stmt *stmt, int i, StringInfo msg, bool blob)
+{
+  int len;
+  const char *data = sqlite_fs_msg_get_bytes(msg, &len);
+
+  if(data == NULL)
+    return sqlite3_bind_null(stmt, i);
+  return (blob) ? sqlite3_bind_blob(stmt, i, data, len, SQLITE_STATIC)
+                : sqlite3_bind_text(stmt, i, data, len, SQLITE_STATIC);
+}
+
+/* Applies one row, in the current transaction. Returns 0 on success. */
+static int
+sqlite_fs_writer_apply(sqlite_fs_conn *conn, void *data, Size nbytes)
+{
+  StringInfoData msg;
+  sqlite3_stmt *stmt = NULL;
+  int rc = SQLITE_ERROR;
+  char op;
+
+  msg.data = (char*)data;
+  msg.len = msg.maxlen = (int)nbytes;
+  msg.cursor = 0;
+
+  op = (char)pq_getmsgbyte(&msg);
+  switch(op){
+  case SQLITE_FS_MSG_INSERT_ENTRY:
+    stmt = sqlite_fs_stmt(conn, SQLITE_FS_INSERT_ENTRY);
+    if(stmt == NULL)
+      return 1;
+    rc = (sqlite3_bind_int64(stmt, 1, pq_getmsgint64(&msg)) ||
+	  sqlite_fs_writer_bind(stmt, 2, &msg, false) ||
+	  sqlite3_bind_int64(stmt, 3, pq_getmsgint64(&msg)) ||
+	  sqlite3_bind_int64(stmt, 4, pq_getmsgint64(&msg)) ||
+	  sqlite3_bind_int64(stmt, 5, pq_getmsgint64(&msg)) ||
+	  sqlite3_bind_int64(stmt, 6, pq_getmsgint64(&msg)) ||
+	  sqlite3_bind_int64(stmt, 7, pq_getmsgint64(&msg)) ||
+	  sqlite3_bind_int(  stmt, 8, pq_getmsgbyte(&msg)));
+    break;
+  case SQLITE_FS_MSG_INSERT_FILE:
+    stmt = sqlite_fs_stmt(conn, SQLITE_FS_INSERT_FILE);
+    if(stmt == NULL)
+      return 1;
+    rc = (sqlite3_bind_int64(stmt, 1, pq_getmsgint64(&msg)) ||
+	  sqlite_fs_writer_bind(stmt, 2, &msg, false) ||
+	  sqlite_fs_writer_bind(stmt, 3, &msg, false) ||
+	  sqlite_fs_writer_bind(stmt, 4, &msg, true) ||
+	  sqlite3_bind_int64(stmt, 5, pq_getmsgint64(&msg)) ||
+	  sqlite_fs_writer_bind(stmt, 6, &msg, true) ||
+	  sqlite_fs_writer_bind(stmt, 7, &msg, true));
+    break;
+  case SQLITE_FS_MSG_DELETE_ENTRY:
+  case SQLITE_FS_MSG_DELETE_FILE:
+    stmt = sqlite_fs_stmt(conn, (op == SQLITE_FS_MSG_DELETE_ENTRY) ? SQLITE_FS_DELETE_ENTRY : SQLITE_FS_DELETE_FILE);
+    if(stmt == NULL)
+      return 1;
+    rc = sqlite3_bind_int64(stmt, 1, pq_getmsgint64(&msg));
+    break;
+  default:
+    W("Invalid request '%c' for %s", op, conn->path);
+    return 1;
+  }
+
+  if(rc == SQLITE_OK)
+    rc = sqlite3_step(stmt);
+  if(rc != SQLITE_DONE)
+    N("SQL error for the request '%c' in %s: %s", op, conn->path, sqlite3_errmsg(conn->db));
+
+  sqlite_fs_stmt_done(stmt);
+  return (rc == SQLITE_DONE) ? 0 : 1;
+}
+
+/* Applies the rows of a request, all or none, in the current transaction. Returns 0 on success. */
+static int
+sqlite_fs_writer_apply_batch(sqlite_fs_conn *conn, void *data, Size nbytes)
+{
+  StringInfoData msg;
+  int count, i, rc = 0;
+
+  msg.data = (char*)data;
+  msg.len = msg.maxlen = (int)nbytes;
+  msg.cursor = 0;
+
+  if(sqlite3_exec(conn->db, "SAVEPOINT sqlite_fs_writer;", NULL, NULL, NULL) != SQLITE_OK){
+    N("Error starting the request in %s: %s", conn->path, sqlite3_errmsg(conn->db));
+    return 1;
+  }
+
+  count = (int)pq_getmsgint(&msg, 4);
+  for(i = 0; i < count && rc == 0; i++){
+    int len = (int)pq_getmsgint(&msg, 4);
+    const char *row = pq_getmsgbytes(&msg, len);
+
+    rc = sqlite_fs_writer_apply(conn, (void*)row, len);
+  }
+
+  if(rc != 0)
+    sqlite3_exec(conn->db, "ROLLBACK TO sqlite_fs_writer;", NULL, NULL, NULL);
+  sqlite3_exec(conn->db, "RELEASE sqlite_fs_writer;", NULL, NULL, NULL);
+  return rc;
+}
+
+PGDLLEXPORT void
+pg_sqlite_fs_writer_main(Datum main_arg)
+{
+  sqlite_fs_writer_slot *slot;
+  sqlite_fs_conn *conn;
+  List *peers = NIL;
+  char path[MAXPGPATH];
+  MemoryContext round_cxt;
+  instr_time idle_since, now;
+
+  pqsignal(SIGHUP, SignalHandlerForConfigReload);
+  pqsignal(SIGTERM, die);
+  BackgroundWorkerUnblockSignals();
+
+  sqlite_fs_writer_slot_index = DatumGetInt32(main_arg);
+  slot = &sqlite_fs_writers->slots[sqlite_fs_writer_slot_index];
+
+  LWLockAcquire(sqlite_fs_writers->lock, LW_EXCLUSIVE);
+  slot->pid = MyProcPid;
+  slot->latch = MyLatch;
+  sqlite_fs_writer_generation = slot->generation;
+  strlcpy(path, slot->path, MAXPGPATH);
+  LWLockRelease(sqlite_fs_writers->lock);
+
+  before_shmem_exit(sqlite_fs_writer_exit, 0);
+
+  conn = sqlite_fs_conn_open(path, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+  if(conn == NULL)
+    proc_exit(1);
+
+  L("sqlite_fs writer started for %s", path);
+
+  round_cxt = AllocSetContextCreate(TopMemoryContext, "sqlite_fs writer round", ALLOCSET_DEFAULT_SIZES);
+  INSTR_TIME_SET_CURRENT(idle_since);
+
+  for(;;){
+    dsm_handle inbox[SQLITE_FS_WRITER_INBOX];
+    int ninbox, i, count = 0;
+    bool in_transaction = false, failed = false;
+    ListCell *lc;
+
+    ResetLatch(MyLatch);
+    CHECK_FOR_INTERRUPTS();
+
+    if(ConfigReloadPending){
+      ConfigReloadPending = false;
+      ProcessConfigFile(PGC_SIGHUP);
+    }
+
+    /* New backends */
+    LWLockAcquire(sqlite_fs_writers->lock, LW_EXCLUSIVE);
+    ninbox = slot->ninbox;
+    memcpy(inbox, slot->inbox, ninbox * sizeof(dsm_handle));
+    slot->ninbox = 0;
+    LWLockRelease(sqlite_fs_writers->lock);
+
+    for(i = 0; i < ninbox; i++){
+      sqlite_fs_writer_peer *peer = sqlite_fs_writer_attach(inbox[i]);
+      if(peer)
+	peers = lappend(peers, peer);
+    }
+
+    /* One request per backend (they wait for the reply), in one transaction */
+    MemoryContextSwitchTo(round_cxt);
+    foreach(lc, peers){
+      sqlite_fs_writer_peer *peer = (sqlite_fs_writer_peer*)lfirst(lc);
+      shm_mq_result res;
+      Size nbytes;
+      void *data;
+
+      res = shm_mq_receive(peer->in, &nbytes, &data, true);
+      if(res == SHM_MQ_WOULD_BLOCK)
+	continue;
+      if(res == SHM_MQ_DETACHED){ /* the backend is gone */
+	dsm_detach(peer->seg);
+	pfree(peer);
+	peers = foreach_delete_current(peers, lc);
+	continue;
+      }
+
+      /* a failed BEGIN fails the requests of this round, not the writer */
+      if(!in_transaction && !failed){
+	if(sqlite3_exec(conn->db, "BEGIN TRANSACTION;", NULL, NULL, NULL) == SQLITE_OK)
+	  in_transaction = true;
+	else {
+	  N("Error starting transaction in %s: %s", path, sqlite3_errmsg(conn->db));
+	  failed = true;
+	}
+      }
+
+      peer->status = (failed) ? 1 : (char)sqlite_fs_writer_apply_batch(conn, data, nbytes);
+      peer->pending = true;
+      count++;
+    }
+    MemoryContextSwitchTo(TopMemoryContext);
+    MemoryContextReset(round_cxt);
+
+    if(in_transaction && sqlite3_exec(conn->db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK){
+      N("Error committing %d request(s) in %s: %s", count, path, sqlite3_errmsg(conn->db));
+      sqlite3_exec(conn->db, "ROLLBACK;", NULL, NULL, NULL);
+      foreach(lc, peers)
+	((sqlite_fs_writer_peer*)lfirst(lc))->status = 1;
+    }
+
+    foreach(lc, peers){
+      sqlite_fs_writer_peer *peer = (sqlite_fs_writer_peer*)lfirst(lc);
+
+      if(!peer->pending)
+	continue;
+      peer->pending = false;
+      if(shm_mq_send(peer->out, 1, &peer->status, false, true) != SHM_MQ_SUCCESS){
+	dsm_detach(peer->seg);
+	pfree(peer);
+	peers = foreach_delete_current(peers, lc);
+      }
+    }
+
+    if(count > 0){
+      D2("%s: %d request(s) committed", path, count);
+      continue; /* more might have arrived in the meantime */
+    }
+
+    INSTR_TIME_SET_CURRENT(now);
+    if(peers != NIL || ninbox > 0)
+      idle_since = now;
+    else {
+      INSTR_TIME_SUBTRACT(now, idle_since);
+      if(INSTR_TIME_GET_MILLISEC(now) >= pg_sqlite_fs_writer_idle_timeout * 1000.0){
+	bool done;
+
+	LWLockAcquire(sqlite_fs_writers->lock, LW_EXCLUSIVE);
+	done = (slot->ninbox == 0);
+	if(done){
+	  slot->in_use = false;
+	  slot->pid = 0;
+	  slot->latch = NULL;
+	}
+	LWLockRelease(sqlite_fs_writers->lock);
+
+	if(done){
+	  L("sqlite_fs writer for %s stopping: idle", path);
+	  sqlite_fs_conn_release(conn);
+	  proc_exit(0);
+	}
+	continue;
+      }
+    }
+
+    (void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH, 1000L, PG_WAIT_EXTENSION);
+  }
+}
+
+
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_create);
+Datum
+pg_sqlite_fs_create(PG_FUNCTION_ARGS)
+{
+
+  int rc = 1;
+  char* db_path;
+  char* err = NULL;
+  sqlite_fs_conn *conn = NULL;
+  sqlite3 *db;
+  mode_t m;
+
+  if(PG_NARGS() != 1){
+    E("Invalid number of arguments: expected 1, got %d", PG_NARGS());
+    PG_RETURN_BOOL(false);
+  }
+
+  if(PG_ARGISNULL(0)){
+    E("Null arguments not accepted");
+    PG_RETURN_BOOL(false);
+  }
+
+  db_path = convert_and_check_path(PG_GETARG_TEXT_PP(0)); // allocated in the function context: will be cleaned by PG
+
+  sqlite_fs_conn_invalidate(db_path); // start afresh
+
+  m = umask(0007);
+  D2("Database open: %s | mask: %o", db_path, m);
+
+  conn = sqlite_fs_conn_open(db_path, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+
+  if( conn == NULL ) {
+    rc = 1;
+    goto bailout;
+  }
+  db = conn->db;
+
+  /* No effect if the database already exists */
+  sqlite_fs_pragma(conn, "PRAGMA page_size = %d;", pg_sqlite_fs_page_size);
+  sqlite_fs_pragma(conn, "PRAGMA auto_vacuum = %d;", pg_sqlite_fs_auto_vacuum);
+
+  {
+    char sql[64];
+    snprintf(sql, sizeof(sql), "PRAGMA journal_mode = %s;", journal_mode_options[pg_sqlite_fs_journal_mode].name);
+    if(sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK)
+      W("SQL error for '%s' in %s: %s", sql, db_path, sqlite3_errmsg(db));
+  }
+
+  /* Execute SQL statement */
+  rc = sqlite3_exec(db, sqlite_fs_schema(), NULL, NULL, &err);
+  if( rc == SQLITE_OK )
+    rc = sqlite3_exec(db, names_index, NULL, NULL, &err);
+   
+  if( rc != SQLITE_OK ){
+    N("SQL error creating schema: %s", err);
+    rc = 2;
+    goto bailout;
+  }
+
+  D3("Successfully created: %s", db_path);
+  rc = 0; // success
+  
+bailout:
+  if(err) sqlite3_free(err);
+  sqlite_fs_conn_release(conn);
+  (void)umask(m); // reset back to old mask
+  PG_RETURN_BOOL(((rc)?false:true));
+}
+
+
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_remove);
+Datum
+pg_sqlite_fs_remove(PG_FUNCTION_ARGS)
+{
+
+  char* db_path;
+
+  if(PG_NARGS() != 1){
+    E("Invalid number of arguments: expected 1, got %d", PG_NARGS());
+    PG_RETURN_BOOL(false);
+  }
+
+  if(PG_ARGISNULL(0)){
+    E("Null arguments not accepted");
+    PG_RETURN_BOOL(false);
+  }
+
+  db_path = convert_and_check_path(PG_GETARG_TEXT_PP(0)); // allocated in the function context: will be cleaned by PG
+
+  sqlite_fs_conn_invalidate(db_path);
+
+  PG_RETURN_BOOL((unlink(db_path))?false:true);
+}
+
+
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_insert_file);
+Datum
+pg_sqlite_fs_insert_file(PG_FUNCTION_ARGS)
+{
+
+  int rc = 1;
+  char* db_path;
+  sqlite_fs_conn *conn = NULL;
+  sqlite3 *db;
+  sqlite3_stmt *stmt = NULL;
+  text  *rpath = NULL;
+  text  *mnt = NULL;
+  bytea *header = NULL;
+  bytea *prepend = NULL;
+  bytea *append = NULL;
+
+  if(PG_NARGS() != 8){
+    E("Invalid number of arguments: expected 8, got %d", PG_NARGS());
+    PG_RETURN_BOOL(false);
+  }
+
+  if(PG_ARGISNULL(0) || PG_ARGISNULL(1)){
+    E("First 2 arguments can't be null");
+    PG_RETURN_BOOL(false);
+  }
+
+  db_path = convert_and_check_path(PG_GETARG_TEXT_PP(0)); // allocated in the function context: will be cleaned by PG
+
+  if(pg_sqlite_fs_use_writer)
+    PG_RETURN_BOOL(sqlite_fs_writer_insert_file(db_path, fcinfo));
+
+  conn = sqlite_fs_conn_open(db_path, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+
+  if( conn == NULL ) {
+    rc = 1;
+    goto bailout;
+  }
+  db = conn->db;
+
+  /* SQL statement */
+  // 1: inode
+  if(!PG_ARGISNULL(2)) mnt = PG_GETARG_TEXT_PP(2);
+  if(!PG_ARGISNULL(3)) rpath = PG_GETARG_TEXT_PP(3);
+  if(!PG_ARGISNULL(4)) header = PG_GETARG_BYTEA_PP(4);
+  // 5: payload_size
+  if(!PG_ARGISNULL(6)) prepend = PG_GETARG_BYTEA_PP(6);
+  if(!PG_ARGISNULL(7)) append = PG_GETARG_BYTEA_PP(7);
+
+  D1("Inserting %.*s/%.*s", (int)VARSIZE_ANY_EXHDR(mnt), VARDATA_ANY(mnt), (int)VARSIZE_ANY_EXHDR(rpath), VARDATA_ANY(rpath));
+
+  stmt = sqlite_fs_stmt(conn, SQLITE_FS_INSERT_FILE);
+  if( stmt == NULL ) {
+    rc = 1;
+    goto bailout;
+  }
+
+  /* Bind arguments */
+  D2("Binding arguments for inserting file");
+  rc = (sqlite3_bind_int64(stmt, 1, PG_GETARG_INT64(1)) ||
+	( (PG_ARGISNULL(2)) ? sqlite3_bind_null(stmt, 2)
+	                    : sqlite3_bind_text(stmt, 2, VARDATA_ANY(mnt), (int)VARSIZE_ANY_EXHDR(mnt), SQLITE_STATIC)) || // we handle destruction
+	( (PG_ARGISNULL(3)) ? sqlite3_bind_null(stmt, 3)
+ 	                    : sqlite3_bind_text(stmt, 3, VARDATA_ANY(rpath), (int)VARSIZE_ANY_EXHDR(rpath), SQLITE_STATIC)) || // we handle destruction
+	( (PG_ARGISNULL(4)) ? sqlite3_bind_null(stmt, 4)
+	                    : sqlite3_bind_blob(stmt, 4, VARDATA_ANY(header), (int)VARSIZE_ANY_EXHDR(header), SQLITE_STATIC) ) ||
+	sqlite3_bind_int64(stmt, 5,  ((PG_ARGISNULL(5)) ? 0 : PG_GETARG_INT64(5))) ||
+	( (PG_ARGISNULL(6)) ? sqlite3_bind_null(stmt, 6)
+	                    : sqlite3_bind_blob(stmt, 6, VARDATA_ANY(prepend), (int)VARSIZE_ANY_EXHDR(prepend), SQLITE_STATIC) ) ||
+	                      // sqlite3_bind_blob64 is too much, come on!
+	( (PG_ARGISNULL(7)) ? sqlite3_bind_null(stmt, 7)
+	                    : sqlite3_bind_blob(stmt, 7, VARDATA_ANY(append), (int)VARSIZE_ANY_EXHDR(append), SQLITE_STATIC) )
+	                      // sqlite3_bind_blob64 is too much, come on!
+	);
+  if( rc != SQLITE_OK ){
+    N("SQL error binding arguments: %s", sqlite3_errmsg(db));
+    rc = 2;
+    goto bailout;
+  }
+
+  {
+    char* expanded_sql = sqlite3_expanded_sql(stmt);
+    D1("expanded statement: %s", expanded_sql);
+    sqlite3_free(expanded_sql);
+  }
+
+  /* Execute SQL prepared statement */
+  D2("Execute statement for insert file");
+  rc = sqlite3_step(stmt);
+  if( rc != SQLITE_DONE ){
+    N("SQL error inserting the file: %s | error: %d", sqlite3_errmsg(db), rc);
+    rc = 3;
+    goto bailout;
+  }
+
+  D3("Successfully inserted file %ld", PG_GETARG_INT64(1));
+  rc = 0; // success
+  
+bailout:
+  sqlite_fs_stmt_done(stmt);
+  sqlite_fs_conn_release(conn);
+  PG_RETURN_BOOL(((rc)?false:true));
+}
+
+
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_insert_entry);
+Datum
+pg_sqlite_fs_insert_entry(PG_FUNCTION_ARGS)
+{
+
+  int rc = 1;
+  char* db_path;
+  sqlite_fs_conn *conn = NULL;
+  sqlite3 *db;
+  sqlite3_stmt *stmt = NULL;
+  text* name;
+  int64 inode, parent_inode;
+
+
+  if(PG_NARGS() < 4){
+    E("Invalid number of arguments: expected at least 4, got %d", PG_NARGS());
+    PG_RETURN_BOOL(false);
+  }
+
+  if(PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(2) || PG_ARGISNULL(3)){
+    E("Null arguments not accepted");
+    PG_RETURN_BOOL(false);
+  }
+
+  db_path = convert_and_check_path(PG_GETARG_TEXT_PP(0)); // allocated in the function context: will be cleaned by PG
+
+  if(pg_sqlite_fs_use_writer)
+    PG_RETURN_BOOL(sqlite_fs_writer_insert_entry(db_path, fcinfo));
+
+  conn = sqlite_fs_conn_open(db_path, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+
+  if( conn == NULL ) {
+    rc = 1;
+    goto bailout;
+  }
+  db = conn->db;
+
+  inode = PG_GETARG_INT64(1);
+  name = PG_GETARG_TEXT_PP(2);
+  parent_inode = PG_GETARG_INT64(3);
+  D2("Inserting entry [%ld]/%*s | %ld", parent_inode, (int)VARSIZE_ANY_EXHDR(name), VARDATA_ANY(name), inode);
 
   /* SQL statement */
-  rc = sqlite3_prepare_v2(db,
-			  "INSERT INTO entries(inode,name,parent_inode,ctime,mtime,nlink,size,is_dir)"
-			  "VALUES(?,?,?,?,?,?,?,?)"
-			  //" ON CONFLICT(inode) DO NOTHING;",
-			  " ON CONFLICT(inode) DO UPDATE SET name=excluded.name,"
-			                                   " parent_inode=excluded.parent_inode,"
-			                                   " ctime=excluded.ctime,"
-			                                   " mtime=excluded.mtime,"
-			                                   " nlink=excluded.nlink,"
-			                                   " size=excluded.size,"
-			                                   " is_dir=excluded.is_dir;",
-			  -1, &stmt, NULL);
+  stmt = sqlite_fs_stmt(conn, SQLITE_FS_INSERT_ENTRY);
+  if( stmt == NULL ) {
+    rc = 1;
+    goto bailout;
+  }
+
+  /* Bind arguments */
+  D2("Binding arguments while inserting entry");
+
+  rc = rc ||
+    (sqlite3_bind_int64(stmt, 1, inode) ||
+     sqlite3_bind_text( stmt, 2, VARDATA_ANY(name), (int)VARSIZE_ANY_EXHDR(name), SQLITE_STATIC) || // we handle destruction
+     sqlite3_bind_int64(stmt, 3, parent_inode) ||
+     sqlite3_bind_int64(stmt, 4, PG_GETARG_INT64(4)) || // ctime
+     sqlite3_bind_int64(stmt, 5, PG_GETARG_INT64(5)) || // mtime
+     sqlite3_bind_int64(stmt, 6, PG_GETARG_INT64(6)) || // nlink
+     sqlite3_bind_int64(stmt, 7, PG_GETARG_INT64(7)) || // size
+     sqlite3_bind_int(  stmt, 8, (PG_GETARG_BOOL(8))?1:0) // is_dir
+     );
+  if( rc != SQLITE_OK ) {
+    N("Error binding main arguments: %s", sqlite3_errmsg(db));
+    rc = 2;
+    goto bailout;
+  }
+
+  /* Execute SQL prepared statement */
+  D2("Execute statement for insert entry");
+  rc = sqlite3_step(stmt);
+  if( rc != SQLITE_DONE ){
+    N("SQL error inserting entry: %ld | error %d: %s", inode, rc, sqlite3_errstr(rc));
+    rc = 3;
+    goto bailout;
+  }
+
+  D3("Successfully inserted entry %ld ([%ld]/%*s)", inode, parent_inode, (int)VARSIZE_ANY_EXHDR(name), VARDATA_ANY(name));
+  rc = 0; // success
+  
+bailout:
+  sqlite_fs_stmt_done(stmt);
+  sqlite_fs_conn_release(conn);
+  PG_RETURN_BOOL(((rc)?false:true));
+}
+
+
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_delete_file);
+Datum
+pg_sqlite_fs_delete_file(PG_FUNCTION_ARGS)
+{
+    int rc = 1;
+    char* db_path;
+    int64 inode;
+    sqlite_fs_conn *conn = NULL;
+    sqlite3 *db;
+    sqlite3_stmt *stmt = NULL;
+
+    db_path = convert_and_check_path(PG_GETARG_TEXT_PP(0)); // allocated in the function context: will be cleaned by PG
+
+    if(pg_sqlite_fs_use_writer)
+      PG_RETURN_BOOL(sqlite_fs_writer_delete(db_path, SQLITE_FS_MSG_DELETE_FILE, PG_GETARG_INT64(1)));
+
+    N("Opening database %s", db_path);
+
+    conn = sqlite_fs_conn_open(db_path, SQLITE_OPEN_READWRITE);
+    if( conn == NULL )
+      E("SQL error opening database: %s", db_path);
+    db = conn->db;
+	
+    stmt = sqlite_fs_stmt(conn, SQLITE_FS_DELETE_FILE);
+    if( stmt == NULL )
+      goto bailout;
+
+    inode = PG_GETARG_INT64(1);
+
+    rc = sqlite3_bind_int64(stmt, 1, inode);
+    if( rc != SQLITE_OK ) {
+      N("Error binding main arguments: %s", sqlite3_errmsg(db));
+      goto bailout;
+    }
+
+    /* Execute SQL prepared statement */
+    D1("Execute statement for deleting a file");
+    rc = sqlite3_step(stmt);
+    if( rc != SQLITE_DONE ){
+      N("Error: %s", sqlite3_errmsg(db));
+      rc = 1;
+    }
+    rc = 0; // success
+
+bailout:
+    sqlite_fs_stmt_done(stmt);
+    sqlite_fs_conn_release(conn);
+    PG_RETURN_BOOL(((rc)?false:true));
+}
+
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_delete_entry);
+Datum
+pg_sqlite_fs_delete_entry(PG_FUNCTION_ARGS)
+{
+    int rc = 1;
+    char* db_path;
+    int64 inode;
+    sqlite_fs_conn *conn = NULL;
+    sqlite3 *db;
+    sqlite3_stmt *stmt = NULL;
+
+    db_path = convert_and_check_path(PG_GETARG_TEXT_PP(0)); // allocated in the function context: will be cleaned by PG
+
+    if(pg_sqlite_fs_use_writer)
+      PG_RETURN_BOOL(sqlite_fs_writer_delete(db_path, SQLITE_FS_MSG_DELETE_ENTRY, PG_GETARG_INT64(1)));
+
+    N("Opening database %s", db_path);
+
+    conn = sqlite_fs_conn_open(db_path, SQLITE_OPEN_READWRITE);
+    if( conn == NULL )
+      E("SQL error opening database: %s", db_path);
+    db = conn->db;
+	
+    stmt = sqlite_fs_stmt(conn, SQLITE_FS_DELETE_ENTRY);
+    if( stmt == NULL )
+      goto bailout;
+
+    inode = PG_GETARG_INT64(1);
+
+    rc = sqlite3_bind_int64(stmt, 1, inode);
+    if( rc != SQLITE_OK ) {
+      N("Error binding main arguments: %s", sqlite3_errmsg(db));
+      goto bailout;
+    }
+
+    /* Execute SQL prepared statement */
+    D1("Execute statement for deleting an entry");
+    while(1){
+      rc = sqlite3_step(stmt);
+      if( rc == SQLITE_DONE ){
+	rc = 0; // success
+	goto bailout;
+      }
+      if( rc != SQLITE_ROW ) {
+	N("Error: %s", sqlite3_errmsg(db));
+	rc = 1;
+	goto bailout;
+      }
+    }
+
+bailout:
+    sqlite_fs_stmt_done(stmt);
+    sqlite_fs_conn_release(conn);
+    PG_RETURN_BOOL(((rc)?false:true));
+}
+
+
+/* auto_vacuum of the database: 0 none, 1 full, 2 incremental (-1 on error) */
+static int
+sqlite_fs_auto_vacuum_mode(sqlite_fs_conn *conn)
+{
+  sqlite3_stmt *stmt = NULL;
+  int mode = -1;
+
+  if(sqlite3_prepare_v2(conn->db, "PRAGMA auto_vacuum;", -1, &stmt, NULL) == SQLITE_OK &&
+     sqlite3_step(stmt) == SQLITE_ROW)
+    mode = sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+  return mode;
+}
+
+static bool
+pg_sqlite_fs_truncate_table(PG_FUNCTION_ARGS, const char* sql, const char* checkpoint, const char* query)
+{
+    int rc = 1;
+    char* db_path;
+    sqlite_fs_conn *conn = NULL;
+    sqlite3 *db;
+    char* err = NULL;
+
+    db_path = convert_and_check_path(PG_GETARG_TEXT_PP(0)); // allocated in the function context: will be cleaned by PG
+    N("Opening database %s", db_path);
+
+    conn = sqlite_fs_conn_open(db_path, SQLITE_OPEN_READWRITE);
+    if( conn == NULL )
+      E("SQL error opening database: %s", db_path);
+    db = conn->db;
+	
+    D1("Execute statement: %s", sql);
+    rc = sqlite3_exec(db, sql, NULL, NULL, &err);
+   
+    if( rc != SQLITE_OK ){
+      N("SQL error for '%s' in %s: %s", sql, db_path, err);
+      if(!sqlite3_get_autocommit(db))
+	(void)sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+    }
+
+    if(err)
+      sqlite3_free(err);
+
+    /* give the free pages back to the file system */
+    if( rc == SQLITE_OK && sqlite_fs_auto_vacuum_mode(conn) == 2 &&
+	sqlite3_exec(db, "PRAGMA incremental_vacuum;", NULL, NULL, NULL) != SQLITE_OK )
+      W("Incremental vacuum of %s failed: %s", db_path, sqlite3_errmsg(db));
+
+    /* a checkpoint would skip rows of the next load */
+    if( rc == SQLITE_OK && checkpoint &&
+	(sqlite_fs_meta_del(conn, checkpoint) || sqlite_fs_meta_del(conn, query)) )
+      rc = SQLITE_ERROR;
+
+    sqlite_fs_conn_release(conn);
+
+    return (rc == SQLITE_OK)?true:false;
+}
+
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_truncate_entries);
+Datum
+pg_sqlite_fs_truncate_entries(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_BOOL(pg_sqlite_fs_truncate_table(fcinfo,
+				   /* without WHERE, SQLite drops the pages in one go: keep the root aside */
+				   "BEGIN TRANSACTION;"
+				   "CREATE TEMP TABLE IF NOT EXISTS root_entry AS SELECT * FROM entries WHERE 0;"
+				   "DELETE FROM temp.root_entry;"
+				   "INSERT INTO temp.root_entry SELECT * FROM entries WHERE inode = 1;"
+				   "DELETE FROM entries;"
+				   "INSERT INTO entries SELECT * FROM temp.root_entry;"
+				   "COMMIT;",
+				   "entries.checkpoint", "entries.query"));
+}
+
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_truncate_files);
+Datum
+pg_sqlite_fs_truncate_files(PG_FUNCTION_ARGS)
+{
+  // See https://www.sqlite.org/lang_delete.html#the_truncate_optimization
+  PG_RETURN_BOOL(pg_sqlite_fs_truncate_table(fcinfo, "DELETE FROM files", "files.checkpoint", "files.query"));
+}
+
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_truncate_attributes);
+Datum
+pg_sqlite_fs_truncate_attributes(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_BOOL(pg_sqlite_fs_truncate_table(fcinfo, "DELETE FROM extended_attributes", NULL, NULL));
+}
+
+
+/*
+ * checkpoint(path, mode): checkpoints the WAL of the database.
+ * mode is PASSIVE (default), FULL, RESTART or TRUNCATE, see sqlite3_wal_checkpoint_v2.
+ * Returns (busy, log, checkpointed): whether it was blocked, and the frames in the WAL and copied back.
+ */
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_checkpoint);
+Datum
+pg_sqlite_fs_checkpoint(PG_FUNCTION_ARGS)
+{
+  int rc;
+  char* db_path;
+  char* mode_name = "PASSIVE";
+  int mode;
+  int nlog = -1, nckpt = -1;
+  sqlite_fs_conn *conn = NULL;
+  TupleDesc tupdesc;
+  Datum values[3];
+  bool nulls[3] = { false, false, false };
+
+  if(PG_ARGISNULL(0))
+    E("Null arguments not accepted");
+
+  if(get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+    E("Function returning record called in context that cannot accept type record");
+
+  db_path = convert_and_check_path(PG_GETARG_TEXT_PP(0)); // allocated in the function context: will be cleaned by PG
+  if(PG_NARGS() > 1 && !PG_ARGISNULL(1))
+    mode_name = text_to_cstring(PG_GETARG_TEXT_PP(1));
+
+  if(pg_strcasecmp(mode_name, "PASSIVE") == 0)
+    mode = SQLITE_CHECKPOINT_PASSIVE;
+  else if(pg_strcasecmp(mode_name, "FULL") == 0)
+    mode = SQLITE_CHECKPOINT_FULL;
+  else if(pg_strcasecmp(mode_name, "RESTART") == 0)
+    mode = SQLITE_CHECKPOINT_RESTART;
+  else if(pg_strcasecmp(mode_name, "TRUNCATE") == 0)
+    mode = SQLITE_CHECKPOINT_TRUNCATE;
+  else
+    E("Invalid checkpoint mode: %s | expecting PASSIVE, FULL, RESTART or TRUNCATE", mode_name);
+
+  conn = sqlite_fs_conn_open(db_path, SQLITE_OPEN_READWRITE);
+  if( conn == NULL )
+    E("SQL error opening database: %s", db_path);
+
+  rc = sqlite3_wal_checkpoint_v2(conn->db, NULL, mode, &nlog, &nckpt);
+  if( rc != SQLITE_OK && rc != SQLITE_BUSY ){
+    N("Error checkpointing %s: %s", db_path, sqlite3_errmsg(conn->db));
+    sqlite_fs_conn_release(conn);
+    PG_RETURN_NULL();
+  }
+  sqlite_fs_conn_release(conn);
+
+  D1("Checkpoint %s of %s: %d frame(s) in the WAL, %d checkpointed%s",
+     mode_name, db_path, nlog, nckpt, (rc == SQLITE_BUSY) ? " (busy)" : "");
+
+  values[0] = BoolGetDatum(rc == SQLITE_BUSY);
+  values[1] = Int32GetDatum(nlog);
+  values[2] = Int32GetDatum(nckpt);
+  PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls)));
+}
+
+
+/*
+ * readdir(path, parent_inode): the entries of a directory, sorted by name.
+ *
+ * Value-per-call: each call steps the statement once, so the rows are
+ * streamed when called in the select list, and a LIMIT stops reading.
+ * In FROM, the function scan stores them all first. The connection stays pinned until
+ * the end of the scan, or the shutdown of the expression context
+ * when the scan is not run to completion.
+ * The cached statement is used, unless it is already running
+ * (eg readdir() called per row of another readdir()): then a private one.
+ */
+
+typedef struct sqlite_fs_readdir_state {
+  sqlite_fs_conn *conn;
+  sqlite3_stmt   *stmt;
+  bool            private_stmt; /* to finalize */
+} sqlite_fs_readdir_state;
+
+static void
+sqlite_fs_readdir_end(Datum arg)
+{
+  sqlite_fs_readdir_state *state = (sqlite_fs_readdir_state*)DatumGetPointer(arg);
+
+  if(state->conn == NULL)
+    return;
+
+  if(state->private_stmt)
+    sqlite3_finalize(state->stmt);
+  else
+    sqlite_fs_stmt_done(state->stmt);
+  state->stmt = NULL;
+  sqlite_fs_conn_release(state->conn);
+  state->conn = NULL;
+}
+
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_readdir);
+Datum
+pg_sqlite_fs_readdir(PG_FUNCTION_ARGS)
+{
+  FuncCallContext *funcctx;
+  sqlite_fs_readdir_state *state;
+  int rc;
+
+  if(SRF_IS_FIRSTCALL()){
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    MemoryContext old_cxt;
+    TupleDesc tupdesc;
+    char *db_path;
+    int64 parent;
+
+    if(PG_ARGISNULL(0) || PG_ARGISNULL(1))
+      E("Null arguments not accepted");
+
+    if(rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+      E("readdir called in a context that cannot accept a set");
+
+    funcctx = SRF_FIRSTCALL_INIT();
+    old_cxt = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+    if(get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+      E("Function returning record called in context that cannot accept type record");
+    funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+    db_path = convert_and_check_path(PG_GETARG_TEXT_PP(0));
+    parent = PG_GETARG_INT64(1);
+
+    state = (sqlite_fs_readdir_state*)palloc0(sizeof(sqlite_fs_readdir_state));
+    funcctx->user_fctx = state;
+    MemoryContextSwitchTo(old_cxt);
+
+    state->conn = sqlite_fs_conn_open(db_path, SQLITE_OPEN_READWRITE);
+    if(state->conn == NULL)
+      E("SQL error opening database: %s", db_path);
+
+    state->stmt = sqlite_fs_stmt(state->conn, SQLITE_FS_READDIR);
+    if(state->stmt != NULL && sqlite3_stmt_busy(state->stmt)){
+      D2("readdir statement busy in %s: using a private one", db_path);
+      if(sqlite3_prepare_v2(state->conn->db, sqlite_fs_stmts_sql[SQLITE_FS_READDIR], -1, &state->stmt, NULL) != SQLITE_OK)
+	state->stmt = NULL;
+      else
+	state->private_stmt = true;
+    }
+    if(state->stmt == NULL){
+      sqlite_fs_conn_release(state->conn);
+      state->conn = NULL;
+      E("Error preparing the readdir statement for %s", db_path);
+    }
+
+    /* from now on, released at the end of the scan or by the shutdown callback */
+    RegisterExprContextCallback(rsinfo->econtext, sqlite_fs_readdir_end, PointerGetDatum(state));
+
+    if(sqlite3_bind_int64(state->stmt, 1, parent) != SQLITE_OK)
+      E("SQL error binding arguments: %s", sqlite3_errmsg(state->conn->db));
+  }
+
+  funcctx = SRF_PERCALL_SETUP();
+  state = (sqlite_fs_readdir_state*)funcctx->user_fctx;
+
+  rc = sqlite3_step(state->stmt);
+  if(rc == SQLITE_ROW){
+    Datum values[5];
+    bool nulls[5] = { false, false, false, false, false };
+
+    values[0] = Int64GetDatum(sqlite3_column_int64(state->stmt, 0));
+    values[1] = PointerGetDatum(cstring_to_text_with_len((const char*)sqlite3_column_text(state->stmt, 1),
+							   sqlite3_column_bytes(state->stmt, 1)));
+    values[2] = BoolGetDatum(sqlite3_column_int(state->stmt, 2) != 0);
+    values[3] = Int64GetDatum(sqlite3_column_int64(state->stmt, 3));
+    values[4] = Int64GetDatum(sqlite3_column_int64(state->stmt, 4));
+
+    SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+  }
+
+  if(rc != SQLITE_DONE)
+    E("SQL error reading the entries of %s: %s", state->conn->path, sqlite3_errmsg(state->conn->db));
+
+  /* SRF_RETURN_DONE frees the state: the callback must not run after it */
+  sqlite_fs_readdir_end(PointerGetDatum(state));
+  UnregisterExprContextCallback(((ReturnSetInfo *) fcinfo->resultinfo)->econtext,
+				sqlite_fs_readdir_end, PointerGetDatum(state));
+  SRF_RETURN_DONE(funcctx);
+}
+
+
+/*
+ * lookup(path, fspath): resolves fspath, eg /a/b/c/file.c4gh, from the root (inode 1)
+ * and returns (inode, is_dir, size, ctime, mtime, nlink), or NULL if not found.
+ *
+ * Each component is a probe of the names index. The resolved components are
+ * cached per connection, (parent inode, name) -> (inode, is_dir), so that
+ * the paths under the same prefix only probe for their last components.
+ * The cache is emptied when the database changed: PRAGMA data_version for
+ * the other connections, and sqlite3_total_changes64 for this one.
+ * It is not used inside a SQLite transaction, which could roll back.
+ */
+
+#define SQLITE_FS_NAME_LEN 256 /* longer names are not cached */
+
+typedef struct sqlite_fs_dentry_key {
+  int64 parent;
+  char  name[SQLITE_FS_NAME_LEN]; /* zero padded: the key is compared as a blob */
+} sqlite_fs_dentry_key;
+
+typedef struct sqlite_fs_dentry {
+  sqlite_fs_dentry_key key; /* hash key: must be first */
+  int64 inode;
+  bool  is_dir;
+} sqlite_fs_dentry;
+
+/* Returns the cache of the connection, emptied if the database changed, or NULL if not to be used */
+static HTAB *
+sqlite_fs_dentries(sqlite_fs_conn *conn)
+{
+  sqlite3_stmt *stmt;
+  int64 version = -1;
+  int64 changes;
+
+  if(pg_sqlite_fs_dentry_cache_size == 0 || !sqlite3_get_autocommit(conn->db))
+    return NULL;
+
+  stmt = sqlite_fs_stmt(conn, SQLITE_FS_DATA_VERSION);
+  if(stmt == NULL)
+    return NULL;
+  if(sqlite3_step(stmt) == SQLITE_ROW)
+    version = sqlite3_column_int64(stmt, 0);
+  sqlite_fs_stmt_done(stmt);
+  if(version < 0)
+    return NULL;
+  changes = sqlite3_total_changes64(conn->db);
+
+  if(conn->dentries &&
+     (conn->data_version != version || conn->total_changes != changes ||
+      hash_get_num_entries(conn->dentries) >= pg_sqlite_fs_dentry_cache_size)){
+    D2("Emptying the dentry cache of %s", conn->path);
+    hash_destroy(conn->dentries);
+    conn->dentries = NULL;
+  }
+
+  if(conn->dentries == NULL){
+    HASHCTL ctl;
+    ctl.keysize = sizeof(sqlite_fs_dentry_key);
+    ctl.entrysize = sizeof(sqlite_fs_dentry);
+    ctl.hcxt = TopMemoryContext;
+    conn->dentries = hash_create("sqlite_fs dentries", 256, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    conn->data_version = version;
+    conn->total_changes = changes;
+  }
+  return conn->dentries;
+}
+
+/* Returns 1 if found, 0 if not found, -1 on error */
+static int
+sqlite_fs_lookup_name(sqlite_fs_conn *conn, HTAB *dentries, int64 parent, const char *name, int len,
+		      int64 *inode, bool *is_dir)
+{
+  sqlite_fs_dentry_key key;
+  sqlite_fs_dentry *dentry;
+  sqlite3_stmt *stmt;
+  int rc;
+
+  if(dentries && len < SQLITE_FS_NAME_LEN){
+    memset(&key, 0, sizeof(key));
+    key.parent = parent;
+    memcpy(key.name, name, len);
+    dentry = (sqlite_fs_dentry*)hash_search(dentries, &key, HASH_FIND, NULL);
+    if(dentry){
+      *inode = dentry->inode;
+      *is_dir = dentry->is_dir;
+      return 1;
+    }
+  } else
+    dentries = NULL;
+
+  stmt = sqlite_fs_stmt(conn, SQLITE_FS_LOOKUP);
+  if(stmt == NULL)
+    return -1;
+
+  if(sqlite3_bind_int64(stmt, 1, parent) ||
+     sqlite3_bind_text(stmt, 2, name, len, SQLITE_STATIC)){
+    N("SQL error binding arguments: %s", sqlite3_errmsg(conn->db));
+    sqlite_fs_stmt_done(stmt);
+    return -1;
+  }
+
+  rc = sqlite3_step(stmt);
+  if(rc == SQLITE_ROW){
+    *inode = sqlite3_column_int64(stmt, 0);
+    *is_dir = (sqlite3_column_int(stmt, 1) != 0);
+    rc = 1;
+  } else if(rc == SQLITE_DONE)
+    rc = 0;
+  else {
+    N("SQL error looking up %.*s in %s: %s", len, name, conn->path, sqlite3_errmsg(conn->db));
+    rc = -1;
+  }
+  sqlite_fs_stmt_done(stmt);
+
+  if(rc == 1 && dentries){
+    dentry = (sqlite_fs_dentry*)hash_search(dentries, &key, HASH_ENTER, NULL);
+    dentry->inode = *inode;
+    dentry->is_dir = *is_dir;
+  }
+  return rc;
+}
+
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_lookup);
+Datum
+pg_sqlite_fs_lookup(PG_FUNCTION_ARGS)
+{
+  int rc = 1;
+  char *db_path;
+  char *fspath, *p, *name;
+  sqlite_fs_conn *conn = NULL;
+  HTAB *dentries;
+  sqlite3_stmt *stmt;
+  TupleDesc tupdesc;
+  Datum values[6];
+  bool nulls[6] = { false, false, false, false, false, false };
+  int64 inode = 1; /* the root */
+  bool is_dir = true;
+
+  if(PG_ARGISNULL(0) || PG_ARGISNULL(1))
+    E("Null arguments not accepted");
+
+  if(get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+    E("Function returning record called in context that cannot accept type record");
+
+  db_path = convert_and_check_path(PG_GETARG_TEXT_PP(0));
+  fspath = text_to_cstring(PG_GETARG_TEXT_PP(1));
+
+  if(fspath[0] != '/')
+    E("Invalid path: %s | must be absolute", fspath);
+
+  conn = sqlite_fs_conn_open(db_path, SQLITE_OPEN_READWRITE);
+  if( conn == NULL )
+    E("SQL error opening database: %s", db_path);
+
+  dentries = sqlite_fs_dentries(conn);
+
+  for(p = fspath; *p; ){
+    int len;
+
+    while(*p == '/') p++;
+    name = p;
+    while(*p && *p != '/') p++;
+    len = (int)(p - name);
+
+    if(len == 0 || (len == 1 && name[0] == '.'))
+      continue;
+
+    if(!is_dir){ /* a file in the middle */
+      rc = 0;
+      break;
+    }
+
+    if(len == 2 && name[0] == '.' && name[1] == '.'){
+      /* the parent: not cached, the stat of the current inode has it */
+      stmt = sqlite_fs_stmt(conn, SQLITE_FS_STAT);
+      if(stmt == NULL){
+	rc = -1;
+	break;
+      }
+      sqlite3_bind_int64(stmt, 1, inode);
+      rc = sqlite3_step(stmt);
+      if(rc == SQLITE_ROW)
+	inode = sqlite3_column_int64(stmt, 5);
+      rc = (rc == SQLITE_ROW) ? 1 : (rc == SQLITE_DONE) ? 0 : -1;
+      sqlite_fs_stmt_done(stmt);
+      if(rc != 1)
+	break;
+      continue;
+    }
+
+    rc = sqlite_fs_lookup_name(conn, dentries, inode, name, len, &inode, &is_dir);
+    if(rc != 1)
+      break;
+  }
+
+  if(rc == 1){
+    /* the stat fields of the last component */
+    stmt = sqlite_fs_stmt(conn, SQLITE_FS_STAT);
+    if(stmt == NULL)
+      rc = -1;
+    else {
+      sqlite3_bind_int64(stmt, 1, inode);
+      rc = sqlite3_step(stmt);
+      if(rc == SQLITE_ROW){
+	values[0] = Int64GetDatum(inode);
+	values[1] = BoolGetDatum(sqlite3_column_int(stmt, 0) != 0);
+	values[2] = Int64GetDatum(sqlite3_column_int64(stmt, 1));
+	values[3] = Int64GetDatum(sqlite3_column_int64(stmt, 2));
+	values[4] = Int64GetDatum(sqlite3_column_int64(stmt, 3));
+	values[5] = Int32GetDatum(sqlite3_column_int(stmt, 4));
+	rc = 1;
+      } else
+	rc = (rc == SQLITE_DONE) ? 0 : -1;
+      sqlite_fs_stmt_done(stmt);
+    }
+  }
+
+  if(rc < 0){ /* not NULL, which is for a missing path */
+    char *err = pstrdup(sqlite3_errmsg(conn->db));
+    sqlite_fs_conn_release(conn);
+    E("SQL error resolving %s in %s: %s", fspath, db_path, err);
+  }
+  sqlite_fs_conn_release(conn);
+
+  if(rc == 0){
+    D2("%s: no such file in %s", fspath, db_path);
+    PG_RETURN_NULL();
+  }
+
+  PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls)));
+}
+
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_exec);
+Datum
+pg_sqlite_fs_exec(PG_FUNCTION_ARGS)
+{
+  int rc = 1;
+  char* db_path;
+  char* sql;
+  char* err = NULL;
+  sqlite_fs_conn *conn = NULL;
+  sqlite3 *db;
+
+  if(PG_NARGS() != 2){
+    E("Invalid number of arguments: expected 2, got %d", PG_NARGS());
+    PG_RETURN_BOOL(false);
+  }
+
+  if(PG_ARGISNULL(0) || PG_ARGISNULL(1)){
+    E("Null arguments not accepted");
+    PG_RETURN_BOOL(false);
+  }
+
+  db_path = convert_and_check_path(PG_GETARG_TEXT_PP(0)); // allocated in the function context: will be cleaned by PG
+
+  sql = text_to_cstring(PG_GETARG_TEXT_PP(1));
+
+  if(!sql){ E("Allocation failed"); PG_RETURN_BOOL(false); }
+
+  conn = sqlite_fs_conn_open(db_path, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+
+  if( conn == NULL ) {
+    rc = 1;
+    goto bailout;
+  }
+  db = conn->db;
+
+  /* Execute SQL statement */
+  rc = sqlite3_exec(db, sql, NULL, NULL, &err);
+   
+  if( rc != SQLITE_OK ){
+    N("SQL error in %s: %s", db_path, err);
+    rc = 2;
+    goto bailout;
+  }
+
+  N("SQL statement executed successfully: %s", sql);
+  rc = 0; // success
+  
+bailout:
+  if(err) sqlite3_free(err);
+  sqlite_fs_conn_release(conn);
+  PG_RETURN_BOOL(((rc)?false:true));
+}
+
+
+
+/*-------------------------------------------------------------------------
+ *
+ * Open from file descriptor:
+ * - https://www.sqlite.org/forum/draft2/info/c15bf2e7df289a5f41c7402b2e4f7323385e38e2a001a1fea42ccc8071a8c2d8
+ *
+ *-------------------------------------------------------------------------
+ */
+
+/*
+ * Bulk loading from a PostgreSQL query.
+ *
+ * The query runs through an SPI cursor and the rows are fetched
+ * sqlite_fs.fetch_size at a time, so the memory stays bounded regardless
+ * of the size of the tree, and SQLite writes as the rows come in.
+ */
+
+typedef struct sqlite_fs_loader {
+  const char        *what;   /* for the messages */
+  int                natts;  /* extra columns are ignored */
+  const Oid         *types;
+  const char* const *names;
+  sqlite_fs_stmt_id  stmt;
+  const char        *checkpoint; /* metadata key of the resumable loads */
+  const char        *query;      /* metadata key of the hash of their query */
+  int (*bind)(sqlite3_stmt *stmt, Datum *values, bool *nulls); /* 0 on success */
+  bool               collect; /* also records the inodes in temp.inode_set */
+} sqlite_fs_loader;
+
+static const Oid entries_types[] = { INT8OID, TEXTOID, INT8OID, INT8OID, INT8OID, INT4OID, INT8OID, BOOLOID };
+static const char* const entries_names[] = { "inode", "name", "parent inode", "created", "modified", "num_links", "filesize", "is_dir" };
+
+static int
+sqlite_fs_bind_entry(sqlite3_stmt *stmt, Datum *values, bool *nulls)
+{
+  text *name;
+  int i;
+
+  for(i = 0; i < 8; i++){
+    if (nulls[i]){
+      W("the %s field can't be NULL", entries_names[i]);
+      return 1;
+    }
+  }
+
+  name = DatumGetTextPP(values[1]);
+
+  /* Bind arguments */
+  D2("Binding arguments for inserting entry");
+  if(sqlite3_bind_int64(stmt, 1, DatumGetInt64(values[0])) ||
+     sqlite3_bind_text( stmt, 2, VARDATA_ANY(name), (int)VARSIZE_ANY_EXHDR(name), SQLITE_STATIC) || // we handle destruction
+     sqlite3_bind_int64(stmt, 3, DatumGetInt64(values[2])) ||
+     sqlite3_bind_int64(stmt, 4, DatumGetInt64(values[3])) ||
+     sqlite3_bind_int64(stmt, 5, DatumGetInt64(values[4])) ||
+     sqlite3_bind_int(  stmt, 6, DatumGetInt32(values[5])) ||
+     sqlite3_bind_int64(stmt, 7, DatumGetInt64(values[6])) ||
+     sqlite3_bind_int(  stmt, 8, (DatumGetBool(values[7]))?1:0)
+     ){
+    N("SQL error binding arguments: %s", sqlite3_errmsg(sqlite3_db_handle(stmt)));
+    return 1;
+  }
+  return 0;
+}
+
+static const sqlite_fs_loader entries_loader = {
+  "entry", 8, entries_types, entries_names, SQLITE_FS_INSERT_ENTRY, "entries.checkpoint", "entries.query", sqlite_fs_bind_entry, false
+};
+
+static const Oid files_types[] = { INT8OID, TEXTOID, TEXTOID, BYTEAOID, INT8OID, BYTEAOID, BYTEAOID };
+static const char* const files_names[] = { "inode", "mountpoint", "rel_path", "header", "payload_size", "prepend", "append" };
+
+static int
+sqlite_fs_bind_file(sqlite3_stmt *stmt, Datum *values, bool *nulls)
+{
+  text *mountpoint, *path;
+  bytea *header = NULL, *prepend = NULL, *append = NULL;
+  int i;
+
+  for(i = 0; i < 3; i++){
+    if (nulls[i]){
+      W("the %s field can't be NULL", files_names[i]);
+      return 1;
+    }
+  }
+
+  mountpoint = DatumGetTextPP(values[1]);
+  path = DatumGetTextPP(values[2]);
+  if(!nulls[3]) header = DatumGetByteaPP(values[3]);
+  if(!nulls[5]) prepend = DatumGetByteaPP(values[5]);
+  if(!nulls[6]) append = DatumGetByteaPP(values[6]);
+
+  /* Bind arguments */
+  D2("Binding arguments for inserting file");
+  if(sqlite3_bind_int64(stmt, 1, DatumGetInt64(values[0])) ||
+     sqlite3_bind_text(stmt, 2, VARDATA_ANY(mountpoint), (int)VARSIZE_ANY_EXHDR(mountpoint), SQLITE_STATIC) || // we handle destruction
+     sqlite3_bind_text(stmt, 3, VARDATA_ANY(path)      , (int)VARSIZE_ANY_EXHDR(path)      , SQLITE_STATIC) || // we handle destruction
+     ( (header == NULL) ? sqlite3_bind_null(stmt, 4)
+                        : sqlite3_bind_blob(stmt, 4, VARDATA_ANY(header), (int)VARSIZE_ANY_EXHDR(header), SQLITE_STATIC) ) ||
+     sqlite3_bind_int64(stmt, 5, (nulls[4]) ? 0 : DatumGetInt64(values[4])) ||
+     ( (prepend == NULL) ? sqlite3_bind_null(stmt, 6)
+                         : sqlite3_bind_blob(stmt, 6, VARDATA_ANY(prepend), (int)VARSIZE_ANY_EXHDR(prepend), SQLITE_STATIC) ) ||
+     ( (append == NULL) ? sqlite3_bind_null(stmt, 7)
+                        : sqlite3_bind_blob(stmt, 7, VARDATA_ANY(append), (int)VARSIZE_ANY_EXHDR(append), SQLITE_STATIC) )
+     ){
+    N("SQL error binding arguments: %s", sqlite3_errmsg(sqlite3_db_handle(stmt)));
+    return 1;
+  }
+  return 0;
+}
+
+static const sqlite_fs_loader files_loader = {
+  "file", 7, files_types, files_names, SQLITE_FS_INSERT_FILE, "files.checkpoint", "files.query", sqlite_fs_bind_file, false
+};
+
+static const Oid inodes_types[] = { INT8OID };
+static const char* const inodes_names[] = { "inode" };
+
+static int
+sqlite_fs_bind_inode(sqlite3_stmt *stmt, Datum *values, bool *nulls)
+{
+  if(nulls[0]){
+    W("the inode field can't be NULL");
+    return 1;
+  }
+  if(sqlite3_bind_int64(stmt, 1, DatumGetInt64(values[0]))){
+    N("SQL error binding arguments: %s", sqlite3_errmsg(sqlite3_db_handle(stmt)));
+    return 1;
+  }
+  return 0;
+}
+
+/* into temp.inode_set, see sqlite_fs_inodes_begin() */
+static const sqlite_fs_loader inodes_loader = {
+  "inode", 1, inodes_types, inodes_names, SQLITE_FS_INSERT_INODE, NULL, NULL, sqlite_fs_bind_inode, false
+};
+
+static const Oid attributes_types[] = { INT8OID, TEXTOID, TEXTOID };
+static const char* const attributes_names[] = { "inode", "name", "value" };
+
+static int
+sqlite_fs_bind_attribute(sqlite3_stmt *stmt, Datum *values, bool *nulls)
+{
+  text *name, *value;
+  int i;
+
+  for(i = 0; i < 3; i++){
+    if (nulls[i]){
+      W("the %s field can't be NULL", attributes_names[i]);
+      return 1;
+    }
+  }
+
+  name = DatumGetTextPP(values[1]);
+  value = DatumGetTextPP(values[2]);
+
+  D2("Binding arguments for inserting attribute");
+  if(sqlite3_bind_int64(stmt, 1, DatumGetInt64(values[0])) ||
+     sqlite3_bind_text(stmt, 2, VARDATA_ANY(name) , (int)VARSIZE_ANY_EXHDR(name) , SQLITE_STATIC) || // we handle destruction
+     sqlite3_bind_text(stmt, 3, VARDATA_ANY(value), (int)VARSIZE_ANY_EXHDR(value), SQLITE_STATIC)
+     ){
+    N("SQL error binding arguments: %s", sqlite3_errmsg(sqlite3_db_handle(stmt)));
+    return 1;
+  }
+  return 0;
+}
+
+static const sqlite_fs_loader attributes_loader = {
+  "attribute", 3, attributes_types, attributes_names, SQLITE_FS_INSERT_ATTRIBUTE, NULL, NULL, sqlite_fs_bind_attribute, false
+};
+
+/* the same, recording the touched inodes (the triggers are dropped meanwhile) */
+static const sqlite_fs_loader attributes_bulk_loader = {
+  "attribute", 3, attributes_types, attributes_names, SQLITE_FS_INSERT_ATTRIBUTE, NULL, NULL, sqlite_fs_bind_attribute, true
+};
+
+/* Creates (or empties) the temporary set of inodes. Returns 0 on success. */
+static int
+sqlite_fs_inodes_begin(sqlite_fs_conn *conn)
+{
+  if(sqlite3_exec(conn->db, inodes_table, NULL, NULL, NULL) != SQLITE_OK){
+    N("SQL error creating the inodes table in %s: %s", conn->path, sqlite3_errmsg(conn->db));
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Runs the query and inserts its rows, in the current SQLite transaction.
+ * The query gets the nargs parameters $1, $2, etc (nargs can be 0).
+ * With commit_every, the transaction is committed every so many rows,
+ * recording the last inserted inode as checkpoint (the rows must come in inode order).
+ * Returns 0 on success.
+ */
+static int
+sqlite_fs_load(sqlite_fs_conn *conn, const char *sql, int nargs, Oid *argtypes, Datum *args,
+	       const sqlite_fs_loader *loader, uint64 commit_every, uint64 *count)
+{
+  int rc = 1;
+  int i;
+  uint64 row;
+  SPIPlanPtr plan;
+  Portal portal = NULL;
+  TupleDesc tupdesc;
+  Datum *values;
+  bool *nulls;
+  MemoryContext batch_cxt, old_cxt;
+  sqlite3_stmt *stmt = NULL;
+  sqlite3_stmt *collect = NULL;
+
+  *count = 0;
+
+  stmt = sqlite_fs_stmt(conn, loader->stmt);
+  if(stmt == NULL)
+    return 1;
+
+  if(loader->collect){
+    collect = sqlite_fs_stmt(conn, SQLITE_FS_INSERT_INODE);
+    if(collect == NULL)
+      goto bailout;
+  }
+
+  /* Connect */
+  rc = SPI_connect();
+  if (rc != SPI_OK_CONNECT){
+    W("SPI_connect failed: error code %d", rc);
+    rc = 1;
+    goto bailout;
+  }
+
+  pgstat_report_activity(STATE_RUNNING, sql);
+
+  plan = SPI_prepare(sql, nargs, argtypes);
+  if (plan == NULL || !SPI_is_cursor_plan(plan)){
+    W("Invalid query (%s): %s", SPI_result_code_string(SPI_result), sql);
+    rc = 2;
+    goto bailout_spi;
+  }
+
+  /* read_only: we don't see our own changes, and don't need to */
+  portal = SPI_cursor_open(NULL, plan, args, NULL, true);
+  tupdesc = portal->tupDesc;
+
+  /* Check the SQL statement to be executed */ 
+  if(tupdesc->natts < loader->natts){
+    W("The query returns %d fields. Expecting %d", tupdesc->natts, loader->natts);
+    rc = 3;
+    goto bailout_spi;
+  }
+
+  for(i = 0; i < loader->natts; i++){
+    if(TupleDescAttr(tupdesc, i)->atttypid != loader->types[i]){
+      W("Invalid type for field %d: %s", i + 1, loader->names[i]);
+      rc = 4;
+      goto bailout_spi;
+    }
+  }
+
+  values = (Datum*)palloc(tupdesc->natts * sizeof(Datum));
+  nulls = (bool*)palloc(tupdesc->natts * sizeof(bool));
+
+  /* the detoasted values only live until the batch is inserted */
+  batch_cxt = AllocSetContextCreate(CurrentMemoryContext, "sqlite_fs batch", ALLOCSET_DEFAULT_SIZES);
+
+  rc = 0;
+  while(rc == 0){
+
+    SPI_cursor_fetch(portal, true, pg_sqlite_fs_fetch_size);
+    if(SPI_processed == 0)
+      break;
+
+    D2("Inserting a batch of " UINT64_FORMAT " %s(s)", SPI_processed, loader->what);
+    old_cxt = MemoryContextSwitchTo(batch_cxt);
+
+    for(row = 0; row < SPI_processed; row++){
+
+      CHECK_FOR_INTERRUPTS();
+
+      heap_deform_tuple(SPI_tuptable->vals[row], tupdesc, values, nulls);
+
+      rc = loader->bind(stmt, values, nulls);
+      if( rc != 0 ){
+	rc = 6;
+	break;
+      }
+
+      /* Execute SQL prepared statement */
+      rc = sqlite3_step(stmt);
+      if( rc != SQLITE_DONE ){
+	N("SQL error inserting the %s: %s | error: %d", loader->what, sqlite3_errmsg(conn->db), rc);
+	rc = (rc == SQLITE_FULL) ? 7 : 5; // 7: out of space, see the in-memory builds
+	break;
+      }
+
+      sqlite3_reset(stmt);
+
+      if(collect){
+	if(sqlite3_bind_int64(collect, 1, DatumGetInt64(values[0])) ||
+	   sqlite3_step(collect) != SQLITE_DONE){
+	  N("SQL error recording the inode: %s", sqlite3_errmsg(conn->db));
+	  sqlite3_reset(collect);
+	  rc = 5;
+	  break;
+	}
+	sqlite3_reset(collect);
+      }
+
+      (*count)++;
+      rc = 0;
+
+      if(commit_every && (*count % commit_every) == 0){
+	if(sqlite_fs_meta_set(conn, loader->checkpoint, DatumGetInt64(values[0])) ||
+	   sqlite3_exec(conn->db, "COMMIT; BEGIN TRANSACTION;", NULL, NULL, NULL) != SQLITE_OK){
+	  N("Error at checkpoint in %s: %s", conn->path, sqlite3_errmsg(conn->db));
+	  rc = 8;
+	  break;
+	}
+	D1("%s: checkpoint after inode " INT64_FORMAT, conn->path, DatumGetInt64(values[0]));
+      }
+    }
+
+    MemoryContextSwitchTo(old_cxt);
+    MemoryContextReset(batch_cxt);
+    SPI_freetuptable(SPI_tuptable);
+  }
+
+  D1("Inserted " UINT64_FORMAT " %s(s)", *count, loader->what);
+
+bailout_spi:
+
+  if(portal) SPI_cursor_close(portal);
+
+  /* finish the SQL statement */
+  SPI_finish();
+  debug_query_string = NULL;
+  pgstat_report_stat(true);
+  pgstat_report_activity(STATE_IDLE, NULL);
+
+bailout:
+  sqlite_fs_stmt_done(stmt);
+  sqlite_fs_stmt_done(collect);
+  return rc;
+}
+
+/*
+ * Wraps the query so that the rows come in inode order (the first column):
+ * with the version 2 schema, the inserts are then appends to the B-tree.
+ * The closing parenthesis goes on its own line, after a trailing -- comment.
+ */
+static char *
+sqlite_fs_sorted_query(const char *sql)
+{
+  int len = strlen(sql);
+
+  while(len > 0 && (sql[len - 1] == ';' || isspace((unsigned char)sql[len - 1])))
+    len--;
+  return psprintf("SELECT * FROM (%.*s\n) AS sqlite_fs_source ORDER BY 1", len, sql);
+}
+
+/* Same, skipping the rows up to the checkpoint */
+static char *
+sqlite_fs_resumed_query(const char *sql, int64 checkpoint)
+{
+  int len = strlen(sql);
+
+  while(len > 0 && (sql[len - 1] == ';' || isspace((unsigned char)sql[len - 1])))
+    len--;
+  return psprintf("SELECT * FROM (%.*s\n) AS sqlite_fs_source(inode)"
+		  " WHERE inode > " INT64_FORMAT " ORDER BY 1", len, sql, checkpoint);
+}
+
+/* Builds the names index, with a cache large enough for the sorter. Returns 0 on success. */
+static int
+sqlite_fs_create_names_index(sqlite_fs_conn *conn)
+{
+  int rc;
+  char *err = NULL;
+
+  sqlite_fs_pragma(conn, "PRAGMA cache_size = -%d;", maintenance_work_mem);
+  conn->cache_size = -1; // restored below
+
+  rc = sqlite3_exec(conn->db, names_index, NULL, NULL, &err);
+  if( rc != SQLITE_OK )
+    N("SQL error creating the names index in %s: %s", conn->path, err);
+  if(err)
+    sqlite3_free(err);
+
+  sqlite_fs_conn_configure(conn);
+  if(rc == SQLITE_FULL)
+    return 7; // out of space, as in sqlite_fs_load: the in-memory builds fall back to disk
+  return (rc == SQLITE_OK) ? 0 : 1;
+}
+
+/*
+ * Loads the entries without the names index, and builds it at the end:
+ * one sort, instead of random B-tree writes for each row.
+ * In the current transaction. Returns 0 on success.
+ * With commit_every, the index is kept: the DROP INDEX would be committed
+ * with the first checkpoint, and an interrupted load would leave the database
+ * without its unique index (slow lookups, and duplicate names on resume).
+ */
+static int
+sqlite_fs_load_entries_deferred(sqlite_fs_conn *conn, const char *sql, uint64 commit_every, uint64 *count)
+{
+  int rc;
+  instr_time start, loaded, indexed;
+
+  if(commit_every){
+    D1("%s: checkpointed load, the names index is not deferred", conn->path);
+    return sqlite_fs_load(conn, sql, 0, NULL, NULL, &entries_loader, commit_every, count);
+  }
+
+  INSTR_TIME_SET_CURRENT(start);
+
+  if(sqlite3_exec(conn->db, "DROP INDEX IF EXISTS names;", NULL, NULL, NULL) != SQLITE_OK){
+    N("SQL error dropping the names index in %s: %s", conn->path, sqlite3_errmsg(conn->db));
+    return 1;
+  }
+
+  rc = sqlite_fs_load(conn, sql, 0, NULL, NULL, &entries_loader, commit_every, count);
+  if(rc)
+    return rc;
+  INSTR_TIME_SET_CURRENT(loaded);
+
+  rc = sqlite_fs_create_names_index(conn);
+  if(rc)
+    return rc;
+  INSTR_TIME_SET_CURRENT(indexed);
+
+  INSTR_TIME_SUBTRACT(indexed, loaded);
+  INSTR_TIME_SUBTRACT(loaded, start);
+  N("%s: " UINT64_FORMAT " entries loaded in %.3f ms, names index built in %.3f ms",
+    conn->path, *count, INSTR_TIME_GET_MILLISEC(loaded), INSTR_TIME_GET_MILLISEC(indexed));
+  return 0;
+}
+
+/*
+ * insert_files and insert_entries: the query result in one SQLite transaction,
+ * or, with sqlite_fs.commit_every, in several ones. The load then resumes
+ * after the last checkpoint, if it was interrupted. The checkpoint only holds
+ * for the query that made it, whose hash is recorded along.
+ */
+static bool
+pg_sqlite_fs_insert_query(PG_FUNCTION_ARGS, const sqlite_fs_loader *loader)
+{
+
+  int rc = 1;
+  char* db_path;
+  sqlite_fs_conn *conn = NULL;
+  sqlite3 *db;
+  char *sql = NULL;
+  uint64 count = 0;
+  uint64 commit_every = (uint64)pg_sqlite_fs_commit_every;
+  int64 query_hash = 0;
+
+  if(PG_NARGS() != 2){
+    E("Invalid number of arguments: expected 2, got %d", PG_NARGS());
+    return false;
+  }
+
+  if(PG_ARGISNULL(0) || PG_ARGISNULL(1)){
+    E("Null arguments not accepted");
+    return false;
+  }
+
+  db_path = convert_and_check_path(PG_GETARG_TEXT_PP(0)); // allocated in the function context: will be cleaned by PG
+  sql = text_to_cstring(PG_GETARG_TEXT_PP(1)); /* clean on exiting the function */
+
+  conn = sqlite_fs_conn_open(db_path, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+
+  if( conn == NULL ) {
+    return false;
+  }
+  db = conn->db;
+
+  if(commit_every){
+    int64 checkpoint, previous_hash;
+
+    query_hash = (int64)hash_bytes_extended((const unsigned char *)sql, strlen(sql), 0);
+
+    switch(sqlite_fs_meta_get(conn, loader->checkpoint, &checkpoint)){
+    case 1:
+      rc = sqlite_fs_meta_get(conn, loader->query, &previous_hash);
+      if(rc < 0){
+	sqlite_fs_conn_release(conn);
+	return false;
+      }
+      if(rc == 0 || previous_hash != query_hash){
+	sqlite_fs_conn_release(conn);
+	E("The load of %s was checkpointed with another query: truncate the %s table to start over",
+	  db_path, (loader == &entries_loader) ? "entries" : "files");
+      }
+      N("Resuming the load of %s after inode " INT64_FORMAT, db_path, checkpoint);
+      sql = sqlite_fs_resumed_query(sql, checkpoint);
+      break;
+    case 0:
+      sql = sqlite_fs_sorted_query(sql); // checkpoints need the inode order
+      break;
+    default:
+      sqlite_fs_conn_release(conn);
+      return false;
+    }
+  } else if(pg_sqlite_fs_sorted_load)
+    sql = sqlite_fs_sorted_query(sql);
+
+  sqlite_fs_fast_build_begin(conn);
+
+  /* Start SQLite transaction */
+  rc = sqlite3_exec(db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
   if( rc != SQLITE_OK ) {
-    N("Error preparing statement: %s", sqlite3_errmsg(db));
+    N("Error starting transaction: %s", sqlite3_errmsg(db));
+    rc = 1;
+    goto close_sqlite_db;
+  }
+
+  /* committed with the first checkpoint */
+  if(commit_every && sqlite_fs_meta_set(conn, loader->query, query_hash))
+    rc = 1;
+  else if(loader == &entries_loader && pg_sqlite_fs_defer_index)
+    rc = sqlite_fs_load_entries_deferred(conn, sql, commit_every, &count);
+  else
+    rc = sqlite_fs_load(conn, sql, 0, NULL, NULL, loader, commit_every, &count);
+
+  if(commit_every){
+    if(rc == 0)
+      rc = sqlite_fs_meta_del(conn, loader->checkpoint) || sqlite_fs_meta_del(conn, loader->query); // done
+    else
+      N("The load of %s was interrupted: call again with the same query to resume it from the last checkpoint", db_path);
+  }
+
+  /* Close the transaction */
+  if( sqlite3_exec(db, (rc)?"ROLLBACK;":"COMMIT;", NULL, NULL, NULL) != SQLITE_OK ) {
+    N("Error closing transaction: %s", sqlite3_errmsg(db));
+    rc = 1;
+  }
+  
+close_sqlite_db:
+  sqlite_fs_fast_build_end(conn);
+  sqlite_fs_conn_release(conn);
+
+  return ((rc)?false:true);
+}
+
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_insert_files);
+Datum
+pg_sqlite_fs_insert_files(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_BOOL(pg_sqlite_fs_insert_query(fcinfo, &files_loader));
+}
+
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_insert_entries);
+Datum
+pg_sqlite_fs_insert_entries(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_BOOL(pg_sqlite_fs_insert_query(fcinfo, &entries_loader));
+}
+
+
+/*
+ * insert_attributes(path, sql, bulk)
+ *
+ * Loads the extended attributes returned by sql: (inode, name, value).
+ * The triggers on extended_attributes update the entry of every row.
+ * In bulk mode, they are dropped for the load (in the same transaction),
+ * the touched inodes are collected, and their entries are updated
+ * in one statement at the end, before the triggers are recreated.
+ */
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_insert_attributes);
+Datum
+pg_sqlite_fs_insert_attributes(PG_FUNCTION_ARGS)
+{
+  int rc = 1;
+  char* db_path;
+  sqlite_fs_conn *conn = NULL;
+  sqlite3 *db;
+  char *sql = NULL;
+  bool bulk;
+  uint64 count = 0;
+
+  if(PG_ARGISNULL(0) || PG_ARGISNULL(1)){
+    E("Null arguments not accepted");
+    PG_RETURN_BOOL(false);
+  }
+
+  db_path = convert_and_check_path(PG_GETARG_TEXT_PP(0));
+  sql = text_to_cstring(PG_GETARG_TEXT_PP(1));
+  bulk = (PG_NARGS() > 2 && !PG_ARGISNULL(2)) ? PG_GETARG_BOOL(2) : true;
+
+  conn = sqlite_fs_conn_open(db_path, SQLITE_OPEN_READWRITE);
+  if( conn == NULL )
+    PG_RETURN_BOOL(false);
+  db = conn->db;
+
+  if(bulk && sqlite_fs_inodes_begin(conn))
+    goto bailout;
+
+  if(sqlite3_exec(db, "BEGIN TRANSACTION;", NULL, NULL, NULL) != SQLITE_OK){
+    N("Error starting transaction: %s", sqlite3_errmsg(db));
+    goto bailout;
+  }
+
+  if(bulk &&
+     sqlite3_exec(db, "DROP TRIGGER IF EXISTS on_insert; DROP TRIGGER IF EXISTS on_update;", NULL, NULL, NULL) != SQLITE_OK){
+    N("SQL error dropping the triggers in %s: %s", db_path, sqlite3_errmsg(db));
+    rc = 1;
+    goto rollback;
+  }
+
+  rc = sqlite_fs_load(conn, sql, 0, NULL, NULL, (bulk) ? &attributes_bulk_loader : &attributes_loader, 0, &count);
+  if(rc)
+    goto rollback;
+
+  if(bulk &&
+     (sqlite3_exec(db, "UPDATE entries SET mtime = unixepoch() WHERE inode IN (SELECT inode FROM temp.inode_set);",
+		   NULL, NULL, NULL) != SQLITE_OK ||
+      sqlite3_exec(db, SQLITE_FS_TRIGGERS, NULL, NULL, NULL) != SQLITE_OK)){
+    N("SQL error updating the entries in %s: %s", db_path, sqlite3_errmsg(db));
+    rc = 1;
+  }
+
+rollback:
+  /* the dropped triggers are restored by the rollback */
+  if( sqlite3_exec(db, (rc)?"ROLLBACK;":"COMMIT;", NULL, NULL, NULL) != SQLITE_OK ) {
+    N("Error closing transaction: %s", sqlite3_errmsg(db));
+    rc = 1;
+  }
+
+bailout:
+  sqlite_fs_conn_release(conn);
+  PG_RETURN_BOOL((rc)?false:true);
+}
+
+
+/*
+ * sync_entries(path, changes, watermark, inodes)
+ *
+ * Incremental refresh: changes is a query of the entries modified since $1,
+ * the watermark of the previous sync (0 the first time), eg
+ *   SELECT ... FROM my_entries WHERE mtime > $1
+ * Its rows are upserted, and the watermark is then recorded in the database.
+ * The (optional) inodes query lists all the inodes of the source:
+ * the entries not in it are deleted, with their files and extended attributes.
+ * All in one SQLite transaction.
+ */
+
+static int
+sqlite_fs_sync_deletes(sqlite_fs_conn *conn, const char *inodes_sql, uint64 *deleted)
+{
+  int rc;
+  uint64 count = 0;
+
+  rc = sqlite_fs_inodes_begin(conn);
+  if(rc == 0)
+    rc = sqlite_fs_load(conn, inodes_sql, 0, NULL, NULL, &inodes_loader, 0, &count);
+  if(rc)
+    return rc;
+
+  D1("%s: " UINT64_FORMAT " inodes in the source", conn->path, count);
+
+  /* the attributes and files of the stale inodes, then the entries (but the root) */
+  if(sqlite3_exec(conn->db,
+		  "DELETE FROM extended_attributes WHERE inode NOT IN (SELECT inode FROM temp.inode_set);"
+		  "DELETE FROM files WHERE inode NOT IN (SELECT inode FROM temp.inode_set);",
+		  NULL, NULL, NULL) != SQLITE_OK ||
+     sqlite3_exec(conn->db,
+		  "DELETE FROM entries WHERE inode > 1 AND inode NOT IN (SELECT inode FROM temp.inode_set);",
+		  NULL, NULL, NULL) != SQLITE_OK){
+    N("SQL error deleting the stale entries in %s: %s", conn->path, sqlite3_errmsg(conn->db));
+    return 1;
+  }
+  *deleted = sqlite3_changes64(conn->db);
+  return 0;
+}
+
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_sync_entries);
+Datum
+pg_sqlite_fs_sync_entries(PG_FUNCTION_ARGS)
+{
+  int rc = 1;
+  char* db_path;
+  sqlite_fs_conn *conn = NULL;
+  char *sql, *inodes_sql = NULL;
+  int64 watermark, previous = 0;
+  Oid argtypes[1] = { INT8OID };
+  Datum args[1];
+  uint64 upserted = 0, deleted = 0;
+
+  if(PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(2))
+    E("Null arguments not accepted");
+
+  db_path = convert_and_check_path(PG_GETARG_TEXT_PP(0)); // allocated in the function context: will be cleaned by PG
+  sql = text_to_cstring(PG_GETARG_TEXT_PP(1));
+  watermark = PG_GETARG_INT64(2);
+  if(!PG_ARGISNULL(3))
+    inodes_sql = text_to_cstring(PG_GETARG_TEXT_PP(3));
+
+  conn = sqlite_fs_conn_open(db_path, SQLITE_OPEN_READWRITE);
+  if(conn == NULL)
+    PG_RETURN_BOOL(false);
+
+  if(sqlite_fs_meta_get(conn, "entries.watermark", &previous) < 0)
+    goto bailout;
+
+  D1("%s: syncing the entries changed since " INT64_FORMAT, db_path, previous);
+
+  if(sqlite3_exec(conn->db, "BEGIN TRANSACTION;", NULL, NULL, NULL) != SQLITE_OK){
+    N("Error starting transaction: %s", sqlite3_errmsg(conn->db));
+    goto bailout;
+  }
+
+  args[0] = Int64GetDatum(previous);
+  rc = sqlite_fs_load(conn, sql, 1, argtypes, args, &entries_loader, 0, &upserted);
+
+  if(rc == 0 && inodes_sql)
+    rc = sqlite_fs_sync_deletes(conn, inodes_sql, &deleted);
+
+  if(rc == 0)
+    rc = sqlite_fs_meta_set(conn, "entries.watermark", watermark);
+
+  if(sqlite3_exec(conn->db, (rc)?"ROLLBACK;":"COMMIT;", NULL, NULL, NULL) != SQLITE_OK){
+    N("Error closing transaction: %s", sqlite3_errmsg(conn->db));
+    rc = 1;
+  }
+
+  if(rc == 0)
+    N("%s: " UINT64_FORMAT " entries upserted, " UINT64_FORMAT " deleted | watermark " INT64_FORMAT,
+      db_path, upserted, deleted, watermark);
+
+bailout:
+  sqlite_fs_conn_release(conn);
+  PG_RETURN_BOOL(((rc)?false:true));
+}
+
+/*
+ * Deletes in bulk
+ *
+ * The inodes to delete are first collected in temp.inode_set,
+ * and the rows are then deleted with one statement per table, in one transaction.
+ */
+
+/* Deletes the collected inodes from the files (and entries and attributes). Returns 0 on success. */
+static int
+sqlite_fs_delete_collected(sqlite_fs_conn *conn, bool entries, uint64 *deleted)
+{
+  /* the entries first: the attribute triggers then have nothing to update */
+  static const char *entries_sql =
+    "DELETE FROM entries WHERE inode IN (SELECT inode FROM temp.inode_set);";
+  static const char *others_sql =
+    "DELETE FROM files WHERE inode IN (SELECT inode FROM temp.inode_set);"
+    "DELETE FROM extended_attributes WHERE inode IN (SELECT inode FROM temp.inode_set);";
+
+  if(entries){
+    if(sqlite3_exec(conn->db, entries_sql, NULL, NULL, NULL) != SQLITE_OK)
+      goto error;
+    *deleted = sqlite3_changes64(conn->db);
+    if(sqlite3_exec(conn->db, others_sql, NULL, NULL, NULL) != SQLITE_OK)
+      goto error;
+  } else {
+    if(sqlite3_exec(conn->db, "DELETE FROM files WHERE inode IN (SELECT inode FROM temp.inode_set);",
+		    NULL, NULL, NULL) != SQLITE_OK)
+      goto error;
+    *deleted = sqlite3_changes64(conn->db);
+  }
+  return 0;
+
+error:
+  N("SQL error deleting from %s: %s", conn->path, sqlite3_errmsg(conn->db));
+  return 1;
+}
+
+/*
+ * delete_subtree(path, inode): the entry and everything below it, with their files
+ * and extended attributes. Returns the deleted inodes.
+ */
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_delete_subtree);
+Datum
+pg_sqlite_fs_delete_subtree(PG_FUNCTION_ARGS)
+{
+  ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+  int rc = 1;
+  char* db_path;
+  int64 inode;
+  sqlite_fs_conn *conn = NULL;
+  sqlite3_stmt *stmt = NULL;
+  uint64 deleted = 0;
+
+  if(PG_ARGISNULL(0) || PG_ARGISNULL(1))
+    E("Null arguments not accepted");
+
+  db_path = convert_and_check_path(PG_GETARG_TEXT_PP(0)); // allocated in the function context: will be cleaned by PG
+  inode = PG_GETARG_INT64(1);
+  if(inode == 1)
+    E("The root can't be deleted: see truncate_entries()");
+
+  InitMaterializedSRF(fcinfo, MAT_SRF_USE_EXPECTED_DESC);
+
+  conn = sqlite_fs_conn_open(db_path, SQLITE_OPEN_READWRITE);
+  if( conn == NULL )
+    E("SQL error opening database: %s", db_path);
+
+  if(sqlite_fs_inodes_begin(conn))
+    goto bailout;
+
+  if(sqlite3_exec(conn->db, "BEGIN TRANSACTION;", NULL, NULL, NULL) != SQLITE_OK){
+    N("Error starting transaction: %s", sqlite3_errmsg(conn->db));
+    goto bailout;
+  }
+
+  /* Collect the subtree: UNION (not ALL) and the root test stop on cycles */
+  stmt = sqlite_fs_stmt(conn, SQLITE_FS_COLLECT_SUBTREE);
+  if(stmt != NULL &&
+     sqlite3_bind_int64(stmt, 1, inode) == SQLITE_OK &&
+     sqlite3_step(stmt) == SQLITE_DONE)
+    rc = 0;
+  else
+    N("SQL error collecting the subtree of " INT64_FORMAT " in %s: %s", inode, db_path, sqlite3_errmsg(conn->db));
+  sqlite_fs_stmt_done(stmt);
+
+  if(rc == 0)
+    rc = sqlite_fs_delete_collected(conn, true, &deleted);
+
+  /* The deleted inodes */
+  if(rc == 0){
+    sqlite3_stmt *list = NULL;
+
+    rc = 1;
+    if(sqlite3_prepare_v2(conn->db, "SELECT inode FROM temp.inode_set ORDER BY inode;", -1, &list, NULL) == SQLITE_OK){
+      int step;
+
+      while((step = sqlite3_step(list)) == SQLITE_ROW){
+	Datum value = Int64GetDatum(sqlite3_column_int64(list, 0));
+	bool isnull = false;
+	tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, &value, &isnull);
+      }
+      if(step == SQLITE_DONE)
+	rc = 0;
+    }
+    if(rc)
+      N("SQL error listing the deleted inodes in %s: %s", db_path, sqlite3_errmsg(conn->db));
+    sqlite3_finalize(list);
+  }
+
+  if(sqlite3_exec(conn->db, (rc)?"ROLLBACK;":"COMMIT;", NULL, NULL, NULL) != SQLITE_OK){
+    N("Error closing transaction: %s", sqlite3_errmsg(conn->db));
+    rc = 1;
+  }
+
+  if(rc == 0)
+    D1("%s: " UINT64_FORMAT " entries deleted under " INT64_FORMAT, db_path, deleted, inode);
+
+bailout:
+  sqlite_fs_conn_release(conn);
+  if(rc)
+    E("Error deleting the subtree of " INT64_FORMAT " in %s", inode, db_path);
+  return (Datum) 0;
+}
+
+
+/*
+ * Write-through trigger
+ *
+ * CREATE TRIGGER ... AFTER INSERT OR UPDATE OR DELETE ON my_entries
+ *   FOR EACH ROW EXECUTE FUNCTION sqlite_fs_sync_trigger('/path/to/db' | path_column [, 'entries' | 'files']);
+ *
+ * The columns are found by name (the ones of the SQLite table, with the types of insert_entries/insert_files).
+ * The changes are kept in the transaction and applied at pre-commit, in one SQLite
+ * transaction per database, with the cached handles and statements.
+ * The changes of an aborted subtransaction are dropped.
+ * Note: if several databases are written and one fails, the PostgreSQL transaction aborts,
+ *       but the ones already committed stay.
+ */
+
+static const char* const entries_columns[] = { "inode", "name", "parent_inode", "ctime", "mtime", "nlink", "size", "is_dir" };
+static const char* const files_columns[] = { "inode", "mountpoint", "rel_path", "header", "payload_size", "prepend", "append" };
+
+#define SQLITE_FS_SYNC_MAX_ATTS 8
+
+/* Per trigger, in fn_extra */
+typedef struct sqlite_fs_sync_map {
+  Oid                      tgoid;
+  const sqlite_fs_loader  *loader;
+  char                    *path;        /* the database, or NULL if in a column */
+  AttrNumber               path_attnum;
+  AttrNumber               attnums[SQLITE_FS_SYNC_MAX_ATTS];
+} sqlite_fs_sync_map;
+
+typedef struct sqlite_fs_change {
+  dlist_node               node;
+  SubTransactionId         subid;
+  const sqlite_fs_loader  *loader;
+  bool                     is_delete;   /* only the inode then */
+  Datum                    values[SQLITE_FS_SYNC_MAX_ATTS];
+  bool                     nulls[SQLITE_FS_SYNC_MAX_ATTS];
+} sqlite_fs_change;
+
+typedef struct sqlite_fs_sync_group {
+  char                    *path;
+  dlist_head               changes;
+} sqlite_fs_sync_group;
+
+/* In TopTransactionContext */
+static List *sqlite_fs_sync_groups = NIL;
+
+static sqlite_fs_sync_map*
+sqlite_fs_sync_map_get(FunctionCallInfo fcinfo, TriggerData *trigdata)
+{
+  Trigger *trigger = trigdata->tg_trigger;
+  TupleDesc tupdesc = RelationGetDescr(trigdata->tg_relation);
+  sqlite_fs_sync_map *map = (sqlite_fs_sync_map*)fcinfo->flinfo->fn_extra;
+  const char* const *columns;
+  const char *kind;
+  int i;
+
+  if(map != NULL && map->tgoid == trigger->tgoid)
+    return map;
+
+  if(trigger->tgnargs < 1 || trigger->tgnargs > 2)
+    E("Usage: sqlite_fs_sync_trigger(path or path_column [, 'entries' | 'files'])");
+
+  map = (sqlite_fs_sync_map*)MemoryContextAllocZero(fcinfo->flinfo->fn_mcxt, sizeof(sqlite_fs_sync_map));
+  map->tgoid = trigger->tgoid;
+
+  kind = (trigger->tgnargs > 1) ? trigger->tgargs[1] : "entries";
+  if(strcmp(kind, "entries") == 0){
+    map->loader = &entries_loader;
+    columns = entries_columns;
+  } else if(strcmp(kind, "files") == 0){
+    map->loader = &files_loader;
+    columns = files_columns;
+  } else
+    E("Invalid kind \"%s\": expecting entries or files", kind);
+
+  if(trigger->tgargs[0][0] == '/'){
+    map->path = MemoryContextStrdup(fcinfo->flinfo->fn_mcxt,
+				    convert_and_check_path(cstring_to_text(trigger->tgargs[0])));
+  } else {
+    map->path_attnum = SPI_fnumber(tupdesc, trigger->tgargs[0]);
+    if(map->path_attnum <= 0)
+      E("Column \"%s\" not found in %s", trigger->tgargs[0], RelationGetRelationName(trigdata->tg_relation));
+    if(TupleDescAttr(tupdesc, map->path_attnum - 1)->atttypid != TEXTOID)
+      E("Invalid type for column \"%s\": expecting text", trigger->tgargs[0]);
+  }
+
+  for(i = 0; i < map->loader->natts; i++){
+    map->attnums[i] = SPI_fnumber(tupdesc, columns[i]);
+    if(map->attnums[i] <= 0)
+      E("Column \"%s\" not found in %s", columns[i], RelationGetRelationName(trigdata->tg_relation));
+    if(TupleDescAttr(tupdesc, map->attnums[i] - 1)->atttypid != map->loader->types[i])
+      E("Invalid type for column \"%s\": %s", columns[i], map->loader->names[i]);
+  }
+
+  fcinfo->flinfo->fn_extra = map;
+  return map;
+}
+
+/* The database of that row, in the current memory context */
+static char*
+sqlite_fs_sync_path(sqlite_fs_sync_map *map, TupleDesc tupdesc, HeapTuple tuple)
+{
+  Datum d;
+  bool isnull;
+
+  if(map->path)
+    return map->path;
+
+  d = heap_getattr(tuple, map->path_attnum, tupdesc, &isnull);
+  if(isnull)
+    E("The database path can't be NULL");
+  return convert_and_check_path(DatumGetTextPP(d));
+}
+
+static void
+sqlite_fs_sync_capture(sqlite_fs_sync_map *map, TupleDesc tupdesc, HeapTuple tuple, const char *path, bool is_delete)
+{
+  MemoryContext old_cxt = MemoryContextSwitchTo(TopTransactionContext);
+  sqlite_fs_sync_group *group = NULL;
+  sqlite_fs_change *change;
+  ListCell *lc;
+  int i, n;
+
+  change = (sqlite_fs_change*)palloc0(sizeof(sqlite_fs_change));
+  change->subid = GetCurrentSubTransactionId();
+  change->loader = map->loader;
+  change->is_delete = is_delete;
+
+  /* copied (and detoasted): the tuple is gone at commit time */
+  n = (is_delete) ? 1 : map->loader->natts;
+  for(i = 0; i < n; i++){
+    Form_pg_attribute attr = TupleDescAttr(tupdesc, map->attnums[i] - 1);
+    Datum d = heap_getattr(tuple, map->attnums[i], tupdesc, &change->nulls[i]);
+
+    if(change->nulls[i])
+      continue;
+    if(attr->attlen == -1)
+      change->values[i] = PointerGetDatum(PG_DETOAST_DATUM_COPY(d));
+    else
+      change->values[i] = datumCopy(d, attr->attbyval, attr->attlen);
+  }
+
+  if(change->nulls[0])
+    E("The inode can't be NULL");
+
+  foreach(lc, sqlite_fs_sync_groups){
+    sqlite_fs_sync_group *g = (sqlite_fs_sync_group*)lfirst(lc);
+    if(strcmp(g->path, path) == 0){
+      group = g;
+      break;
+    }
+  }
+
+  if(group == NULL){
+    group = (sqlite_fs_sync_group*)palloc0(sizeof(sqlite_fs_sync_group));
+    group->path = pstrdup(path);
+    dlist_init(&group->changes);
+    sqlite_fs_sync_groups = lappend(sqlite_fs_sync_groups, group);
+  }
+
+  dlist_push_tail(&group->changes, &change->node);
+  MemoryContextSwitchTo(old_cxt);
+}
+
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_sync_trigger);
+Datum
+pg_sqlite_fs_sync_trigger(PG_FUNCTION_ARGS)
+{
+  TriggerData *trigdata = (TriggerData *) fcinfo->context;
+  sqlite_fs_sync_map *map;
+  TupleDesc tupdesc;
+  HeapTuple tuple;
+  char *path;
+
+  if(!CALLED_AS_TRIGGER(fcinfo))
+    E("sqlite_fs_sync_trigger: not called by the trigger manager");
+
+  if(!TRIGGER_FIRED_FOR_ROW(trigdata->tg_event) || !TRIGGER_FIRED_AFTER(trigdata->tg_event))
+    E("sqlite_fs_sync_trigger must be fired AFTER ... FOR EACH ROW");
+
+  map = sqlite_fs_sync_map_get(fcinfo, trigdata);
+  tupdesc = RelationGetDescr(trigdata->tg_relation);
+  tuple = trigdata->tg_trigtuple;
+  path = sqlite_fs_sync_path(map, tupdesc, tuple);
+
+  if(TRIGGER_FIRED_BY_INSERT(trigdata->tg_event)){
+    sqlite_fs_sync_capture(map, tupdesc, tuple, path, false);
+  }
+  else if(TRIGGER_FIRED_BY_DELETE(trigdata->tg_event)){
+    sqlite_fs_sync_capture(map, tupdesc, tuple, path, true);
+  }
+  else if(TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event)){
+    HeapTuple newtuple = trigdata->tg_newtuple;
+    char *newpath = sqlite_fs_sync_path(map, tupdesc, newtuple);
+    Datum inode, newinode;
+    bool isnull, newisnull;
+
+    inode = heap_getattr(tuple, map->attnums[0], tupdesc, &isnull);
+    newinode = heap_getattr(newtuple, map->attnums[0], tupdesc, &newisnull);
+    if(isnull || newisnull)
+      E("The inode can't be NULL");
+
+    /* moved to another inode or database: remove the old one */
+    if(strcmp(path, newpath) != 0 || DatumGetInt64(inode) != DatumGetInt64(newinode))
+      sqlite_fs_sync_capture(map, tupdesc, tuple, path, true);
+
+    sqlite_fs_sync_capture(map, tupdesc, newtuple, newpath, false);
+  }
+
+  return PointerGetDatum(NULL);
+}
+
+/* Returns 0 on success */
+static int
+sqlite_fs_sync_change(sqlite_fs_conn *conn, sqlite_fs_change *change)
+{
+  sqlite3_stmt *stmt;
+  sqlite_fs_stmt_id id;
+  int rc;
+
+  if(change->is_delete)
+    id = (change->loader == &entries_loader) ? SQLITE_FS_DELETE_INODE : SQLITE_FS_DELETE_FILE;
+  else
+    id = change->loader->stmt;
+
+  stmt = sqlite_fs_stmt(conn, id);
+  if(stmt == NULL)
+    return 1;
+
+  if(change->is_delete)
+    rc = (sqlite3_bind_int64(stmt, 1, DatumGetInt64(change->values[0])) == SQLITE_OK) ? 0 : 1;
+  else
+    rc = change->loader->bind(stmt, change->values, change->nulls);
+
+  if(rc == 0 && sqlite3_step(stmt) != SQLITE_DONE){
+    N("SQL error applying the %s " INT64_FORMAT ": %s",
+      change->loader->what, DatumGetInt64(change->values[0]), sqlite3_errmsg(conn->db));
+    rc = 1;
+  }
+
+  sqlite_fs_stmt_done(stmt);
+  return rc;
+}
+
+/* Errors abort the PostgreSQL transaction, and the abort callback rolls back the SQLite one */
+static void
+sqlite_fs_sync_apply(void)
+{
+  List *groups = sqlite_fs_sync_groups;
+  ListCell *lc;
+
+  sqlite_fs_sync_groups = NIL; /* applied once */
+
+  foreach(lc, groups){
+    sqlite_fs_sync_group *group = (sqlite_fs_sync_group*)lfirst(lc);
+    sqlite_fs_conn *conn;
+    dlist_iter iter;
+    int count = 0;
+
+    if(dlist_is_empty(&group->changes))
+      continue;
+
+    conn = sqlite_fs_conn_open(group->path, SQLITE_OPEN_READWRITE);
+    if(conn == NULL)
+      E("Can't open %s to apply the changes", group->path);
+
+    if(sqlite3_exec(conn->db, "BEGIN TRANSACTION;", NULL, NULL, NULL) != SQLITE_OK)
+      E("Error starting transaction in %s: %s", group->path, sqlite3_errmsg(conn->db));
+
+    dlist_foreach(iter, &group->changes){
+      if(sqlite_fs_sync_change(conn, dlist_container(sqlite_fs_change, node, iter.cur)))
+	E("Error applying the changes to %s", group->path);
+      count++;
+    }
+
+    if(sqlite3_exec(conn->db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
+      E("Error committing the changes to %s: %s", group->path, sqlite3_errmsg(conn->db));
+
+    sqlite_fs_conn_release(conn);
+    D1("%s: %d change(s) applied", group->path, count);
+  }
+}
+
+static void
+sqlite_fs_sync_xact_callback(XactEvent event, void *arg)
+{
+  switch(event){
+  case XACT_EVENT_PRE_COMMIT:
+    sqlite_fs_sync_apply();
+    break;
+  case XACT_EVENT_PRE_PREPARE:
+    if(sqlite_fs_sync_groups != NIL)
+      E("Cannot PREPARE a transaction with pending sqlite_fs changes");
+    break;
+  case XACT_EVENT_COMMIT:
+  case XACT_EVENT_ABORT:
+  case XACT_EVENT_PREPARE:
+    sqlite_fs_sync_groups = NIL; /* freed with TopTransactionContext */
+    break;
+  default:
+    break;
+  }
+}
+
+static void
+sqlite_fs_sync_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+				SubTransactionId parentSubid, void *arg)
+{
+  ListCell *lc;
+
+  if(event != SUBXACT_EVENT_COMMIT_SUB && event != SUBXACT_EVENT_ABORT_SUB)
+    return;
+
+  foreach(lc, sqlite_fs_sync_groups){
+    sqlite_fs_sync_group *group = (sqlite_fs_sync_group*)lfirst(lc);
+    dlist_mutable_iter iter;
+
+    dlist_foreach_modify(iter, &group->changes){
+      sqlite_fs_change *change = dlist_container(sqlite_fs_change, node, iter.cur);
+
+      if(change->subid != mySubid)
+	continue;
+      if(event == SUBXACT_EVENT_ABORT_SUB){
+	dlist_delete(iter.cur);
+	pfree(change);
+      } else
+	change->subid = parentSubid;
+    }
+  }
+}
+
+
+/*
+ * insert_entries_array(path, inodes, names, parents, ctimes, mtimes, nlinks, sizes, is_dirs)
+ *
+ * One entry per array element, in one SQLite transaction with one prepared statement,
+ * for callers that batch their rows in arrays rather than in a query.
+ * The arrays after parents are optional (defaults of insert_entry).
+ */
+static int
+sqlite_fs_deconstruct(ArrayType *array, Oid type, Datum **values, bool **nulls)
+{
+  int16 typlen;
+  bool typbyval;
+  char typalign;
+  int n;
+
+  if(ARR_NDIM(array) > 1)
+    E("Arrays must be one-dimensional");
+
+  get_typlenbyvalalign(type, &typlen, &typbyval, &typalign);
+  deconstruct_array(array, type, typlen, typbyval, typalign, values, nulls, &n);
+  return n;
+}
+
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_insert_entries_array);
+Datum
+pg_sqlite_fs_insert_entries_array(PG_FUNCTION_ARGS)
+{
+  int rc = 1;
+  char* db_path;
+  sqlite_fs_conn *conn = NULL;
+  sqlite3_stmt *stmt = NULL;
+  /* the array elements, as the entries loader expects them */
+  static const Oid types[] = { INT8OID, TEXTOID, INT8OID, INT8OID, INT8OID, INT8OID, INT8OID, BOOLOID };
+  const Datum defaults[] = { 0, 0, 0, Int64GetDatum(0), Int64GetDatum(0), Int32GetDatum(1), Int64GetDatum(0), BoolGetDatum(true) };
+  Datum *elems[8];
+  bool *elnulls[8];
+  Datum values[8];
+  bool nulls[8];
+  int i, n = -1, row;
+
+  if(PG_NARGS() != 9){
+    E("Invalid number of arguments: expected 9, got %d", PG_NARGS());
+    PG_RETURN_BOOL(false);
+  }
+
+  if(PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(2) || PG_ARGISNULL(3)){
+    E("First 4 arguments can't be null");
+    PG_RETURN_BOOL(false);
+  }
+
+  db_path = convert_and_check_path(PG_GETARG_TEXT_PP(0)); // allocated in the function context: will be cleaned by PG
+
+  for(i = 0; i < 8; i++){
+    int len;
+
+    elems[i] = NULL;
+    elnulls[i] = NULL;
+    if(PG_ARGISNULL(i + 1))
+      continue;
+
+    len = sqlite_fs_deconstruct(PG_GETARG_ARRAYTYPE_P(i + 1), types[i], &elems[i], &elnulls[i]);
+    if(n < 0)
+      n = len;
+    else if(len != n)
+      E("The %s array has %d elements, expecting %d", entries_names[i], len, n);
+  }
+
+  /* nlinks come as bigint: checked before the SQLite transaction */
+  for(row = 0; elems[5] && row < n; row++){
+    int64 v;
+
+    if(elnulls[5][row])
+      continue;
+    v = DatumGetInt64(elems[5][row]);
+    if(v < PG_INT32_MIN || v > PG_INT32_MAX)
+      ereport(ERROR, (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+		      errmsg("nlink " INT64_FORMAT " of element %d is out of range for type integer",
+			     v, row + 1)));
+    elems[5][row] = Int32GetDatum((int32)v);
+  }
+
+  conn = sqlite_fs_conn_open(db_path, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+  if( conn == NULL )
+    PG_RETURN_BOOL(false);
+
+  stmt = sqlite_fs_stmt(conn, SQLITE_FS_INSERT_ENTRY);
+  if( stmt == NULL )
+    goto bailout;
+
+  /* Start SQLite transaction */
+  if( sqlite3_exec(conn->db, "BEGIN TRANSACTION;", NULL, NULL, NULL) != SQLITE_OK ) {
+    N("Error starting transaction: %s", sqlite3_errmsg(conn->db));
+    goto bailout;
+  }
+
+  rc = 0;
+  for(row = 0; row < n; row++){
+
+    CHECK_FOR_INTERRUPTS();
+
+    for(i = 0; i < 8; i++){
+      if(elems[i] == NULL){
+	values[i] = defaults[i];
+	nulls[i] = false;
+      } else {
+	values[i] = elems[i][row];
+	nulls[i] = elnulls[i][row];
+      }
+    }
+
+    rc = sqlite_fs_bind_entry(stmt, values, nulls);
+    if( rc != 0 )
+      break;
+
+    /* Execute SQL prepared statement */
+    rc = sqlite3_step(stmt);
+    if( rc != SQLITE_DONE ){
+      N("SQL error inserting entry %ld | error %d: %s", DatumGetInt64(values[0]), rc, sqlite3_errmsg(conn->db));
+      break;
+    }
+    sqlite3_reset(stmt);
+    rc = 0;
+  }
+
+  /* Close the transaction */
+  if( sqlite3_exec(conn->db, (rc)?"ROLLBACK;":"COMMIT;", NULL, NULL, NULL) != SQLITE_OK ) {
+    N("Error closing transaction: %s", sqlite3_errmsg(conn->db));
     rc = 1;
+  }
+
+  if(rc == 0)
+    D3("Inserted %d entries", n);
+
+bailout:
+  sqlite_fs_stmt_done(stmt);
+  sqlite_fs_conn_release(conn);
+  PG_RETURN_BOOL(((rc)?false:true));
+}
+
+
+/*
+ * delete_entries(path, inodes) and delete_files(path, inodes),
+ * with inodes as an array or as a query (as insert_entries).
+ * In one SQLite transaction, through the temporary inode set.
+ * The entries are deleted with their files and extended attributes (but not their children).
+ */
+
+/* Collects the array in the inode set. Returns 0 on success. */
+static int
+sqlite_fs_collect_array(sqlite_fs_conn *conn, ArrayType *array, uint64 *count)
+{
+  sqlite3_stmt *stmt;
+  Datum *values;
+  bool *nulls;
+  int i, n, rc = 0;
+
+  n = sqlite_fs_deconstruct(array, INT8OID, &values, &nulls);
+
+  stmt = sqlite_fs_stmt(conn, SQLITE_FS_INSERT_INODE);
+  if(stmt == NULL)
+    return 1;
+
+  for(i = 0; i < n && rc == 0; i++){
+    if(nulls[i])
+      continue;
+    if(sqlite3_bind_int64(stmt, 1, DatumGetInt64(values[i])) != SQLITE_OK ||
+       sqlite3_step(stmt) != SQLITE_DONE){
+      N("SQL error collecting inode " INT64_FORMAT ": %s", DatumGetInt64(values[i]), sqlite3_errmsg(conn->db));
+      rc = 1;
+    }
+    sqlite3_reset(stmt);
+    (*count)++;
+  }
+
+  sqlite_fs_stmt_done(stmt);
+  return rc;
+}
+
+static bool
+pg_sqlite_fs_delete_many(PG_FUNCTION_ARGS, bool entries, bool query)
+{
+  int rc = 1;
+  char* db_path;
+  sqlite_fs_conn *conn = NULL;
+  uint64 count = 0, deleted = 0;
+
+  if(PG_ARGISNULL(0) || PG_ARGISNULL(1))
+    E("Null arguments not accepted");
+
+  db_path = convert_and_check_path(PG_GETARG_TEXT_PP(0)); // allocated in the function context: will be cleaned by PG
+
+  conn = sqlite_fs_conn_open(db_path, SQLITE_OPEN_READWRITE);
+  if( conn == NULL )
+    E("SQL error opening database: %s", db_path);
+
+  if(sqlite_fs_inodes_begin(conn))
+    goto bailout;
+
+  if(sqlite3_exec(conn->db, "BEGIN TRANSACTION;", NULL, NULL, NULL) != SQLITE_OK){
+    N("Error starting transaction: %s", sqlite3_errmsg(conn->db));
     goto bailout;
   }
 
-  /* Bind arguments */
-  D2("Binding arguments while inserting entry");
+  if(query)
+    rc = sqlite_fs_load(conn, text_to_cstring(PG_GETARG_TEXT_PP(1)), 0, NULL, NULL, &inodes_loader, 0, &count);
+  else
+    rc = sqlite_fs_collect_array(conn, PG_GETARG_ARRAYTYPE_P(1), &count);
+
+  if(rc == 0)
+    rc = sqlite_fs_delete_collected(conn, entries, &deleted);
+
+  if(sqlite3_exec(conn->db, (rc)?"ROLLBACK;":"COMMIT;", NULL, NULL, NULL) != SQLITE_OK){
+    N("Error closing transaction: %s", sqlite3_errmsg(conn->db));
+    rc = 1;
+  }
+
+  if(rc == 0)
+    D1("%s: " UINT64_FORMAT " %s deleted, out of " UINT64_FORMAT " inodes",
+       db_path, deleted, (entries) ? "entries" : "files", count);
+
+bailout:
+  sqlite_fs_conn_release(conn);
+  return ((rc)?false:true);
+}
+
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_delete_entries_array);
+Datum
+pg_sqlite_fs_delete_entries_array(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_BOOL(pg_sqlite_fs_delete_many(fcinfo, true, false));
+}
+
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_delete_files_array);
+Datum
+pg_sqlite_fs_delete_files_array(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_BOOL(pg_sqlite_fs_delete_many(fcinfo, false, false));
+}
+
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_delete_entries_query);
+Datum
+pg_sqlite_fs_delete_entries_query(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_BOOL(pg_sqlite_fs_delete_many(fcinfo, true, true));
+}
+
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_delete_files_query);
+Datum
+pg_sqlite_fs_delete_files_query(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_BOOL(pg_sqlite_fs_delete_many(fcinfo, false, true));
+}
+
+
+/*
+ * sqlite_fs_entries_agg(path, entry)
+ *
+ * SELECT sqlite_fs_entries_agg('/x.db', e) FROM my_entries e;
+ *
+ * Each row goes straight to the prepared INSERT, in one SQLite transaction
+ * opened on the first row and committed by the final function.
+ * The path is the same for all the rows of a group, and two groups can't load the
+ * same database at once (with GROUP BY, the groups are only sequential when sorted).
+ * The record fields are the ones of insert_entries.
+ */
+typedef struct sqlite_fs_agg_state {
+  sqlite_fs_conn *conn;
+  text           *path;   /* as given, to check the next rows */
+  sqlite3_stmt   *stmt;
+  TupleDesc       tupdesc;
+  int             attnums[8]; /* skipping the dropped columns */
+  Datum          *values;
+  bool           *nulls;
+  int64           count;
+} sqlite_fs_agg_state;
+
+/* If the final function did not run (eg rescan) */
+static void
+sqlite_fs_agg_shutdown(Datum arg)
+{
+  sqlite_fs_agg_state *state = (sqlite_fs_agg_state *) DatumGetPointer(arg);
+
+  if(state->conn == NULL)
+    return;
+
+  sqlite_fs_stmt_done(state->stmt);
+  if(sqlite3_exec(state->conn->db, "ROLLBACK;", NULL, NULL, NULL) != SQLITE_OK)
+    W("Error rolling back %s: %s", state->conn->path, sqlite3_errmsg(state->conn->db));
+  sqlite_fs_conn_release(state->conn);
+  state->conn = NULL;
+}
+
+static sqlite_fs_agg_state *
+sqlite_fs_agg_init(FunctionCallInfo fcinfo, MemoryContext aggcontext, HeapTupleHeader th)
+{
+  sqlite_fs_agg_state *state;
+  char *db_path;
+  TupleDesc tupdesc;
+  MemoryContext old_cxt;
+  int i, n = 0;
+
+  if(PG_ARGISNULL(1))
+    E("Null path not accepted");
+
+  db_path = convert_and_check_path(PG_GETARG_TEXT_PP(1));
+
+  old_cxt = MemoryContextSwitchTo(aggcontext);
+  state = (sqlite_fs_agg_state *) palloc0(sizeof(sqlite_fs_agg_state));
+  state->path = DatumGetTextPCopy(PG_GETARG_DATUM(1));
+
+  /* Check the record */
+  tupdesc = lookup_rowtype_tupdesc(HeapTupleHeaderGetTypeId(th), HeapTupleHeaderGetTypMod(th));
+  state->tupdesc = CreateTupleDescCopy(tupdesc);
+  ReleaseTupleDesc(tupdesc);
+
+  for(i = 0; i < state->tupdesc->natts && n < 8; i++){
+    Form_pg_attribute att = TupleDescAttr(state->tupdesc, i);
+    if(att->attisdropped)
+      continue;
+    if(att->atttypid != entries_types[n])
+      E("Invalid type for field %d: %s", n + 1, entries_names[n]);
+    state->attnums[n++] = i;
+  }
+  if(n < 8)
+    E("The record has %d fields. Expecting %d", n, 8);
+
+  state->values = (Datum*)palloc(state->tupdesc->natts * sizeof(Datum));
+  state->nulls = (bool*)palloc(state->tupdesc->natts * sizeof(bool));
+  MemoryContextSwitchTo(old_cxt);
+
+  state->conn = sqlite_fs_conn_open(db_path, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+  if(state->conn == NULL)
+    E("Can't open database %s", db_path);
+
+  if(!sqlite3_get_autocommit(state->conn->db)){
+    sqlite_fs_conn_release(state->conn);
+    state->conn = NULL;
+    E("%s is already being loaded by another group: sort the groups, or aggregate in separate queries", db_path);
+  }
+
+  state->stmt = sqlite_fs_stmt(state->conn, SQLITE_FS_INSERT_ENTRY);
+  if(state->stmt == NULL ||
+     sqlite3_exec(state->conn->db, "BEGIN TRANSACTION;", NULL, NULL, NULL) != SQLITE_OK)
+    E("Error starting transaction in %s: %s", db_path, sqlite3_errmsg(state->conn->db));
+
+  AggRegisterCallback(fcinfo, sqlite_fs_agg_shutdown, PointerGetDatum(state));
+  return state;
+}
+
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_entries_agg_transfn);
+Datum
+pg_sqlite_fs_entries_agg_transfn(PG_FUNCTION_ARGS)
+{
+  MemoryContext aggcontext;
+  sqlite_fs_agg_state *state;
+  HeapTupleHeader th;
+  HeapTupleData tuple;
+  Datum values[8];
+  bool nulls[8];
+  int i, rc;
+
+  if (!AggCheckCallContext(fcinfo, &aggcontext))
+    E("sqlite_fs_entries_agg called in non-aggregate context");
+
+  if(PG_ARGISNULL(2))
+    E("Null entries not accepted");
+
+  th = PG_GETARG_HEAPTUPLEHEADER(2);
+
+  if(PG_ARGISNULL(0))
+    state = sqlite_fs_agg_init(fcinfo, aggcontext, th);
+  else {
+    text *path;
+
+    state = (sqlite_fs_agg_state *) PG_GETARG_POINTER(0);
+    if(PG_ARGISNULL(1))
+      E("Null path not accepted");
+    path = PG_GETARG_TEXT_PP(1);
+    if(VARSIZE_ANY_EXHDR(path) != VARSIZE_ANY_EXHDR(state->path) ||
+       memcmp(VARDATA_ANY(path), VARDATA_ANY(state->path), VARSIZE_ANY_EXHDR(path)) != 0)
+      E("All the rows of a group must go to the same database: got %s after %s",
+	text_to_cstring(path), state->conn->path);
+  }
+
+  tuple.t_len = HeapTupleHeaderGetDatumLength(th);
+  ItemPointerSetInvalid(&(tuple.t_self));
+  tuple.t_tableOid = InvalidOid;
+  tuple.t_data = th;
+
+  /* in the per-row context: the detoasted values are freed after each row */
+  heap_deform_tuple(&tuple, state->tupdesc, state->values, state->nulls);
+  for(i = 0; i < 8; i++){
+    values[i] = state->values[state->attnums[i]];
+    nulls[i] = state->nulls[state->attnums[i]];
+  }
+
+  if(sqlite_fs_bind_entry(state->stmt, values, nulls))
+    E("Error binding entry in %s", state->conn->path);
+
+  /* Execute SQL prepared statement */
+  rc = sqlite3_step(state->stmt);
+  if( rc != SQLITE_DONE )
+    E("SQL error inserting entry %ld | error %d: %s", DatumGetInt64(values[0]), rc, sqlite3_errmsg(state->conn->db));
+  sqlite3_reset(state->stmt);
+
+  state->count++;
+  PG_RETURN_POINTER(state);
+}
+
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_entries_agg_finalfn);
+Datum
+pg_sqlite_fs_entries_agg_finalfn(PG_FUNCTION_ARGS)
+{
+  sqlite_fs_agg_state *state;
+
+  if(PG_ARGISNULL(0)) /* no rows */
+    PG_RETURN_INT64(0);
+
+  state = (sqlite_fs_agg_state *) PG_GETARG_POINTER(0);
+
+  if(state->conn){
+    sqlite_fs_stmt_done(state->stmt);
+    if(sqlite3_exec(state->conn->db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
+      E("Error committing %s: %s", state->conn->path, sqlite3_errmsg(state->conn->db));
+    D1("Inserted %ld entries in %s", state->count, state->conn->path);
+    sqlite_fs_conn_release(state->conn);
+    state->conn = NULL;
+  }
+
+  PG_RETURN_INT64(state->count);
+}
+
+
+/*-------------------------------------------------------------------------
+ *
+ * Building a database from scratch
+ *
+ * The database is built in a sibling temporary file, with no journal and no sync,
+ * switched to sqlite_fs.journal_mode, and then renamed over the target path:
+ * the readers of the target never wait for the build, nor see a half-built tree.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+/* Creates the schema and loads the queries, in a fresh database. Returns 0 on success. */
+static int
+sqlite_fs_build_into(sqlite_fs_conn *conn, const char *entries_sql, const char *files_sql)
+{
+  int rc;
+  char *err = NULL;
+  uint64 count;
+
+  sqlite_fs_pragma(conn, "PRAGMA page_size = %d;", pg_sqlite_fs_page_size);
+  sqlite_fs_pragma(conn, "PRAGMA auto_vacuum = %d;", pg_sqlite_fs_auto_vacuum);
+  sqlite_fs_pragma(conn, "PRAGMA synchronous = %d;", 0);
+  conn->synchronous = 0;
+  if(sqlite3_exec(conn->db, "PRAGMA journal_mode = OFF;", NULL, NULL, NULL) != SQLITE_OK)
+    W("Can't turn off the journal of %s: %s", conn->path, sqlite3_errmsg(conn->db));
+
+  rc = sqlite3_exec(conn->db, sqlite_fs_schema(), NULL, NULL, &err);
+  if( rc != SQLITE_OK ){
+    N("SQL error creating schema: %s", err);
+    sqlite3_free(err);
+    return 1;
+  }
+
+  rc = sqlite3_exec(conn->db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+  if( rc != SQLITE_OK ) {
+    N("Error starting transaction: %s", sqlite3_errmsg(conn->db));
+    return 1;
+  }
+
+  if(pg_sqlite_fs_sorted_load){
+    entries_sql = sqlite_fs_sorted_query(entries_sql);
+    if(files_sql) files_sql = sqlite_fs_sorted_query(files_sql);
+  }
+
+  rc = sqlite_fs_load_entries_deferred(conn, entries_sql, 0, &count);
+  if(rc == 0 && files_sql)
+    rc = sqlite_fs_load(conn, files_sql, 0, NULL, NULL, &files_loader, 0, &count);
+
+  if(rc){
+    /* SQLITE_FULL may have rolled it back already: keep rc, 7 falls back to disk */
+    if(!sqlite3_get_autocommit(conn->db))
+      (void)sqlite3_exec(conn->db, "ROLLBACK;", NULL, NULL, NULL);
+  } else if( sqlite3_exec(conn->db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK ) {
+    N("Error closing transaction: %s", sqlite3_errmsg(conn->db));
+    rc = (sqlite3_errcode(conn->db) == SQLITE_FULL) ? 7 : 1;
+  }
+  return rc;
+}
+
+/* A sibling of db_path, unique to the backend */
+static void
+sqlite_fs_tmp_path(const char *db_path, char *tmp_path)
+{
+  if(snprintf(tmp_path, MAXPGPATH, "%s.%d.tmp", db_path, MyProcPid) >= MAXPGPATH)
+    E("Path too long: %s", db_path);
+  (void)unlink(tmp_path); // leftover from a crash
+}
+
+/*
+ * Built without a journal: give the new file the configured journal mode,
+ * which the readers find in the header (wal) or get by default (the others).
+ */
+static void
+sqlite_fs_build_journal_mode(const char *tmp_path)
+{
+  sqlite_fs_conn *conn;
+  char sql[64];
+
+  conn = sqlite_fs_conn_private(tmp_path, SQLITE_OPEN_READWRITE);
+  if(conn == NULL)
+    return;
+
+  snprintf(sql, sizeof(sql), "PRAGMA journal_mode = %s;", journal_mode_options[pg_sqlite_fs_journal_mode].name);
+  if(sqlite3_exec(conn->db, sql, NULL, NULL, NULL) != SQLITE_OK)
+    W("SQL error for '%s' in %s: %s", sql, tmp_path, sqlite3_errmsg(conn->db));
+
+  sqlite_fs_conn_close(conn);
+}
+
+/*
+ * The -wal of db_path would be paired with the new file (the rename ignores it): corruption.
+ * So it is checkpointed into the old database and truncated first.
+ * Returns false if it can't be (eg a reader still uses it): the old database stays.
+ */
+static bool
+sqlite_fs_publish_wal(const char *db_path)
+{
+  char wal_path[MAXPGPATH + 4];
+  struct stat st;
+  sqlite_fs_conn *conn;
+  int rc;
+
+  snprintf(wal_path, sizeof(wal_path), "%s-wal", db_path);
+  if(stat(wal_path, &st) != 0 || st.st_size == 0)
+    return true;
+
+  conn = sqlite_fs_conn_open(db_path, SQLITE_OPEN_READWRITE);
+  if( conn == NULL )
+    return false;
+  rc = sqlite3_wal_checkpoint_v2(conn->db, NULL, SQLITE_CHECKPOINT_TRUNCATE, NULL, NULL);
+  if( rc != SQLITE_OK )
+    W("Can't checkpoint the WAL of %s: %s", db_path, sqlite3_errmsg(conn->db));
+  sqlite_fs_conn_release(conn);
+  sqlite_fs_conn_invalidate(db_path);
+
+  if(rc != SQLITE_OK || (stat(wal_path, &st) == 0 && st.st_size > 0)){
+    W("The WAL of %s is in use: not replacing the database", db_path);
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Set the journal mode, empty the WAL of the old database,
+ * fsync the new file, rename it over db_path, and fsync the directory
+ */
+static bool
+sqlite_fs_publish(const char *tmp_path, const char *db_path)
+{
+  sqlite_fs_build_journal_mode(tmp_path);
+
+  if(!sqlite_fs_publish_wal(db_path)){
+    (void)unlink(tmp_path);
+    return false;
+  }
+
+  if(durable_rename(tmp_path, db_path, WARNING) != 0){
+    (void)unlink(tmp_path);
+    return false;
+  }
+  sqlite_fs_conn_invalidate(db_path);
+  D1("Successfully built: %s", db_path);
+  return true;
+}
+
+static bool
+sqlite_fs_build_file(const char *db_path, const char *entries_sql, const char *files_sql)
+{
+  int rc = 1;
+  char tmp_path[MAXPGPATH];
+  sqlite_fs_conn * volatile conn = NULL;
+  mode_t m;
+
+  sqlite_fs_tmp_path(db_path, tmp_path);
+
+  m = umask(0007);
+  D1("Building %s in %s", db_path, tmp_path);
+
+  PG_TRY();
+  {
+    conn = sqlite_fs_conn_private(tmp_path, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+    if(conn)
+      rc = sqlite_fs_build_into(conn, entries_sql, files_sql);
+  }
+  PG_CATCH();
+  {
+    sqlite_fs_conn_close(conn);
+    (void)unlink(tmp_path);
+    (void)umask(m);
+    PG_RE_THROW();
+  }
+  PG_END_TRY();
+
+  (void)umask(m); // reset back to old mask
+
+  if(!sqlite_fs_conn_close(conn))
+    rc = 1;
+
+  if(rc){
+    (void)unlink(tmp_path);
+    return false;
+  }
+
+  return sqlite_fs_publish(tmp_path, db_path);
+}
+
+/*
+ * reset(path): replaces the database with an empty one, whatever its size.
+ * The new database is created aside, and renamed over the old one.
+ */
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_reset);
+Datum
+pg_sqlite_fs_reset(PG_FUNCTION_ARGS)
+{
+  int rc = 1;
+  char *db_path;
+  char tmp_path[MAXPGPATH];
+  char *err = NULL;
+  sqlite_fs_conn * volatile conn = NULL;
+  mode_t m;
+
+  if(PG_ARGISNULL(0))
+    E("Null arguments not accepted");
+
+  db_path = convert_and_check_path(PG_GETARG_TEXT_PP(0)); // allocated in the function context: will be cleaned by PG
+  sqlite_fs_tmp_path(db_path, tmp_path);
+
+  m = umask(0007);
+
+  PG_TRY();
+  {
+    conn = sqlite_fs_conn_private(tmp_path, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+    if(conn){
+      sqlite_fs_pragma(conn, "PRAGMA page_size = %d;", pg_sqlite_fs_page_size);
+      sqlite_fs_pragma(conn, "PRAGMA auto_vacuum = %d;", pg_sqlite_fs_auto_vacuum);
+      rc = sqlite3_exec(conn->db, sqlite_fs_schema(), NULL, NULL, &err);
+      if( rc == SQLITE_OK )
+	rc = sqlite3_exec(conn->db, names_index, NULL, NULL, &err);
+      if( rc != SQLITE_OK )
+	N("SQL error creating schema: %s", err);
+    }
+  }
+  PG_CATCH();
+  {
+    sqlite_fs_conn_close(conn);
+    (void)unlink(tmp_path);
+    (void)umask(m);
+    PG_RE_THROW();
+  }
+  PG_END_TRY();
+
+  (void)umask(m); // reset back to old mask
+
+  if(err)
+    sqlite3_free(err);
+
+  if(!sqlite_fs_conn_close(conn))
+    rc = 1;
+
+  if(rc){
+    (void)unlink(tmp_path);
+    PG_RETURN_BOOL(false);
+  }
+
+  PG_RETURN_BOOL(sqlite_fs_publish(tmp_path, db_path));
+}
+
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_build);
+Datum
+pg_sqlite_fs_build(PG_FUNCTION_ARGS)
+{
+  char *db_path;
+  char *entries_sql, *files_sql = NULL;
+
+  if(PG_NARGS() != 3){
+    E("Invalid number of arguments: expected 3, got %d", PG_NARGS());
+    PG_RETURN_BOOL(false);
+  }
+
+  if(PG_ARGISNULL(0) || PG_ARGISNULL(1)){
+    E("First 2 arguments can't be null");
+    PG_RETURN_BOOL(false);
+  }
+
+  db_path = convert_and_check_path(PG_GETARG_TEXT_PP(0)); // allocated in the function context: will be cleaned by PG
+  entries_sql = text_to_cstring(PG_GETARG_TEXT_PP(1));
+  if(!PG_ARGISNULL(2)) files_sql = text_to_cstring(PG_GETARG_TEXT_PP(2));
 
-  rc = rc ||
-    (sqlite3_bind_int64(stmt, 1, inode) ||
-     sqlite3_bind_text( stmt, 2, VARDATA_ANY(name), (int)VARSIZE_ANY_EXHDR(name), SQLITE_STATIC) || // we handle destruction
-     sqlite3_bind_int64(stmt, 3, parent_inode) ||
-     sqlite3_bind_int64(stmt, 4, PG_GETARG_INT64(4)) || // ctime
-     sqlite3_bind_int64(stmt, 5, PG_GETARG_INT64(5)) || // mtime
-     sqlite3_bind_int64(stmt, 6, PG_GETARG_INT64(6)) || // nlink
-     sqlite3_bind_int64(stmt, 7, PG_GETARG_INT64(7)) || // size
-     sqlite3_bind_int(  stmt, 8, (PG_GETARG_BOOL(8))?1:0) // is_dir
-     );
-  if( rc != SQLITE_OK ) {
-    N("Error binding main arguments: %s", sqlite3_errmsg(db));
-    rc = 2;
-    goto bailout;
-  }
+  PG_RETURN_BOOL(sqlite_fs_build_file(db_path, entries_sql, files_sql));
+}
 
-  /* Execute SQL prepared statement */
-  D2("Execute statement for insert entry");
-  rc = sqlite3_step(stmt);
-  if( rc != SQLITE_DONE ){
-    N("SQL error inserting entry: %ld | error %d: %s", inode, rc, sqlite3_errstr(rc));
-    rc = 3;
-    goto bailout;
+
+/*
+ * In-memory builds
+ *
+ * The database is built in memory, up to sqlite_fs.max_memory_build,
+ * and written in one sequential pass with VACUUM INTO.
+ */
+
+/* Turns the (empty) :memory: database into a memdb one, which can be capped */
+static int
+sqlite_fs_memdb(sqlite_fs_conn *conn, sqlite3_int64 limit)
+{
+  int rc;
+
+  rc = sqlite3_deserialize(conn->db, "main", NULL, 0, 0,
+			   SQLITE_DESERIALIZE_FREEONCLOSE | SQLITE_DESERIALIZE_RESIZEABLE);
+  if( rc != SQLITE_OK ){
+    N("Error creating the in-memory database: %s", sqlite3_errmsg(conn->db));
+    return rc;
   }
 
-  D3("Successfully inserted entry %ld ([%ld]/%*s)", inode, parent_inode, (int)VARSIZE_ANY_EXHDR(name), VARDATA_ANY(name));
-  rc = 0; // success
-  
-bailout:
-  if(stmt) sqlite3_finalize(stmt);
-  sqlite3_close(db);
-  PG_RETURN_BOOL(((rc)?false:true));
+  rc = sqlite3_file_control(conn->db, "main", SQLITE_FCNTL_SIZE_LIMIT, &limit);
+  if( rc != SQLITE_OK )
+    N("Error capping the in-memory database: %s", sqlite3_errstr(rc));
+  return rc;
 }
 
+/*
+ * Returns 0 on success, 7 if the database does not fit in memory.
+ * The database is then in conn.
+ */
+static int
+sqlite_fs_build_memory(sqlite_fs_conn *conn, const char *entries_sql, const char *files_sql)
+{
+  if(sqlite_fs_memdb(conn, (sqlite3_int64)pg_sqlite_fs_max_memory_build * 1024) != SQLITE_OK)
+    return 1;
 
-PG_FUNCTION_INFO_V1(pg_sqlite_fs_delete_file);
+  return sqlite_fs_build_into(conn, entries_sql, files_sql);
+}
+
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_build_in_memory);
 Datum
-pg_sqlite_fs_delete_file(PG_FUNCTION_ARGS)
+pg_sqlite_fs_build_in_memory(PG_FUNCTION_ARGS)
 {
-    int rc = 1;
-    char* db_path;
-    int64 inode;
-    sqlite3 *db;
-    sqlite3_stmt *stmt = NULL;
+  int rc = 1;
+  char *db_path;
+  char *entries_sql, *files_sql = NULL;
+  char tmp_path[MAXPGPATH];
+  sqlite_fs_conn * volatile conn = NULL;
+  sqlite3_stmt *stmt = NULL;
+  mode_t m;
 
-    db_path = convert_and_check_path(PG_GETARG_TEXT_PP(0)); // allocated in the function context: will be cleaned by PG
-    N("Opening database %s", db_path);
+  if(PG_NARGS() != 3){
+    E("Invalid number of arguments: expected 3, got %d", PG_NARGS());
+    PG_RETURN_BOOL(false);
+  }
 
-    rc = sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READWRITE, NULL);
-    if( rc != SQLITE_OK )
-      E("SQL error opening database: %s | error %d: %s", db_path, rc, sqlite3_errstr(rc));
-	
-    /* rc = sqlite3_prepare_v3(db,
-			    "DELETE FROM files WHERE inode = ?;",
-			    -1, SQLITE_PREPARE_PERSISTENT, // reused
-			    &stmt, NULL); */
-    rc = sqlite3_prepare_v2(db,
-			   "DELETE FROM files WHERE inode = ?;",
-			   -1, &stmt, NULL);
+  if(PG_ARGISNULL(0) || PG_ARGISNULL(1)){
+    E("First 2 arguments can't be null");
+    PG_RETURN_BOOL(false);
+  }
 
-    inode = PG_GETARG_INT64(1);
+  db_path = convert_and_check_path(PG_GETARG_TEXT_PP(0)); // allocated in the function context: will be cleaned by PG
+  entries_sql = text_to_cstring(PG_GETARG_TEXT_PP(1));
+  if(!PG_ARGISNULL(2)) files_sql = text_to_cstring(PG_GETARG_TEXT_PP(2));
 
-    rc = sqlite3_bind_int64(stmt, 1, inode);
-    if( rc != SQLITE_OK ) {
-      N("Error binding main arguments: %s", sqlite3_errmsg(db));
-      goto bailout;
-    }
+  sqlite_fs_tmp_path(db_path, tmp_path);
 
-    /* Execute SQL prepared statement */
-    D1("Execute statement for deleting a file");
-    rc = sqlite3_step(stmt);
-    if( rc != SQLITE_DONE ){
-      N("Error: %s", sqlite3_errmsg(db));
-      rc = 1;
+  m = umask(0007);
+  D1("Building %s in memory", db_path);
+
+  PG_TRY();
+  {
+    conn = sqlite_fs_conn_private(":memory:", SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+    if(conn)
+      rc = sqlite_fs_build_memory(conn, entries_sql, files_sql);
+
+    if(rc == 0){
+      /* Write it in one go */
+      rc = sqlite3_prepare_v2(conn->db, "VACUUM INTO ?;", -1, &stmt, NULL);
+      if(rc == SQLITE_OK)
+	rc = sqlite3_bind_text(stmt, 1, tmp_path, -1, SQLITE_STATIC);
+      if(rc == SQLITE_OK && (rc = sqlite3_step(stmt)) == SQLITE_DONE)
+	rc = 0;
+      else
+	N("Error writing %s: %s", tmp_path, sqlite3_errmsg(conn->db));
+      sqlite3_finalize(stmt);
     }
-    rc = 0; // success
+  }
+  PG_CATCH();
+  {
+    sqlite_fs_conn_close(conn);
+    (void)unlink(tmp_path);
+    (void)umask(m);
+    PG_RE_THROW();
+  }
+  PG_END_TRY();
 
-bailout:
-    if(stmt) sqlite3_finalize(stmt);
-    sqlite3_close(db);
-    PG_RETURN_BOOL(((rc)?false:true));
+  (void)umask(m); // reset back to old mask
+
+  sqlite_fs_conn_close(conn);
+
+  if(rc == 7){
+    N("%s does not fit in %s = %dkB: building on disk", db_path, SQLITE_FS_MAX_MEMORY_BUILD, pg_sqlite_fs_max_memory_build);
+    PG_RETURN_BOOL(sqlite_fs_build_file(db_path, entries_sql, files_sql));
+  }
+
+  if(rc){
+    (void)unlink(tmp_path);
+    PG_RETURN_BOOL(false);
+  }
+
+  PG_RETURN_BOOL(sqlite_fs_publish(tmp_path, db_path));
 }
 
-PG_FUNCTION_INFO_V1(pg_sqlite_fs_delete_entry);
+
+/*
+ * Same, but returns the database as a bytea, instead of writing it
+ * under sqlite_fs.location: the clients fetch it in one round trip.
+ */
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_build_bytea);
 Datum
-pg_sqlite_fs_delete_entry(PG_FUNCTION_ARGS)
+pg_sqlite_fs_build_bytea(PG_FUNCTION_ARGS)
 {
-    int rc = 1;
-    char* db_path;
-    int64 inode;
-    sqlite3 *db;
-    sqlite3_stmt *stmt = NULL;
+  int rc = 1;
+  char *entries_sql, *files_sql = NULL;
+  sqlite_fs_conn * volatile conn = NULL;
+  sqlite3_int64 limit, size = 0;
+  unsigned char *data;
+  bytea *result = NULL;
 
-    db_path = convert_and_check_path(PG_GETARG_TEXT_PP(0)); // allocated in the function context: will be cleaned by PG
-    N("Opening database %s", db_path);
+  if(PG_NARGS() != 2){
+    E("Invalid number of arguments: expected 2, got %d", PG_NARGS());
+    PG_RETURN_NULL();
+  }
 
-    rc = sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READWRITE, NULL);
-    if( rc != SQLITE_OK )
-      E("SQL error opening database: %s | error %d: %s", db_path, rc, sqlite3_errstr(rc));
-	
-    rc = sqlite3_prepare_v2(db,
-			   "DELETE FROM entries WHERE inode = ?1 OR parent_inode = ?1;",
-			    // Note: in case of directory: missing some sub-directories
-			    // => Use recursive with condition
-			   -1, &stmt, NULL);
+  if(PG_ARGISNULL(0)){
+    E("First argument can't be null");
+    PG_RETURN_NULL();
+  }
 
-    inode = PG_GETARG_INT64(1);
+  entries_sql = text_to_cstring(PG_GETARG_TEXT_PP(0));
+  if(!PG_ARGISNULL(1)) files_sql = text_to_cstring(PG_GETARG_TEXT_PP(1));
 
-    rc = sqlite3_bind_int64(stmt, 1, inode);
-    if( rc != SQLITE_OK ) {
-      N("Error binding main arguments: %s", sqlite3_errmsg(db));
-      goto bailout;
-    }
+  /* a bytea can't be larger */
+  limit = Min((sqlite3_int64)pg_sqlite_fs_max_memory_build * 1024, (sqlite3_int64)(MaxAllocSize - VARHDRSZ));
 
-    /* Execute SQL prepared statement */
-    D1("Execute statement for deleting an entry");
-    while(1){
-      rc = sqlite3_step(stmt);
-      if( rc == SQLITE_DONE ){
-	rc = 0; // success
-	goto bailout;
-      }
-      if( rc != SQLITE_ROW ) {
-	N("Error: %s", sqlite3_errmsg(db));
+  PG_TRY();
+  {
+    conn = sqlite_fs_conn_private(":memory:", SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+    if(conn && sqlite_fs_memdb(conn, limit) == SQLITE_OK)
+      rc = sqlite_fs_build_into(conn, entries_sql, files_sql);
+
+    if(rc == 0){
+      /* no copy: points into the memdb buffer */
+      data = sqlite3_serialize(conn->db, "main", &size, SQLITE_SERIALIZE_NOCOPY);
+      if(data == NULL || size > limit){
+	N("Error serializing the database: %s", sqlite3_errmsg(conn->db));
 	rc = 1;
-	goto bailout;
+      } else {
+	result = (bytea *) palloc(size + VARHDRSZ);
+	SET_VARSIZE(result, size + VARHDRSZ);
+	memcpy(VARDATA(result), data, size);
       }
     }
+  }
+  PG_CATCH();
+  {
+    sqlite_fs_conn_close(conn);
+    PG_RE_THROW();
+  }
+  PG_END_TRY();
 
-bailout:
-    if(stmt) sqlite3_finalize(stmt);
-    sqlite3_close(db);
-    PG_RETURN_BOOL(((rc)?false:true));
+  sqlite_fs_conn_close(conn);
+
+  if(rc == 7)
+    E("The database does not fit in %s = %dkB", SQLITE_FS_MAX_MEMORY_BUILD, pg_sqlite_fs_max_memory_build);
+
+  if(rc)
+    PG_RETURN_NULL();
+
+  D1("Serialized database: %lld bytes", (long long)size);
+  PG_RETURN_BYTEA_P(result);
 }
 
 
-static bool
-pg_sqlite_fs_truncate_table(PG_FUNCTION_ARGS, const char* sql)
+/*
+ * build_many(jobs, workers)
+ *
+ * jobs is a query returning (path, entries, files) text columns, as the arguments of build().
+ * The jobs are built by up to `workers` dynamic background workers, each taking the next
+ * job from a shared counter. The GUCs of the caller are passed on to the workers.
+ * The workers run in their own transactions: the jobs only see committed data.
+ * Returns one (path, ok, ms) row per job, and reports them as they finish.
+ */
+
+typedef struct sqlite_fs_build_job {
+  Size              path;     /* offsets in the segment, 0 for NULL */
+  Size              entries;
+  Size              files;
+  pg_atomic_uint32  done;
+  bool              ok;
+  double            ms;
+} sqlite_fs_build_job;
+
+typedef struct sqlite_fs_build_shared {
+  PGPROC           *leader;
+  Oid               dbid;
+  Oid               userid;
+  Size              gucs;     /* offset */
+  pg_atomic_uint32  next;
+  int               njobs;
+  sqlite_fs_build_job jobs[FLEXIBLE_ARRAY_MEMBER];
+} sqlite_fs_build_shared;
+
+#define SQLITE_FS_BUILD_STRING(shared, offset) ((offset) ? (char*)(shared) + (offset) : NULL)
+
+/* Builds a job, in its own transaction, so that a failure does not stop the others */
+static void
+sqlite_fs_build_job_run(sqlite_fs_build_shared *shared, sqlite_fs_build_job *job)
 {
-    int rc = 1;
-    char* db_path;
-    sqlite3 *db;
-    char* err = NULL;
+  MemoryContext cxt = CurrentMemoryContext;
+  instr_time start, end;
+  volatile bool ok = false;
 
-    db_path = convert_and_check_path(PG_GETARG_TEXT_PP(0)); // allocated in the function context: will be cleaned by PG
-    N("Opening database %s", db_path);
+  INSTR_TIME_SET_CURRENT(start);
 
-    rc = sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READWRITE, NULL);
-    if( rc != SQLITE_OK )
-      E("SQL error opening database: %s | error %d: %s", db_path, rc, sqlite3_errstr(rc));
-	
-    D1("Execute statement: %s", sql);
-    rc = sqlite3_exec(db, sql, NULL, NULL, &err);
-   
-    if( rc != SQLITE_OK )
-      N("SQL error for '%s' in %s: %s", sql, db_path, err);
+  SetCurrentStatementStartTimestamp();
+  StartTransactionCommand();
+  PushActiveSnapshot(GetTransactionSnapshot());
+  pgstat_report_activity(STATE_RUNNING, SQLITE_FS_BUILD_STRING(shared, job->path));
 
-    if(err)
-      sqlite3_free(err);
+  PG_TRY();
+  {
+    ok = sqlite_fs_build_file(SQLITE_FS_BUILD_STRING(shared, job->path),
+			      SQLITE_FS_BUILD_STRING(shared, job->entries),
+			      SQLITE_FS_BUILD_STRING(shared, job->files));
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+  }
+  PG_CATCH();
+  {
+    MemoryContextSwitchTo(cxt);
+    EmitErrorReport();
+    FlushErrorState();
+    AbortCurrentTransaction();
+    ok = false;
+  }
+  PG_END_TRY();
 
-    sqlite3_close(db);
+  pgstat_report_activity(STATE_IDLE, NULL);
+  INSTR_TIME_SET_CURRENT(end);
+  INSTR_TIME_SUBTRACT(end, start);
 
-    return (rc == SQLITE_OK)?true:false;
+  job->ok = ok;
+  job->ms = INSTR_TIME_GET_MILLISEC(end);
+  pg_write_barrier();
+  pg_atomic_write_u32(&job->done, 1);
 }
 
-PG_FUNCTION_INFO_V1(pg_sqlite_fs_truncate_entries);
-Datum
-pg_sqlite_fs_truncate_entries(PG_FUNCTION_ARGS)
+PGDLLEXPORT void
+pg_sqlite_fs_build_worker_main(Datum main_arg)
 {
-  PG_RETURN_BOOL(pg_sqlite_fs_truncate_table(fcinfo, "DELETE FROM entries WHERE inode > 1"));
+  dsm_segment *seg;
+  sqlite_fs_build_shared *shared;
+  uint32 i;
+
+  pqsignal(SIGTERM, die);
+  BackgroundWorkerUnblockSignals();
+
+  CurrentResourceOwner = ResourceOwnerCreate(NULL, "sqlite_fs build worker");
+  seg = dsm_attach(DatumGetUInt32(main_arg));
+  if(seg == NULL)
+    E("Could not map the build_many jobs: the caller is gone");
+  shared = (sqlite_fs_build_shared*)dsm_segment_address(seg);
+
+  BackgroundWorkerInitializeConnectionByOid(shared->dbid, shared->userid, 0);
+
+  StartTransactionCommand();
+  RestoreGUCState((char*)shared + shared->gucs);
+  CommitTransactionCommand();
+
+  while((i = pg_atomic_fetch_add_u32(&shared->next, 1)) < (uint32)shared->njobs){
+    CHECK_FOR_INTERRUPTS();
+    sqlite_fs_build_job_run(shared, &shared->jobs[i]);
+    SetLatch(&shared->leader->procLatch);
+  }
+
+  dsm_detach(seg);
+  proc_exit(0);
 }
 
-PG_FUNCTION_INFO_V1(pg_sqlite_fs_truncate_files);
-Datum
-pg_sqlite_fs_truncate_files(PG_FUNCTION_ARGS)
+/* Returns the number of workers started */
+static int
+sqlite_fs_build_workers_start(dsm_segment *seg, int nworkers, BackgroundWorkerHandle **handles)
 {
-  // See https://www.sqlite.org/lang_delete.html#the_truncate_optimization
-  PG_RETURN_BOOL(pg_sqlite_fs_truncate_table(fcinfo, "DELETE FROM files"));
+  BackgroundWorker worker;
+  int i;
+
+  memset(&worker, 0, sizeof(worker));
+  worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+  worker.bgw_start_time = BgWorkerStart_ConsistentState;
+  worker.bgw_restart_time = BGW_NEVER_RESTART;
+  snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_sqlite_fs");
+  snprintf(worker.bgw_function_name, BGW_MAXLEN, "pg_sqlite_fs_build_worker_main");
+  snprintf(worker.bgw_name, BGW_MAXLEN, "sqlite_fs build worker for PID %d", MyProcPid);
+  snprintf(worker.bgw_type, BGW_MAXLEN, "sqlite_fs build worker");
+  worker.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(seg));
+  worker.bgw_notify_pid = MyProcPid;
+
+  for(i = 0; i < nworkers; i++){
+    if(!RegisterDynamicBackgroundWorker(&worker, &handles[i])){
+      N("Could only start %d of %d build workers: see max_worker_processes", i, nworkers);
+      break;
+    }
+  }
+  return i;
 }
 
-PG_FUNCTION_INFO_V1(pg_sqlite_fs_truncate_attributes);
-Datum
-pg_sqlite_fs_truncate_attributes(PG_FUNCTION_ARGS)
+/* Waits for the workers, reporting the jobs as they finish */
+static void
+sqlite_fs_build_workers_wait(sqlite_fs_build_shared *shared, BackgroundWorkerHandle **handles, int nworkers)
 {
-  PG_RETURN_BOOL(pg_sqlite_fs_truncate_table(fcinfo, "DELETE FROM extended_attributes"));
-}
+  bool *reported = (bool*)palloc0(shared->njobs * sizeof(bool));
+  int nreported = 0;
+
+  for(;;){
+    bool stopped = true;
+    int i;
+    pid_t pid;
+
+    /* before the new reports, so that the last jobs are not missed */
+    for(i = 0; i < nworkers; i++)
+      if(GetBackgroundWorkerPid(handles[i], &pid) != BGWH_STOPPED)
+	stopped = false;
+
+    for(i = 0; i < shared->njobs; i++){
+      sqlite_fs_build_job *job = &shared->jobs[i];
+
+      if(reported[i] || pg_atomic_read_u32(&job->done) == 0)
+	continue;
+      pg_read_barrier();
+      reported[i] = true;
+      nreported++;
+      N("[%d/%d] %s %s in %.3f ms", nreported, shared->njobs,
+	SQLITE_FS_BUILD_STRING(shared, job->path), (job->ok) ? "built" : "failed", job->ms);
+    }
 
+    if(nreported == shared->njobs || stopped)
+      break;
 
-PG_FUNCTION_INFO_V1(pg_sqlite_fs_exec);
+    (void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH, 1000L, PG_WAIT_EXTENSION);
+    ResetLatch(MyLatch);
+    CHECK_FOR_INTERRUPTS();
+  }
+
+  pfree(reported);
+}
+
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_build_many);
 Datum
-pg_sqlite_fs_exec(PG_FUNCTION_ARGS)
+pg_sqlite_fs_build_many(PG_FUNCTION_ARGS)
 {
-  int rc = 1;
-  char* db_path;
-  char* sql;
-  char* err = NULL;
-  sqlite3 *db;
+  ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+  char *jobs_sql;
+  int nworkers, nstarted, njobs, i, j;
+  Size size, gucs_size, offset;
+  TupleDesc tupdesc;
+  dsm_segment *seg;
+  sqlite_fs_build_shared *shared;
+  BackgroundWorkerHandle **handles;
+  char **paths;
+
+  if(PG_ARGISNULL(0))
+    E("Null arguments not accepted");
 
-  if(PG_NARGS() != 2){
-    E("Invalid number of arguments: expected 2, got %d", PG_NARGS());
-    PG_RETURN_BOOL(false);
+  jobs_sql = text_to_cstring(PG_GETARG_TEXT_PP(0));
+  nworkers = (PG_ARGISNULL(1)) ? 1 : PG_GETARG_INT32(1);
+  if(nworkers < 1)
+    E("The number of workers must be positive");
+
+  InitMaterializedSRF(fcinfo, 0);
+
+  /* The jobs */
+  if(SPI_connect() != SPI_OK_CONNECT)
+    E("SPI_connect failed");
+
+  if(SPI_execute(jobs_sql, true, 0) != SPI_OK_SELECT)
+    E("Invalid jobs query: %s", jobs_sql);
+
+  tupdesc = SPI_tuptable->tupdesc;
+  if(tupdesc->natts < 3)
+    E("The jobs query returns %d fields. Expecting 3: path, entries and files", tupdesc->natts);
+  for(j = 0; j < 3; j++)
+    if(TupleDescAttr(tupdesc, j)->atttypid != TEXTOID)
+      E("Invalid type for field %d: expecting text", j + 1);
+
+  njobs = (int)SPI_processed;
+  paths = (char**)palloc(njobs * sizeof(char*));
+
+  /* header, paths, queries, and the GUCs */
+  gucs_size = EstimateGUCStateSpace();
+  size = MAXALIGN(offsetof(sqlite_fs_build_shared, jobs) + njobs * sizeof(sqlite_fs_build_job));
+  for(i = 0; i < njobs; i++){
+    bool isnull;
+    Datum d = heap_getattr(SPI_tuptable->vals[i], 1, tupdesc, &isnull);
+
+    if(isnull || heap_attisnull(SPI_tuptable->vals[i], 2, tupdesc))
+      E("The path and entries of job %d can't be NULL", i + 1);
+    paths[i] = convert_and_check_path(DatumGetTextPP(d));
+    size += strlen(paths[i]) + 1;
+    for(j = 2; j <= 3; j++){
+      d = heap_getattr(SPI_tuptable->vals[i], j, tupdesc, &isnull);
+      if(!isnull)
+	size += VARSIZE_ANY_EXHDR(DatumGetTextPP(d)) + 1;
+    }
+  }
+  size = MAXALIGN(size) + gucs_size;
+
+  seg = dsm_create(size, 0);
+  shared = (sqlite_fs_build_shared*)dsm_segment_address(seg);
+  shared->leader = MyProc;
+  shared->dbid = MyDatabaseId;
+  shared->userid = GetUserId();
+  shared->njobs = njobs;
+  pg_atomic_init_u32(&shared->next, 0);
+
+  offset = MAXALIGN(offsetof(sqlite_fs_build_shared, jobs) + njobs * sizeof(sqlite_fs_build_job));
+  for(i = 0; i < njobs; i++){
+    sqlite_fs_build_job *job = &shared->jobs[i];
+    Size *fields[3] = { &job->path, &job->entries, &job->files };
+
+    memset(job, 0, sizeof(sqlite_fs_build_job));
+    pg_atomic_init_u32(&job->done, 0);
+
+    job->path = offset;
+    strcpy((char*)shared + offset, paths[i]);
+    offset += strlen(paths[i]) + 1;
+
+    for(j = 2; j <= 3; j++){
+      bool isnull;
+      Datum d = heap_getattr(SPI_tuptable->vals[i], j, tupdesc, &isnull);
+      text *t;
+
+      if(isnull)
+	continue;
+      t = DatumGetTextPP(d);
+      *fields[j - 1] = offset;
+      memcpy((char*)shared + offset, VARDATA_ANY(t), VARSIZE_ANY_EXHDR(t));
+      offset += VARSIZE_ANY_EXHDR(t);
+      *((char*)shared + offset++) = '\0';
+    }
   }
+  shared->gucs = MAXALIGN(offset);
+  SerializeGUCState(gucs_size, (char*)shared + shared->gucs);
 
-  if(PG_ARGISNULL(0) || PG_ARGISNULL(1)){
-    E("Null arguments not accepted");
-    PG_RETURN_BOOL(false);
+  SPI_finish();
+
+  /* The workers */
+  if(njobs > 0){
+    nworkers = Min(nworkers, njobs);
+    handles = (BackgroundWorkerHandle**)palloc0(nworkers * sizeof(BackgroundWorkerHandle*));
+    nstarted = sqlite_fs_build_workers_start(seg, nworkers, handles);
+
+    if(nstarted == 0){
+      N("No build worker available: building in this backend");
+      for(i = 0; i < njobs; i++){
+	sqlite_fs_build_job *job = &shared->jobs[i];
+	instr_time start, end;
+
+	INSTR_TIME_SET_CURRENT(start);
+	job->ok = sqlite_fs_build_file(SQLITE_FS_BUILD_STRING(shared, job->path),
+				       SQLITE_FS_BUILD_STRING(shared, job->entries),
+				       SQLITE_FS_BUILD_STRING(shared, job->files));
+	INSTR_TIME_SET_CURRENT(end);
+	INSTR_TIME_SUBTRACT(end, start);
+	job->ms = INSTR_TIME_GET_MILLISEC(end);
+	pg_atomic_write_u32(&job->done, 1);
+      }
+    } else {
+      PG_TRY();
+      {
+	sqlite_fs_build_workers_wait(shared, handles, nstarted);
+      }
+      PG_CATCH();
+      {
+	/* cancelled: stop the workers */
+	for(i = 0; i < nstarted; i++)
+	  TerminateBackgroundWorker(handles[i]);
+	PG_RE_THROW();
+      }
+      PG_END_TRY();
+    }
   }
 
-  db_path = convert_and_check_path(PG_GETARG_TEXT_PP(0)); // allocated in the function context: will be cleaned by PG
+  /* The results */
+  for(i = 0; i < njobs; i++){
+    sqlite_fs_build_job *job = &shared->jobs[i];
+    Datum values[3];
+    bool nulls[3] = { false, false, false };
+
+    values[0] = CStringGetTextDatum(SQLITE_FS_BUILD_STRING(shared, job->path));
+    if(pg_atomic_read_u32(&job->done)){
+      values[1] = BoolGetDatum(job->ok);
+      values[2] = Float8GetDatum(job->ms);
+    } else {
+      nulls[1] = nulls[2] = true; /* not run: the workers stopped */
+    }
+    tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+  }
 
-  sql = text_to_cstring(PG_GETARG_TEXT_PP(1));
+  dsm_detach(seg);
+  return (Datum) 0;
+}
 
-  if(!sql){ E("Allocation failed"); PG_RETURN_BOOL(false); }
 
-  rc = sqlite3_open(db_path, &db); // SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE
+/*-------------------------------------------------------------------------
+ *
+ * Foreign data wrapper
+ *
+ * The tables of a database (entries, files, extended_attributes) as foreign tables:
+ *   CREATE SERVER fs FOREIGN DATA WRAPPER sqlite_fs OPTIONS (database '/location/db.sqlite');
+ *   IMPORT FOREIGN SCHEMA main FROM SERVER fs INTO some_schema;
+ * The database option can be set on the table instead, and the table option
+ * names the SQLite table (the foreign table name by default).
+ *
+ * The comparisons of a column with a constant or a parameter are pushed down
+ * (integers, and the equality of texts), so they use the SQLite indexes,
+ * as is the LIMIT of a single table query, when all its conditions are.
+ * Only the columns in use are read.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+/* Conversion of a SQLite value into a PostgreSQL type */
+typedef struct sqlite_fs_column {
+  Oid      typid;
+  int32    typmod;
+  Oid      ioparam;
+  FmgrInfo input; /* for the types not converted directly */
+} sqlite_fs_column;
 
-  if( rc ) {
-    N("Can't open database %s: %s", db_path, sqlite3_errmsg(db));
-    rc = 1;
-    goto bailout;
-  }
+static void
+sqlite_fs_column_init(sqlite_fs_column *column, Oid typid, int32 typmod)
+{
+  Oid input;
 
-  N("Database open: %s", db_path);
+  column->typid = typid;
+  column->typmod = typmod;
+  getTypeInputInfo(typid, &input, &column->ioparam);
+  fmgr_info(input, &column->input);
+}
 
-  /* Execute SQL statement */
-  rc = sqlite3_exec(db, sql, NULL, NULL, &err);
-   
-  if( rc != SQLITE_OK ){
-    N("SQL error in %s: %s", db_path, err);
-    rc = 2;
-    goto bailout;
+static Datum
+sqlite_fs_column_datum(sqlite3_stmt *stmt, int i, sqlite_fs_column *column, bool *isnull)
+{
+  int type = sqlite3_column_type(stmt, i);
+  const char *value;
+
+  *isnull = (type == SQLITE_NULL);
+  if(*isnull)
+    return (Datum) 0;
+
+  if(type == SQLITE_INTEGER){
+    int64 v = sqlite3_column_int64(stmt, i);
+    switch(column->typid){
+    case INT8OID:
+      return Int64GetDatum(v);
+    case INT4OID:
+      if(v < PG_INT32_MIN || v > PG_INT32_MAX)
+	ereport(ERROR, (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+			errmsg("value " INT64_FORMAT " of column %s is out of range for type integer",
+			       v, sqlite3_column_name(stmt, i))));
+      return Int32GetDatum((int32)v);
+    case INT2OID:
+      if(v < PG_INT16_MIN || v > PG_INT16_MAX)
+	ereport(ERROR, (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+			errmsg("value " INT64_FORMAT " of column %s is out of range for type smallint",
+			       v, sqlite3_column_name(stmt, i))));
+      return Int16GetDatum((int16)v);
+    case BOOLOID:
+      return BoolGetDatum(v != 0);
+    case FLOAT8OID:
+      return Float8GetDatum((float8)v);
+    }
+  } else if(type == SQLITE_FLOAT && column->typid == FLOAT8OID)
+    return Float8GetDatum(sqlite3_column_double(stmt, i));
+
+  if(column->typid == BYTEAOID){
+    const void *blob = sqlite3_column_blob(stmt, i); // first, then the size
+    int len = sqlite3_column_bytes(stmt, i);
+    bytea *b = (bytea*)palloc(len + VARHDRSZ);
+
+    SET_VARSIZE(b, len + VARHDRSZ);
+    if(len) memcpy(VARDATA(b), blob, len);
+    return PointerGetDatum(b);
   }
 
-  N("SQL statement executed successfully: %s", sql);
-  rc = 0; // success
-  
-bailout:
-  if(err) sqlite3_free(err);
-  sqlite3_close(db);
-  PG_RETURN_BOOL(((rc)?false:true));
+  /* the others from the text */
+  value = (const char*)sqlite3_column_text(stmt, i);
+  if(column->typid == TEXTOID || column->typid == VARCHAROID)
+    return PointerGetDatum(cstring_to_text_with_len(value, sqlite3_column_bytes(stmt, i)));
+
+  return InputFunctionCall(&column->input, (char*)value, column->ioparam, column->typmod);
+}
+
+/* Appends a quoted SQLite identifier */
+static void
+sqlite_fs_quote_ident(StringInfo buf, const char *name)
+{
+  const char *p;
+
+  appendStringInfoChar(buf, '"');
+  for(p = name; *p; p++){
+    if(*p == '"')
+      appendStringInfoChar(buf, '"');
+    appendStringInfoChar(buf, *p);
+  }
+  appendStringInfoChar(buf, '"');
 }
 
+/* Planning state, in baserel->fdw_private */
+typedef struct sqlite_fs_fdw_plan {
+  char          *db_path;
+  char          *table;
+  List          *remote_conds; /* RestrictInfos pushed down */
+  List          *local_conds;  /* the others */
+  List          *params;       /* the values compared, as ?1, ?2, etc */
+  StringInfoData where;
+  int64          limit;        /* 0 if none */
+} sqlite_fs_fdw_plan;
+
+/* Execution state */
+typedef struct sqlite_fs_fdw_scan {
+  sqlite_fs_conn   *conn;
+  sqlite3_stmt     *stmt;
+  List             *retrieved; /* attribute numbers of the columns of the query */
+  sqlite_fs_column *columns;
+  List             *params;    /* ExprStates */
+  Oid              *param_types;
+  bool              bound;     /* params bound, since the (re)start */
+} sqlite_fs_fdw_scan;
+
+static void
+sqlite_fs_fdw_options(Oid relid, char **db_path, char **table)
+{
+  ForeignTable *ft = GetForeignTable(relid);
+  ForeignServer *server = GetForeignServer(ft->serverid);
+  List *options = list_concat(list_copy(server->options), ft->options); // the table's win
+  char *database = NULL;
+  ListCell *lc;
+
+  *table = get_rel_name(relid);
+  foreach(lc, options){
+    DefElem *def = (DefElem *) lfirst(lc);
+    if(strcmp(def->defname, "database") == 0)
+      database = defGetString(def);
+    else if(strcmp(def->defname, "table") == 0)
+      *table = defGetString(def);
+  }
 
+  if(database == NULL)
+    E("The foreign table %s needs the database option, on the table or its server", get_rel_name(relid));
 
-/*-------------------------------------------------------------------------
- *
- * Open from file descriptor:
- * - https://www.sqlite.org/forum/draft2/info/c15bf2e7df289a5f41c7402b2e4f7323385e38e2a001a1fea42ccc8071a8c2d8
- *
- *-------------------------------------------------------------------------
+  *db_path = convert_and_check_path(cstring_to_text(database));
+}
+
+/*
+ * Whether the clause is <column> <op> <constant or parameter>, to push down.
+ * If so, appends it to the WHERE clause, and the value to the params.
  */
+static bool
+sqlite_fs_fdw_pushable(RelOptInfo *baserel, Oid relid, Expr *clause, sqlite_fs_fdw_plan *plan)
+{
+  OpExpr *op;
+  Node *left, *right, *value;
+  Var *var;
+  const char *opname;
+  Oid vartype, valuetype;
+  bool integers;
+
+  if(!IsA(clause, OpExpr))
+    return false;
+  op = (OpExpr *) clause;
+  if(list_length(op->args) != 2 || op->opno >= FirstGenbkiObjectId) /* built-in operators only */
+    return false;
 
-#define SQLITE_FS_CHECK_TYPE(p, t, n) if(TupleDescAttr(SPI_tuptable->tupdesc, (p))->atttypid != (t)){ W("SPI_execute: invalid type %d: %s", (p), (n)); rc = 4; goto bailout_spi; }
+  left = (Node *) linitial(op->args);
+  right = (Node *) lsecond(op->args);
+  if(IsA(left, RelabelType)) left = (Node *) ((RelabelType *) left)->arg;
+  if(IsA(right, RelabelType)) right = (Node *) ((RelabelType *) right)->arg;
 
-PG_FUNCTION_INFO_V1(pg_sqlite_fs_insert_files);
-Datum
-pg_sqlite_fs_insert_files(PG_FUNCTION_ARGS)
-{
+  opname = get_opname(op->opno);
+  if(opname == NULL)
+    return false;
 
-  int rc = 1;
-  char* db_path;
-  sqlite3 *db;
-  sqlite3_stmt *stmt = NULL;
-  char *sql = NULL;
-  int i;
+  if(IsA(left, Var)){
+    var = (Var *) left;
+    value = right;
+  } else if(IsA(right, Var)){
+    var = (Var *) right;
+    value = left;
+    /* commute */
+    if(strcmp(opname, "<") == 0) opname = ">";
+    else if(strcmp(opname, ">") == 0) opname = "<";
+    else if(strcmp(opname, "<=") == 0) opname = ">=";
+    else if(strcmp(opname, ">=") == 0) opname = "<=";
+  } else
+    return false;
 
-  if(PG_NARGS() != 2){
-    E("Invalid number of arguments: expected 2, got %d", PG_NARGS());
-    PG_RETURN_BOOL(false);
-  }
+  if(var->varno != baserel->relid || var->varlevelsup != 0 || var->varattno <= 0)
+    return false;
 
-  if(PG_ARGISNULL(0) || PG_ARGISNULL(1)){
-    E("Null arguments not accepted");
-    PG_RETURN_BOOL(false);
-  }
+  if(!(IsA(value, Param) || (IsA(value, Const) && !((Const *) value)->constisnull)))
+    return false;
 
-  db_path = convert_and_check_path(PG_GETARG_TEXT_PP(0)); // allocated in the function context: will be cleaned by PG
+  vartype = var->vartype;
+  valuetype = exprType(value);
+  integers = ((vartype == INT8OID || vartype == INT4OID || vartype == INT2OID) &&
+	      (valuetype == INT8OID || valuetype == INT4OID || valuetype == INT2OID));
+
+  if(integers){
+    if(strcmp(opname, "=") && strcmp(opname, "<>") && strcmp(opname, "<") &&
+       strcmp(opname, "<=") && strcmp(opname, ">") && strcmp(opname, ">="))
+      return false;
+  } else if(vartype == TEXTOID && valuetype == TEXTOID){
+    /* SQLite compares the bytes: the same equality as a deterministic collation */
+    if(strcmp(opname, "=") && strcmp(opname, "<>"))
+      return false;
+    if(!OidIsValid(op->inputcollid) || !get_collation_isdeterministic(op->inputcollid))
+      return false;
+  } else
+    return false;
 
-  rc = sqlite3_open(db_path, &db); // SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE
+  plan->params = lappend(plan->params, value);
+  appendStringInfoString(&plan->where, (plan->where.len) ? " AND " : " WHERE ");
+  sqlite_fs_quote_ident(&plan->where, get_attname(relid, var->varattno, false));
+  appendStringInfo(&plan->where, " %s ?%d", opname, list_length(plan->params));
+  return true;
+}
 
-  if( rc ) {
-    N("Can't open database %s: %s", db_path, sqlite3_errmsg(db));
-    PG_RETURN_BOOL(false);
-  }
+/* Cheap estimate of the number of rows: the largest rowid */
+static double
+sqlite_fs_fdw_tuples(sqlite_fs_fdw_plan *plan)
+{
+  sqlite_fs_conn *conn;
+  sqlite3_stmt *stmt = NULL;
+  StringInfoData sql;
+  double tuples = 1000; /* WITHOUT ROWID tables */
 
-  D2("Database open: %s", db_path);
+  conn = sqlite_fs_conn_open(plan->db_path, SQLITE_OPEN_READWRITE);
+  if(conn == NULL)
+    E("SQL error opening database: %s", plan->db_path);
 
-  /* Start SQLite transaction */
-  rc = sqlite3_exec(db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
-  if( rc != SQLITE_OK ) {
-    N("Error starting transaction: %s", sqlite3_errmsg(db));
-    rc = 1;
-    goto close_sqlite_db;
-  }
+  initStringInfo(&sql);
+  appendStringInfoString(&sql, "SELECT max(rowid) FROM ");
+  sqlite_fs_quote_ident(&sql, plan->table);
 
-  /* SQL prepared statement */
-  rc = sqlite3_prepare_v2(db,
-			  "INSERT INTO files(inode,mountpoint,rel_path,header,payload_size,prepend,append)"
-			  " VALUES(?,?,?,?,?,?,?)"
-			  " ON CONFLICT(inode) DO UPDATE SET mountpoint=excluded.mountpoint,"
-			  "                                  rel_path=excluded.rel_path,"
-			  "                                  header=excluded.header,"
-			  "                                  payload_size=excluded.payload_size,"
-			  "                                  prepend=excluded.prepend,"
-			  "                                  append=excluded.append;",
-			  -1, &stmt, NULL);
-  if( rc != SQLITE_OK ) {
-    N("Error preparing statement: %s", sqlite3_errmsg(db));
-    rc = 1;
-    goto close_sqlite_stmt;
-  }
+  if(sqlite3_prepare_v2(conn->db, sql.data, -1, &stmt, NULL) == SQLITE_OK &&
+     sqlite3_step(stmt) == SQLITE_ROW)
+    tuples = (double) sqlite3_column_int64(stmt, 0);
+  sqlite3_finalize(stmt);
+  sqlite_fs_conn_release(conn);
 
-  /* Connect */
-  rc = SPI_connect();
-  if (rc != SPI_OK_CONNECT){
-    W("SPI_connect failed: error code %d", rc);
-    goto close_sqlite_stmt;
-  }
+  D3("%s in %s: about %.0f rows", plan->table, plan->db_path, tuples);
+  return tuples;
+}
 
-  /* Execute the query */
-  sql = text_to_cstring(PG_GETARG_TEXT_PP(1)); /* clean on exiting the function */
-  if(!sql){ // no mem
-    rc = 1;
-    goto bailout_spi;
-  }
-  pgstat_report_activity(STATE_RUNNING, sql); 
+static void
+sqlite_fs_fdw_rel_size(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid)
+{
+  sqlite_fs_fdw_plan *plan = (sqlite_fs_fdw_plan*)palloc0(sizeof(sqlite_fs_fdw_plan));
+  ListCell *lc;
+  double rows;
 
-  /* We can now execute queries via SPI */
-  rc = SPI_execute(sql, true /* read_only */, 0 /* count */);
+  baserel->fdw_private = plan;
+  sqlite_fs_fdw_options(foreigntableid, &plan->db_path, &plan->table);
+  initStringInfo(&plan->where);
 
-  if (rc != SPI_OK_SELECT){
-    W("SPI_execute failed: error code %d", rc);
-    rc = 2;
-    goto bailout_spi;
-  }
+  foreach(lc, baserel->baserestrictinfo){
+    RestrictInfo *rinfo = lfirst_node(RestrictInfo, lc);
 
-  /* Check the SQL statement to be executed */ 
-  if(SPI_tuptable->tupdesc->natts != 4){
-    W("SPI_execute returns %d fields. Expecting 4", SPI_tuptable->tupdesc->natts);
-    rc = 3;
-    goto bailout_spi;
+    if(sqlite_fs_fdw_pushable(baserel, foreigntableid, rinfo->clause, plan))
+      plan->remote_conds = lappend(plan->remote_conds, rinfo);
+    else
+      plan->local_conds = lappend(plan->local_conds, rinfo);
   }
 
-  SQLITE_FS_CHECK_TYPE(0, INT8OID, "inode");
-  SQLITE_FS_CHECK_TYPE(1, TEXTOID, "mountpoint");
-  SQLITE_FS_CHECK_TYPE(2, TEXTOID, "rel_path");
-  SQLITE_FS_CHECK_TYPE(3, BYTEAOID, "header");
-  SQLITE_FS_CHECK_TYPE(4, INT8OID, "payload_size");
-  SQLITE_FS_CHECK_TYPE(5, BYTEAOID, "prepend");
-  SQLITE_FS_CHECK_TYPE(6, BYTEAOID, "append");
-
+  baserel->tuples = sqlite_fs_fdw_tuples(plan);
+  rows = baserel->tuples * clauselist_selectivity(root, baserel->baserestrictinfo, baserel->relid, JOIN_INNER, NULL);
 
-  for(i=0 ; i < SPI_processed; i++){
+  /* The LIMIT goes down when nothing filters, sorts or combines the rows above the scan */
+  if(plan->local_conds == NIL && root->limit_tuples > 0 && root->parse->sortClause == NIL &&
+     bms_membership(root->all_baserels) == BMS_SINGLETON){
+    plan->limit = (int64) root->limit_tuples;
+    rows = Min(rows, root->limit_tuples);
+  }
 
-    bytea *header;
-    bytea *prepend;
-    bytea *append;
-    text *path;
-    text *mountpoint;
-    int64 inode, payload_size;
-    bool isnull, header_isnull, prepend_isnull, append_isnull;
+  baserel->rows = clamp_row_est(rows);
+}
 
-    rc = 1;
+static void
+sqlite_fs_fdw_paths(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid)
+{
+  sqlite_fs_fdw_plan *plan = (sqlite_fs_fdw_plan*)baserel->fdw_private;
+  Cost startup_cost = 10;
+  Cost total_cost;
+  double scanned = (plan->remote_conds) ? baserel->rows : baserel->tuples; // the index, or a full scan
 
-    inode = DatumGetUInt64(SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1, &isnull));
-    if (isnull){
-      W("the inode field can't be NULL");
-      goto bailout_spi;
-    }
+  total_cost = startup_cost + scanned * cpu_operator_cost + baserel->rows * cpu_tuple_cost;
 
-    mountpoint = DatumGetTextPP(SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 2, &isnull));
-    if (isnull){
-      W("The mountpoint field can't be NULL");
-      goto bailout_spi;
-    }
+  add_path(baserel, (Path *) create_foreignscan_path(root, baserel, NULL, baserel->rows,
+						     startup_cost, total_cost,
+						     NIL, NULL, NULL, NIL));
+}
 
-    path = DatumGetTextPP(SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 3, &isnull));
-    if (isnull){
-      W("The path field can't be NULL");
-      goto bailout_spi;
-    }
+static ForeignScan *
+sqlite_fs_fdw_plan_scan(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid,
+			ForeignPath *best_path, List *tlist, List *scan_clauses, Plan *outer_plan)
+{
+  sqlite_fs_fdw_plan *plan = (sqlite_fs_fdw_plan*)baserel->fdw_private;
+  List *local_exprs = NIL;
+  List *retrieved = NIL;
+  Bitmapset *attrs_used = NULL;
+  bool whole_row;
+  StringInfoData sql;
+  Relation rel;
+  TupleDesc tupdesc;
+  ListCell *lc;
+  int i;
 
-    header = DatumGetByteaP(SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 4, &header_isnull));
-    payload_size = DatumGetUInt64(SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 5, &isnull));
-    if (isnull) payload_size = 0;
-    prepend = DatumGetByteaP(SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 6, &prepend_isnull));
-    append = DatumGetByteaP(SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 7, &append_isnull));
-
-    /* Bind arguments */
-    D2("Binding arguments for inserting file");
-    rc = (sqlite3_bind_int64(stmt, 1, inode) ||
-	  sqlite3_bind_text(stmt, 2, VARDATA_ANY(mountpoint), (int)VARSIZE_ANY_EXHDR(mountpoint), SQLITE_STATIC) || // we handle destruction
-	  sqlite3_bind_text(stmt, 3, VARDATA_ANY(path)      , (int)VARSIZE_ANY_EXHDR(path)      , SQLITE_STATIC) || // we handle destruction
-	  ( (header_isnull) ? sqlite3_bind_null(stmt, 4)
-	                    : sqlite3_bind_blob(stmt, 4, VARDATA_ANY(header), (int)VARSIZE_ANY_EXHDR(header), SQLITE_STATIC) ) ||
-	  sqlite3_bind_int64(stmt, 5, payload_size) ||
-	  ( (prepend_isnull) ? sqlite3_bind_null(stmt, 6)
-	                     : sqlite3_bind_blob(stmt, 6, VARDATA_ANY(prepend), (int)VARSIZE_ANY_EXHDR(prepend), SQLITE_STATIC) ) ||
-	  ( (append_isnull) ? sqlite3_bind_null(stmt, 7)
-	                    : sqlite3_bind_blob(stmt, 7, VARDATA_ANY(append), (int)VARSIZE_ANY_EXHDR(append), SQLITE_STATIC) )
-	  );
-    if( rc != SQLITE_OK ){
-      N("SQL error binding arguments: %s", sqlite3_errmsg(db));
-      rc = 6;
-      goto bailout_spi;
-    }
+  foreach(lc, scan_clauses){
+    RestrictInfo *rinfo = lfirst_node(RestrictInfo, lc);
 
-    /* Execute SQL prepared statement */
-    D2("Execute statement for insert file");
-    rc = sqlite3_step(stmt);
-    if( rc != SQLITE_DONE ){
-      N("SQL error inserting the file: %s | error: %d", sqlite3_errmsg(db), rc);
-      rc = 3;
-      goto bailout_spi;
-    }
+    if(rinfo->pseudoconstant || list_member_ptr(plan->remote_conds, rinfo))
+      continue;
+    local_exprs = lappend(local_exprs, rinfo->clause);
+  }
 
-    sqlite3_reset(stmt);
-    rc = 0;
+  /* Projection: the columns of the target list and of the local conditions */
+  pull_varattnos((Node *) baserel->reltarget->exprs, baserel->relid, &attrs_used);
+  pull_varattnos((Node *) local_exprs, baserel->relid, &attrs_used);
+  whole_row = bms_is_member(0 - FirstLowInvalidHeapAttributeNumber, attrs_used);
+
+  initStringInfo(&sql);
+  appendStringInfoString(&sql, "SELECT ");
+
+  rel = table_open(foreigntableid, NoLock);
+  tupdesc = RelationGetDescr(rel);
+  for(i = 1; i <= tupdesc->natts; i++){
+    Form_pg_attribute att = TupleDescAttr(tupdesc, i - 1);
+
+    if(att->attisdropped)
+      continue;
+    if(!whole_row && !bms_is_member(i - FirstLowInvalidHeapAttributeNumber, attrs_used))
+      continue;
+    if(retrieved)
+      appendStringInfoString(&sql, ", ");
+    sqlite_fs_quote_ident(&sql, NameStr(att->attname));
+    retrieved = lappend_int(retrieved, i);
   }
+  table_close(rel, NoLock);
 
-bailout_spi:
+  if(retrieved == NIL)
+    appendStringInfoString(&sql, "NULL"); // eg count(*)
 
-  /* finish the SQL statement */
-  SPI_finish();
-  debug_query_string = NULL;
-  pgstat_report_stat(true);
-  pgstat_report_activity(STATE_IDLE, NULL);
+  appendStringInfoString(&sql, " FROM ");
+  sqlite_fs_quote_ident(&sql, plan->table);
+  appendStringInfoString(&sql, plan->where.data);
+  if(plan->limit > 0)
+    appendStringInfo(&sql, " LIMIT " INT64_FORMAT, plan->limit);
+
+  D2("Foreign scan of %s: %s", plan->db_path, sql.data);
 
+  return make_foreignscan(tlist, local_exprs, baserel->relid, plan->params,
+			  list_make3(makeString(plan->db_path), makeString(sql.data), retrieved),
+			  NIL, NIL, outer_plan);
+}
 
-close_sqlite_stmt:
+static void
+sqlite_fs_fdw_begin(ForeignScanState *node, int eflags)
+{
+  ForeignScan *fsplan = (ForeignScan *) node->ss.ps.plan;
+  sqlite_fs_fdw_scan *scan = (sqlite_fs_fdw_scan*)palloc0(sizeof(sqlite_fs_fdw_scan));
+  char *db_path = strVal(linitial(fsplan->fdw_private));
+  char *sql = strVal(lsecond(fsplan->fdw_private));
+  TupleDesc tupdesc = RelationGetDescr(node->ss.ss_currentRelation);
+  ListCell *lc;
+  int i;
 
-  if(stmt) sqlite3_finalize(stmt);
+  node->fdw_state = scan;
+  if(eflags & EXEC_FLAG_EXPLAIN_ONLY)
+    return;
 
-  /* Close the transaction */
-  rc = sqlite3_exec(db, (rc)?"ROLLBACK;":"COMMIT;", NULL, NULL, NULL);
-  if( rc != SQLITE_OK ) {
-    N("Error closing transaction: %s", sqlite3_errmsg(db));
-    rc = 1;
-  } else
-    rc = 0; // success
-  
-close_sqlite_db:
-  sqlite3_close(db);
+  scan->retrieved = (List *) lthird(fsplan->fdw_private);
+  scan->columns = (sqlite_fs_column*)palloc(Max(list_length(scan->retrieved), 1) * sizeof(sqlite_fs_column));
+  i = 0;
+  foreach(lc, scan->retrieved){
+    Form_pg_attribute att = TupleDescAttr(tupdesc, lfirst_int(lc) - 1);
+    sqlite_fs_column_init(&scan->columns[i++], att->atttypid, att->atttypmod);
+  }
 
-  PG_RETURN_BOOL(((rc)?false:true));
+  scan->params = ExecInitExprList(fsplan->fdw_exprs, (PlanState *) node);
+  scan->param_types = (Oid*)palloc(Max(list_length(fsplan->fdw_exprs), 1) * sizeof(Oid));
+  i = 0;
+  foreach(lc, fsplan->fdw_exprs)
+    scan->param_types[i++] = exprType((Node *) lfirst(lc));
+
+  scan->conn = sqlite_fs_conn_open(db_path, SQLITE_OPEN_READWRITE);
+  if(scan->conn == NULL)
+    E("SQL error opening database: %s", db_path);
+
+  /* private: the query is the scan's own */
+  if(sqlite3_prepare_v2(scan->conn->db, sql, -1, &scan->stmt, NULL) != SQLITE_OK){
+    char *err = pstrdup(sqlite3_errmsg(scan->conn->db));
+    sqlite_fs_conn_release(scan->conn);
+    scan->conn = NULL;
+    E("SQL error preparing %s in %s: %s", sql, db_path, err);
+  }
 }
 
+static void
+sqlite_fs_fdw_bind(ForeignScanState *node, sqlite_fs_fdw_scan *scan)
+{
+  ExprContext *econtext = node->ss.ps.ps_ExprContext;
+  ListCell *lc;
+  int i = 0;
+  int rc;
+
+  foreach(lc, scan->params){
+    ExprState *expr = (ExprState *) lfirst(lc);
+    bool isnull;
+    Datum value = ExecEvalExpr(expr, econtext, &isnull);
+
+    i++;
+    if(isnull)
+      rc = sqlite3_bind_null(scan->stmt, i);
+    else switch(scan->param_types[i - 1]){
+      case INT8OID: rc = sqlite3_bind_int64(scan->stmt, i, DatumGetInt64(value)); break;
+      case INT4OID: rc = sqlite3_bind_int64(scan->stmt, i, DatumGetInt32(value)); break;
+      case INT2OID: rc = sqlite3_bind_int64(scan->stmt, i, DatumGetInt16(value)); break;
+      default: /* text */
+	{
+	  text *t = DatumGetTextPP(value);
+	  rc = sqlite3_bind_text(scan->stmt, i, VARDATA_ANY(t), (int)VARSIZE_ANY_EXHDR(t), SQLITE_TRANSIENT);
+	}
+      }
+    if(rc != SQLITE_OK)
+      E("SQL error binding arguments: %s", sqlite3_errmsg(scan->conn->db));
+  }
+  scan->bound = true;
+}
 
+static TupleTableSlot *
+sqlite_fs_fdw_iterate(ForeignScanState *node)
+{
+  sqlite_fs_fdw_scan *scan = (sqlite_fs_fdw_scan*)node->fdw_state;
+  TupleTableSlot *slot = node->ss.ss_ScanTupleSlot;
+  ListCell *lc;
+  int i = 0;
+  int rc;
+
+  if(!scan->bound)
+    sqlite_fs_fdw_bind(node, scan);
+
+  ExecClearTuple(slot);
+
+  rc = sqlite3_step(scan->stmt);
+  if(rc == SQLITE_DONE)
+    return slot;
+  if(rc != SQLITE_ROW)
+    E("SQL error reading %s: %s", scan->conn->path, sqlite3_errmsg(scan->conn->db));
+
+  /* in the per-tuple memory context */
+  memset(slot->tts_isnull, true, slot->tts_tupleDescriptor->natts * sizeof(bool));
+  foreach(lc, scan->retrieved){
+    int attnum = lfirst_int(lc) - 1;
+    slot->tts_values[attnum] = sqlite_fs_column_datum(scan->stmt, i, &scan->columns[i], &slot->tts_isnull[attnum]);
+    i++;
+  }
+  return ExecStoreVirtualTuple(slot);
+}
 
-PG_FUNCTION_INFO_V1(pg_sqlite_fs_insert_entries);
-Datum
-pg_sqlite_fs_insert_entries(PG_FUNCTION_ARGS)
+static void
+sqlite_fs_fdw_rescan(ForeignScanState *node)
 {
+  sqlite_fs_fdw_scan *scan = (sqlite_fs_fdw_scan*)node->fdw_state;
 
-  int rc = 1;
-  char* db_path;
-  sqlite3 *db;
-  sqlite3_stmt *stmt = NULL;
-  char *sql = NULL;
-  int i;
-  bool isnull;
+  if(scan->stmt)
+    sqlite3_reset(scan->stmt);
+  scan->bound = false; // the params may have changed
+}
 
-  if(PG_NARGS() != 2){
-    E("Invalid number of arguments: expected 2, got %d", PG_NARGS());
-    PG_RETURN_BOOL(false);
-  }
+static void
+sqlite_fs_fdw_end(ForeignScanState *node)
+{
+  sqlite_fs_fdw_scan *scan = (sqlite_fs_fdw_scan*)node->fdw_state;
 
-  if(PG_ARGISNULL(0) || PG_ARGISNULL(1)){
-    E("Null arguments not accepted");
-    PG_RETURN_BOOL(false);
+  if(scan == NULL)
+    return;
+  if(scan->stmt){
+    sqlite3_finalize(scan->stmt);
+    scan->stmt = NULL;
   }
+  if(scan->conn){
+    sqlite_fs_conn_release(scan->conn);
+    scan->conn = NULL;
+  }
+}
 
-  db_path = convert_and_check_path(PG_GETARG_TEXT_PP(0)); // allocated in the function context: will be cleaned by PG
-
-  rc = sqlite3_open(db_path, &db); // SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE
+static void
+sqlite_fs_fdw_explain(ForeignScanState *node, ExplainState *es)
+{
+  ForeignScan *fsplan = (ForeignScan *) node->ss.ps.plan;
 
-  if( rc ) {
-    N("Can't open database %s: %s", db_path, sqlite3_errmsg(db));
-    PG_RETURN_BOOL(false);
+  if(es->verbose){
+    ExplainPropertyText("SQLite database", strVal(linitial(fsplan->fdw_private)), es);
+    ExplainPropertyText("SQLite query", strVal(lsecond(fsplan->fdw_private)), es);
   }
+}
 
-  D2("Database open: %s", db_path);
+/* The tables of the schema, with the types used by insert_entries() and insert_files() */
+static const struct {
+  const char *name;
+  const char *columns;
+} sqlite_fs_fdw_tables[] = {
+  { "entries", "inode bigint NOT NULL, name text NOT NULL, parent_inode bigint NOT NULL, "
+               "ctime bigint, mtime bigint, nlink int, size bigint, is_dir boolean" },
+  { "files", "inode bigint NOT NULL, mountpoint text, rel_path text, header bytea, "
+             "payload_size bigint, prepend bytea, append bytea" },
+  { "extended_attributes", "inode bigint NOT NULL, name text NOT NULL, value text NOT NULL" },
+  { NULL, NULL }
+};
+
+/* IMPORT FOREIGN SCHEMA <any name, eg main> FROM SERVER ... INTO ... [OPTIONS (database '...')] */
+static List *
+sqlite_fs_fdw_import(ImportForeignSchemaStmt *stmt, Oid serverOid)
+{
+  ForeignServer *server = GetForeignServer(serverOid);
+  List *commands = NIL;
+  char *database = NULL;
+  ListCell *lc;
+  int i;
 
-  /* Start SQLite transaction */
-  rc = sqlite3_exec(db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
-  if( rc != SQLITE_OK ) {
-    N("Error starting transaction: %s", sqlite3_errmsg(db));
-    rc = 1;
-    goto close_sqlite_db;
+  foreach(lc, stmt->options){
+    DefElem *def = (DefElem *) lfirst(lc);
+    if(strcmp(def->defname, "database") == 0)
+      database = convert_and_check_path(cstring_to_text(defGetString(def)));
+    else
+      ereport(ERROR,
+	      (errcode(ERRCODE_FDW_INVALID_OPTION_NAME),
+	       errmsg("invalid option \"%s\"", def->defname),
+	       errhint("Valid option: database")));
   }
 
-  /* SQL prepared statement */
-  rc = sqlite3_prepare_v2(db,
-			  "INSERT INTO entries(inode,name,parent_inode,ctime,mtime,nlink,size,is_dir)"
-			  "VALUES(?,?,?,?,?,?,?,?)"
-			  //" ON CONFLICT(inode) DO NOTHING;",
-			  " ON CONFLICT(inode) DO UPDATE SET "
-			  "name=excluded.name,"
-			  "parent_inode=excluded.parent_inode,"
-			  "ctime=excluded.ctime,"
-			  "mtime=excluded.mtime,"
-			  "nlink=excluded.nlink,"
-			  "size=excluded.size,"
-			  "is_dir=excluded.is_dir;",
-			  -1, &stmt, NULL);
-  if( rc != SQLITE_OK ) {
-    N("Error preparing statement: %s", sqlite3_errmsg(db));
-    rc = 1;
-    goto close_sqlite_stmt;
+  if(database == NULL){
+    foreach(lc, server->options){
+      if(strcmp(((DefElem *) lfirst(lc))->defname, "database") == 0)
+	break;
+    }
+    if(lc == NULL)
+      E("IMPORT FOREIGN SCHEMA needs the database option, on the server %s or in the statement", server->servername);
   }
 
-  /* Connect */
-  rc = SPI_connect();
-  if (rc != SPI_OK_CONNECT){
-    W("SPI_connect failed: error code %d", rc);
-    goto close_sqlite_stmt;
-  }
+  for(i = 0; sqlite_fs_fdw_tables[i].name; i++){
+    const char *name = sqlite_fs_fdw_tables[i].name;
+    bool listed = false;
+    StringInfoData cmd;
 
-  /* Execute the query */
-  sql = text_to_cstring(PG_GETARG_TEXT_PP(1)); /* clean on exiting the function */
-  if(!sql){ // no mem
-    rc = 1;
-    goto bailout_spi;
+    foreach(lc, stmt->table_list){
+      if(strcmp(((RangeVar *) lfirst(lc))->relname, name) == 0){
+	listed = true;
+	break;
+      }
+    }
+    if((stmt->list_type == FDW_IMPORT_SCHEMA_LIMIT_TO && !listed) ||
+       (stmt->list_type == FDW_IMPORT_SCHEMA_EXCEPT && listed))
+      continue;
+
+    initStringInfo(&cmd);
+    appendStringInfo(&cmd, "CREATE FOREIGN TABLE %s (%s) SERVER %s OPTIONS (table %s",
+		     quote_identifier(name), sqlite_fs_fdw_tables[i].columns,
+		     quote_identifier(server->servername), quote_literal_cstr(name));
+    if(database)
+      appendStringInfo(&cmd, ", database %s", quote_literal_cstr(database));
+    appendStringInfoChar(&cmd, ')');
+    commands = lappend(commands, cmd.data);
   }
-  pgstat_report_activity(STATE_RUNNING, sql); 
+  return commands;
+}
 
-  /* We can now execute queries via SPI */
-  rc = SPI_execute(sql, true /* read_only */, 0 /* count */);
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_fdw_handler);
+Datum
+pg_sqlite_fs_fdw_handler(PG_FUNCTION_ARGS)
+{
+  FdwRoutine *routine = makeNode(FdwRoutine);
+
+  routine->GetForeignRelSize = sqlite_fs_fdw_rel_size;
+  routine->GetForeignPaths = sqlite_fs_fdw_paths;
+  routine->GetForeignPlan = sqlite_fs_fdw_plan_scan;
+  routine->BeginForeignScan = sqlite_fs_fdw_begin;
+  routine->IterateForeignScan = sqlite_fs_fdw_iterate;
+  routine->ReScanForeignScan = sqlite_fs_fdw_rescan;
+  routine->EndForeignScan = sqlite_fs_fdw_end;
+  routine->ExplainForeignScan = sqlite_fs_fdw_explain;
+  routine->ImportForeignSchema = sqlite_fs_fdw_import;
+
+  PG_RETURN_POINTER(routine);
+}
 
-  if (rc != SPI_OK_SELECT){
-    W("SPI_execute failed: error code %d", rc);
-    rc = 2;
-    goto bailout_spi;
-  }
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_fdw_validator);
+Datum
+pg_sqlite_fs_fdw_validator(PG_FUNCTION_ARGS)
+{
+  List *options = untransformRelOptions(PG_GETARG_DATUM(0));
+  Oid catalog = PG_GETARG_OID(1);
+  ListCell *lc;
 
-  /* Check the SQL statement to be executed */ 
-  if(SPI_tuptable->tupdesc->natts != 9){
-    W("SPI_execute returns %d fields. Expecting 9", SPI_tuptable->tupdesc->natts);
-    rc = 3;
-    goto bailout_spi;
+  foreach(lc, options){
+    DefElem *def = (DefElem *) lfirst(lc);
+
+    if(strcmp(def->defname, "database") == 0 &&
+       (catalog == ForeignServerRelationId || catalog == ForeignTableRelationId))
+      continue;
+    if(strcmp(def->defname, "table") == 0 && catalog == ForeignTableRelationId)
+      continue;
+
+    ereport(ERROR,
+	    (errcode(ERRCODE_FDW_INVALID_OPTION_NAME),
+	     errmsg("invalid option \"%s\"", def->defname),
+	     errhint("Valid options: database (server or foreign table), table (foreign table)")));
   }
 
-  SQLITE_FS_CHECK_TYPE(0, INT8OID, "inode");
-  SQLITE_FS_CHECK_TYPE(1, TEXTOID, "name");
-  SQLITE_FS_CHECK_TYPE(2, INT8OID, "parent inode");
-  SQLITE_FS_CHECK_TYPE(3, INT8OID, "created");
-  SQLITE_FS_CHECK_TYPE(4, INT8OID, "modified");
-  SQLITE_FS_CHECK_TYPE(5, INT4OID, "num_links");
-  SQLITE_FS_CHECK_TYPE(6, INT8OID, "filesize");
-  SQLITE_FS_CHECK_TYPE(7, BOOLOID, "is_dir");
+  PG_RETURN_VOID();
+}
 
-  for(i=0 ; i < SPI_processed; i++){
 
-    int64 inode, parent_inode, ctime, mtime, nlink, size;
-    bool is_dir;
-    text *name;
+/*
+ * sqlite_fs_query(path, sql, params...): the rows of a read-only SQLite query,
+ *   SELECT * FROM sqlite_fs_query('/location/db.sqlite',
+ *                                 'SELECT inode, name FROM entries WHERE parent_inode = ?', 1)
+ *     AS t(inode bigint, name text);
+ * The parameters are bound with their native types (integers, floats, booleans,
+ * texts, byteas; the others as text). The values are converted to the types
+ * of the column definition list: directly for the matching SQLite types,
+ * else through the input function of the type.
+ * Value-per-call, as readdir(). With its column definition list, it is called
+ * in FROM, where the function scan stores all the rows first.
+ */
 
-    rc = 1;
+typedef struct sqlite_fs_query_state {
+  sqlite_fs_readdir_state scan; /* with a private statement */
+  sqlite_fs_column       *columns;
+} sqlite_fs_query_state;
 
-    inode = DatumGetUInt64(SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1, &isnull));
-    if (isnull){
-      W("the inode field can't be NULL");
-      goto bailout_spi;
-    }
-    name = DatumGetTextPP(SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 2, &isnull));
-    if (isnull){
-      W("The name field can't be NULL");
-      goto bailout_spi;
-    }
-    parent_inode = DatumGetUInt64(SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 3, &isnull));
-    if (isnull){
-      W("the parent inode field can't be NULL");
-      goto bailout_spi;
-    }
-    ctime = DatumGetUInt64(SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 4, &isnull));
-    if (isnull){
-      W("the ctime field can't be NULL");
-      goto bailout_spi;
-    }
-    mtime = DatumGetUInt64(SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 5, &isnull));
-    if (isnull){
-      W("the mtime field can't be NULL");
-      goto bailout_spi;
-    }
-    nlink = DatumGetUInt32(SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 6, &isnull));
-    if (isnull){
-      W("the nlink field can't be NULL");
-      goto bailout_spi;
-    }
-    size = DatumGetUInt64(SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 7, &isnull));
-    if (isnull){
-      W("the size field can't be NULL");
-      goto bailout_spi;
+static int
+sqlite_fs_bind_datum(sqlite3_stmt *stmt, int i, Oid type, Datum value)
+{
+  switch(type){
+  case INT8OID: return sqlite3_bind_int64(stmt, i, DatumGetInt64(value));
+  case INT4OID: return sqlite3_bind_int64(stmt, i, DatumGetInt32(value));
+  case INT2OID: return sqlite3_bind_int64(stmt, i, DatumGetInt16(value));
+  case BOOLOID: return sqlite3_bind_int(stmt, i, DatumGetBool(value) ? 1 : 0);
+  case FLOAT8OID: return sqlite3_bind_double(stmt, i, DatumGetFloat8(value));
+  case FLOAT4OID: return sqlite3_bind_double(stmt, i, DatumGetFloat4(value));
+  case UNKNOWNOID: /* a literal */
+  case CSTRINGOID:
+    return sqlite3_bind_text(stmt, i, DatumGetCString(value), -1, SQLITE_TRANSIENT);
+  case BYTEAOID:
+    {
+      bytea *b = DatumGetByteaPP(value);
+      return sqlite3_bind_blob(stmt, i, VARDATA_ANY(b), (int)VARSIZE_ANY_EXHDR(b), SQLITE_TRANSIENT);
     }
-    is_dir = DatumGetBool(SPI_getbinval(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 8, &isnull));
-    if (isnull){
-      W("the is_dir field can't be NULL");
-      goto bailout_spi;
+  case TEXTOID:
+  case VARCHAROID:
+    {
+      text *t = DatumGetTextPP(value);
+      return sqlite3_bind_text(stmt, i, VARDATA_ANY(t), (int)VARSIZE_ANY_EXHDR(t), SQLITE_TRANSIENT);
     }
+  default:
+    {
+      Oid output;
+      bool varlena;
 
-    /* Bind arguments */
-    D2("Binding arguments for inserting file");
-    rc = (sqlite3_bind_int64(stmt, 1, inode) ||
-	  sqlite3_bind_text( stmt, 2, VARDATA_ANY(name), (int)VARSIZE_ANY_EXHDR(name), SQLITE_STATIC) || // we handle destruction
-	  sqlite3_bind_int64(stmt, 3, parent_inode) ||
-	  sqlite3_bind_int64(stmt, 4, ctime) ||
-	  sqlite3_bind_int64(stmt, 5, mtime) ||
-	  sqlite3_bind_int(  stmt, 6, nlink) ||
-	  sqlite3_bind_int64(stmt, 7, size) ||
-	  sqlite3_bind_int(  stmt, 8, (is_dir)?1:0)
-	  );
-    if( rc != SQLITE_OK ){
-      N("SQL error binding arguments: %s", sqlite3_errmsg(db));
-      rc = 6;
-      goto bailout_spi;
+      getTypeOutputInfo(type, &output, &varlena);
+      return sqlite3_bind_text(stmt, i, OidOutputFunctionCall(output, value), -1, SQLITE_TRANSIENT);
     }
+  }
+}
 
-    /* Execute SQL prepared statement */
-    D2("Execute statement for insert file");
-    rc = sqlite3_step(stmt);
-    if( rc != SQLITE_DONE ){
-      N("SQL error inserting the file: %s | error: %d", sqlite3_errmsg(db), rc);
-      rc = 3;
-      goto bailout_spi;
-    }
+/*
+ * "Read-only" for SQLite, but not for us: ATTACH would open files outside sqlite_fs.location,
+ * a PRAGMA with a value (locking_mode = EXCLUSIVE, busy_timeout = 0) would reconfigure
+ * the cached handle shared with the other functions, and BEGIN or SAVEPOINT would outlive the query.
+ */
+static int
+sqlite_fs_query_authorizer(void *arg, int action, const char *a, const char *b, const char *c, const char *d)
+{
+  switch(action){
+  case SQLITE_ATTACH:
+  case SQLITE_DETACH:
+  case SQLITE_TRANSACTION:
+  case SQLITE_SAVEPOINT:
+    return SQLITE_DENY;
+  case SQLITE_PRAGMA: /* a is the pragma, b its value */
+    return (b == NULL) ? SQLITE_OK : SQLITE_DENY;
+  default:
+    return SQLITE_OK;
+  }
+}
 
-    sqlite3_reset(stmt);
-    rc = 0;
+/* Binds the arguments from the first one, the VARIADIC "any" ones or an explicit VARIADIC array */
+static void
+sqlite_fs_query_bind(FunctionCallInfo fcinfo, int first, sqlite_fs_conn *conn, sqlite3_stmt *stmt)
+{
+  int i, n = 0;
+  int rc = SQLITE_OK;
+
+  if(get_fn_expr_variadic(fcinfo->flinfo)){
+    ArrayType *array;
+    Datum *values;
+    bool *nulls;
+    Oid type;
+    int16 typlen;
+    bool typbyval;
+    char typalign;
+
+    if(PG_NARGS() <= first || PG_ARGISNULL(first))
+      return;
+    array = PG_GETARG_ARRAYTYPE_P(first);
+    type = ARR_ELEMTYPE(array);
+    get_typlenbyvalalign(type, &typlen, &typbyval, &typalign);
+    deconstruct_array(array, type, typlen, typbyval, typalign, &values, &nulls, &n);
+
+    for(i = 0; i < n && rc == SQLITE_OK; i++)
+      rc = (nulls[i]) ? sqlite3_bind_null(stmt, i + 1) : sqlite_fs_bind_datum(stmt, i + 1, type, values[i]);
+  } else {
+    n = PG_NARGS() - first;
+    for(i = 0; i < n && rc == SQLITE_OK; i++){
+      if(PG_ARGISNULL(first + i))
+	rc = sqlite3_bind_null(stmt, i + 1);
+      else
+	rc = sqlite_fs_bind_datum(stmt, i + 1, get_fn_expr_argtype(fcinfo->flinfo, first + i), PG_GETARG_DATUM(first + i));
+    }
   }
 
-bailout_spi:
+  if(rc != SQLITE_OK)
+    E("SQL error binding parameter %d: %s", i, sqlite3_errmsg(conn->db));
+  if(n != sqlite3_bind_parameter_count(stmt))
+    E("The query has %d parameter(s), got %d", sqlite3_bind_parameter_count(stmt), n);
+}
 
-  /* finish the SQL statement */
-  SPI_finish();
-  debug_query_string = NULL;
-  pgstat_report_stat(true);
-  pgstat_report_activity(STATE_IDLE, NULL);
+PG_FUNCTION_INFO_V1(pg_sqlite_fs_query);
+Datum
+pg_sqlite_fs_query(PG_FUNCTION_ARGS)
+{
+  FuncCallContext *funcctx;
+  sqlite_fs_query_state *state;
+  int rc, i;
+
+  if(SRF_IS_FIRSTCALL()){
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    MemoryContext old_cxt;
+    TupleDesc tupdesc;
+    char *db_path, *sql;
+    const char *tail = NULL;
+
+    if(PG_ARGISNULL(0) || PG_ARGISNULL(1))
+      E("Null arguments not accepted");
+
+    if(rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+      E("sqlite_fs_query called in a context that cannot accept a set");
+
+    funcctx = SRF_FIRSTCALL_INIT();
+    old_cxt = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+    if(get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+      E("A column definition list is required, eg AS t(inode bigint, name text)");
+    funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+    db_path = convert_and_check_path(PG_GETARG_TEXT_PP(0));
+    sql = text_to_cstring(PG_GETARG_TEXT_PP(1));
+
+    state = (sqlite_fs_query_state*)palloc0(sizeof(sqlite_fs_query_state));
+    state->columns = (sqlite_fs_column*)palloc(Max(tupdesc->natts, 1) * sizeof(sqlite_fs_column));
+    for(i = 0; i < tupdesc->natts; i++){
+      Form_pg_attribute att = TupleDescAttr(tupdesc, i);
+      sqlite_fs_column_init(&state->columns[i], att->atttypid, att->atttypmod);
+    }
+    funcctx->user_fctx = state;
+    MemoryContextSwitchTo(old_cxt);
+
+    state->scan.conn = sqlite_fs_conn_open(db_path, SQLITE_OPEN_READWRITE);
+    if(state->scan.conn == NULL)
+      E("SQL error opening database: %s", db_path);
+
+    sqlite3_set_authorizer(state->scan.conn->db, sqlite_fs_query_authorizer, NULL);
+    rc = sqlite3_prepare_v2(state->scan.conn->db, sql, -1, &state->scan.stmt, &tail);
+    sqlite3_set_authorizer(state->scan.conn->db, NULL, NULL);
+    if(rc != SQLITE_OK){
+      char *err = pstrdup(sqlite3_errmsg(state->scan.conn->db));
+      sqlite_fs_conn_release(state->scan.conn);
+      state->scan.conn = NULL;
+      E("SQL error preparing %s in %s: %s", sql, db_path, err);
+    }
+    state->scan.private_stmt = true;
+
+    /* from now on, released at the end of the scan or by the shutdown callback */
+    RegisterExprContextCallback(rsinfo->econtext, sqlite_fs_readdir_end, PointerGetDatum(&state->scan));
+
+    if(state->scan.stmt == NULL)
+      E("Empty query: %s", sql);
+    while(tail && isspace((unsigned char)*tail)) tail++;
+    if(tail && *tail)
+      E("Only one statement is allowed: %s", sql);
+    if(!sqlite3_stmt_readonly(state->scan.stmt))
+      E("Only read-only statements are allowed: %s", sql);
+    if(sqlite3_column_count(state->scan.stmt) != tupdesc->natts)
+      E("The query returns %d column(s), the column definition list has %d",
+	sqlite3_column_count(state->scan.stmt), tupdesc->natts);
+
+    sqlite_fs_query_bind(fcinfo, 2, state->scan.conn, state->scan.stmt);
+  }
 
+  funcctx = SRF_PERCALL_SETUP();
+  state = (sqlite_fs_query_state*)funcctx->user_fctx;
 
-close_sqlite_stmt:
+  rc = sqlite3_step(state->scan.stmt);
+  if(rc == SQLITE_ROW){
+    int natts = funcctx->tuple_desc->natts;
+    Datum *values = (Datum*)palloc(Max(natts, 1) * sizeof(Datum));
+    bool *nulls = (bool*)palloc(Max(natts, 1) * sizeof(bool));
 
-  if(stmt) sqlite3_finalize(stmt);
+    for(i = 0; i < natts; i++)
+      values[i] = sqlite_fs_column_datum(state->scan.stmt, i, &state->columns[i], &nulls[i]);
 
-  /* Close the transaction */
-  rc = sqlite3_exec(db, (rc)?"ROLLBACK;":"COMMIT;", NULL, NULL, NULL);
-  if( rc != SQLITE_OK ) {
-    N("Error closing transaction: %s", sqlite3_errmsg(db));
-    rc = 1;
-  } else
-    rc = 0; // success
-  
-close_sqlite_db:
-  sqlite3_close(db);
+    SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+  }
 
-  PG_RETURN_BOOL(((rc)?false:true));
+  if(rc != SQLITE_DONE)
+    E("SQL error running the query in %s: %s", state->scan.conn->path, sqlite3_errmsg(state->scan.conn->db));
+
+  sqlite_fs_readdir_end(PointerGetDatum(&state->scan));
+  UnregisterExprContextCallback(((ReturnSetInfo *) fcinfo->resultinfo)->econtext,
+				sqlite_fs_readdir_end, PointerGetDatum(&state->scan));
+  SRF_RETURN_DONE(funcctx);
 }